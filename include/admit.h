@@ -0,0 +1,67 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// defaults, overridable from the command line
+#define ADMIT_RATE 0            // per-user sustained requests/sec, 0 = unlimited
+#define ADMIT_BURST_X 2         // per-user bucket depth, in seconds of that rate
+#define ADMIT_MAX_DELAY_MS 50   // queue delay above which bulk work is shed
+#define ADMIT_BULK_SHARE 75     // % of its lane's slots one bulk type may hold
+
+// reasons a request was rejected with ESERV
+enum admit_reason {
+    ADMIT_OK,
+    ADMIT_RATE_LIMITED,
+    ADMIT_QUOTA,
+    ADMIT_DELAY,
+    ADMIT_FULL,
+    ADMIT_NREASONS
+};
+
+/*
+ * Token bucket, one per connection. Only touched by that connection's
+ * reader thread, so it needs no locking.
+ */
+typedef struct {
+    double tokens;
+    uint64_t last_ns;
+} tbucket_t;
+
+/*
+ * Set limits and size quotas for a job queue of n slots per lane.
+ * rate 0 disables per-user rate limiting.
+ */
+void admit_init(int n, int rate, int burst, int max_delay_ms, FILE *log);
+void tbucket_init(tbucket_t *b);
+
+/*
+ * Decide whether a request of msg_type may be queued.
+ * @return ADMIT_OK, or the reason for rejecting it
+ */
+enum admit_reason admit_check(tbucket_t *b, uint8_t msg_type);
+
+/*
+ * Bookkeeping around the job queue: admit_enqueued before a job is
+ * inserted, admit_dequeued once it is taken out or failed to go in.
+ * admit_sample_delay feeds the queue delay that admit_check sheds load
+ * on; call it only for jobs that really waited in the queue.
+ */
+void admit_enqueued(uint8_t msg_type);
+void admit_dequeued(uint8_t msg_type);
+void admit_sample_delay(uint64_t queued_ns, uint64_t now);
+
+/* Current smoothed queue delay, shed target and jobs queued */
+uint64_t admit_delay_ns(void);
+uint64_t admit_target_delay_ns(void);
+int admit_queued(void);
+
+/* Count a rejection; logs a summary at most once per second */
+void admit_reject(enum admit_reason why);
+
+/* Log totals to the audit log */
+void admit_report(void);
+
+#endif
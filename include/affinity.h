@@ -0,0 +1,35 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+
+#define AFF_MAX_NODES 8
+
+/*
+ * CPU placement for I/O (client reader and accept) threads and job
+ * threads. Each thread is pinned to the CPUs of one NUMA node within its
+ * configured set, round robin over nodes, and reports that node so the
+ * job queue can keep a connection's jobs on the node of its I/O thread.
+ * Memory a thread allocates and touches after pinning (trace buffers,
+ * per-thread pools) is then node local under the kernel's first-touch
+ * policy.
+ *
+ * With no CPU sets configured nothing is pinned and there is one node.
+ * CPU sets are lists like "0-3,8,10-11".
+ *
+ * @return 0 on success, -1 if a CPU list does not parse
+ */
+int aff_init(const char *io_cpus, const char *job_cpus, FILE *log);
+
+/* Number of job queue nodes */
+int aff_nodes(void);
+
+/*
+ * Pin the calling thread, the seq'th of its kind.
+ * @return node index in [0, aff_nodes()), -1 if the thread is not pinned
+ */
+int aff_pin_io(int seq);
+int aff_pin_job(int seq);
+void aff_pin_accept(void);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+#include <stdio.h>
+
+/*
+ * Audit log statements by level. Anything above AUDIT_LEVEL is compiled
+ * out entirely, arguments included, so a release build (make release,
+ * AUDIT=N) pays nothing for per-request chatter. Debug builds keep
+ * everything. Statements write to the a_log in scope.
+ *
+ * AUDIT_ERROR - failures and rejected input
+ * AUDIT_EVENT - server, connection and room lifecycle
+ * AUDIT_TRACE - per-request and per-frame detail
+ *
+ * Shutdown reports are not audit statements and are always written.
+ */
+#define AUDIT_ERROR 1
+#define AUDIT_EVENT 2
+#define AUDIT_TRACE 3
+
+#ifndef AUDIT_LEVEL
+#define AUDIT_LEVEL AUDIT_TRACE
+#endif
+
+#define audit(L, S, ...)                          \
+    do {                                          \
+        if ((L) <= AUDIT_LEVEL)                   \
+            fprintf(a_log, S, ##__VA_ARGS__);     \
+    } while (0)
+
+#endif /* AUDIT_H */
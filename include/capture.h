@@ -0,0 +1,43 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+#define CAPTURE_MAGIC 0x43525450 // "PTRC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_MAX_FD 65536
+#define CAPTURE_CLOSE 0xfe       // record type for a closed connection
+
+/*
+ * Capture file layout: one cap_file_hdr, then a cap_rec per incoming
+ * frame followed by its msg_len payload bytes. t_ns is relative to the
+ * start of the capture, conn_id numbers connections from 1 in accept order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_unix_ns;
+} cap_file_hdr;
+
+typedef struct {
+    uint64_t t_ns;
+    uint32_t conn_id;
+    uint32_t msg_len;
+    uint8_t msg_type;
+    uint8_t pad[7];
+} cap_rec;
+
+/*
+ * Start capturing to path.
+ * @return 0 on success, -1 if the file cannot be created
+ */
+int capture_open(const char *path);
+void capture_close(void);
+
+/* Record frames; all are no-ops unless capture_open succeeded */
+void capture_conn(int fd);
+void capture_frame(int fd, petr_header *h, const char *payload);
+void capture_disconnect(int fd);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Epoch-based reclamation for lock-free readers. A reader brackets its
+ * traversal with epoch_enter/epoch_exit and may follow any pointer it
+ * loaded inside; the only shared line it writes is its own slot.
+ * Writers stay serialised by their own lock: they unlink or replace an
+ * object, then hand it to epoch_retire, which frees it once every thread
+ * that was reading when it was retired has left its read section.
+ *
+ * The global epoch only moves from E to E+1 when no reader is still in
+ * an epoch older than E, so anything retired in E is unreachable to all
+ * readers by E+2.
+ */
+
+/* Start/end a read section; sections nest */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* Call fn(p) once no reader can still hold p */
+void epoch_retire(void *p, void (*fn)(void *));
+
+/* Wait for every read section that is open now to end; must not be called inside one */
+void epoch_synchronize(void);
+
+/* Log the epoch and how much is retired and freed */
+void epoch_report(FILE *log);
+
+#endif
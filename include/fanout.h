@@ -0,0 +1,33 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdio.h>
+#include "protocol.h"
+
+#define FANOUT_MIN 2048   // recipients below which the job thread sends alone
+#define FANOUT_CHUNK 512  // recipients per chunk claimed by a worker
+
+/*
+ * Parallel room broadcast. A job thread posts the member fd array of a
+ * large room, then claims FANOUT_CHUNK sized chunks alongside the fan-out
+ * workers until every chunk has been written. fanout() only returns once
+ * the whole room has the message, so a sender's next message can never
+ * overtake the previous one, whichever job thread handles it. A member
+ * that stops reading holds its chunk for at most the send timeout (the
+ * sndtimeo socket option), after which it is dropped.
+ *
+ * threads - fan-out workers besides the calling job thread, 0 = send serially
+ * send - writes one frame, e.g. wr_msg
+ */
+void fanout_init(int threads, int (*send)(int, petr_header *, char *), FILE *log);
+
+/*
+ * Send h/msg to every fd in fds except skip_fd.
+ * @return number of frames sent
+ */
+int fanout(const int *fds, int n, int skip_fd, petr_header *h, char *msg);
+
+/* Log broadcast counts */
+void fanout_report(void);
+
+#endif
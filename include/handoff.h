@@ -0,0 +1,73 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "linkedList.h"
+
+#define HANDOFF_MAGIC 0x50455452 // "PETR"
+#define HANDOFF_VERSION 3
+
+/*
+ * Hot upgrade: the running server passes its listening socket, every
+ * logged in client fd (SCM_RIGHTS) and the user/room state to a freshly
+ * exec'd server over a SOCK_SEQPACKET socketpair. Clients never notice
+ * the restart, so there is no reconnect storm on the login path.
+ *
+ * Wire format, one packet each:
+ *   ho_hdr                    + listen fd
+ *   ho_fd     if has_unix     + AF_UNIX listen fd
+ *   ho_user   x n_users       + that user's client fd,
+ *     ho_fd   x 3 if has_xp   + its memfd, c2s and s2c doorbells
+ *   ho_room   x n_rooms, each followed by n_members member names
+ * The receiver replies with a single ack byte once the state is rebuilt.
+ *
+ * A REQID tag a client has sent ahead of a request still unread travels
+ * in its ho_user. Parked sessions are ended first; resume tokens of live
+ * ones, mailboxes and the search index stay behind (resume.h, mailbox.h,
+ * search.h).
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_users;
+    uint32_t n_rooms;
+    uint32_t has_unix;
+} ho_hdr;
+
+typedef struct {
+    char username[STR_MAX];
+    uint32_t has_xp; // shared-memory rings follow
+    uint32_t tagged; // tag is a REQID waiting for the client's next request
+    uint32_t tag;
+} ho_user;
+
+typedef struct {
+    uint32_t which;
+} ho_fd;
+
+typedef struct {
+    char roomname[STR_MAX];
+    char owner[STR_MAX];
+    uint32_t n_members;
+} ho_room;
+
+/*
+ * Serialize state to the new process and wait for its ack.
+ * pending_tag(fd, &tag) - whether fd has a REQID tag waiting, and which
+ * @return 0 on success, -1 if the new process failed to take over
+ */
+int handoff_send(int chan, int listen_fd, int unix_fd, userlist_t *users, roomlist_t *rooms,
+                 bool (*pending_tag)(int, uint32_t *));
+
+/*
+ * Rebuild state sent by handoff_send. users and rooms must be empty.
+ * *unix_fd is the inherited AF_UNIX listener, -1 if there was none.
+ * restore_tag(fd, tag) is called for each client with a REQID waiting.
+ * On error every fd received so far is closed.
+ * @return the inherited listening socket, -1 on error
+ */
+int handoff_recv(int chan, int *unix_fd, userlist_t *users, roomlist_t *rooms,
+                 void (*restore_tag)(int, uint32_t));
+
+#endif
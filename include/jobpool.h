@@ -0,0 +1,34 @@
+#ifndef JOBPOOL_H
+#define JOBPOOL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define JOBPOOL_TICK_MS 100        // controller sampling period
+#define JOBPOOL_IDLE_MS 100        // how long a worker waits for a job before checking in
+#define JOBPOOL_SHRINK_TICKS 50    // quiet ticks (5s) before retiring a worker
+#define JOBPOOL_MAX_CPU 90         // don't grow past this process CPU utilization, %
+#define JOBPOOL_MIN_TARGET_US 1000 // queue delay worth growing for, whatever the shed target
+
+/*
+ * Adaptive job thread pool. A controller thread samples queue delay and
+ * process CPU utilization every tick and grows the pool between min and
+ * max while requests wait and CPU is available, or retires a worker after
+ * a sustained quiet period. A worker counts as busy only while it runs
+ * a job, not while it waits for buffer_lock or its turn to send: more
+ * workers would only wait too. Each worker gets its spawn sequence number
+ * as its argument. Idle workers sit in sem_timedwait on the job
+ * queue, so parking costs nothing but a wakeup per JOBPOOL_IDLE_MS.
+ */
+void jobpool_init(int min, int max, void *(*worker)(void *), FILE *log);
+void jobpool_start(void);
+
+/* Workers: bracket each job, and ask whether to exit after an idle wait */
+void jobpool_busy(void);
+void jobpool_idle(void);
+bool jobpool_retire(void);
+
+/* Log pool size and resize counts */
+void jobpool_report(void);
+
+#endif
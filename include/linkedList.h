@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "pool.h"
 
 #define INT_MODE 0
 #define STR_MODE 1
@@ -73,15 +76,51 @@ user_t* getUser(userlist_t* list, int index);
 user_t* getUserByName(userlist_t* list, char* name);
 int nameExists(userlist_t* list, char* name);
 
+/*
+ * Members of a room, kept as parallel arrays rather than a list so a
+ * broadcast walks one contiguous run of fds. Names are only read for
+ * listings and handoff.
+ *
+ * A memberlist_t is an immutable snapshot: readers get the current one
+ * from roomMembers() inside an epoch read section (epoch.h) and walk it
+ * without any lock while joins and leaves go on. A join appends past the
+ * snapshot's length and publishes a new header over the same arrays; a
+ * leave publishes a copy. Replaced headers and arrays are retired to the
+ * epoch reclaimer. Writers are still serialised by the caller.
+ *
+ * Snapshots share the name strings, so a copy costs a pointer per member
+ * rather than STR_MAX bytes; a name is allocated on join and retired on
+ * leave.
+ *
+ * version - bumped on every change to the room's membership
+ * fds - member client fds, fds[i] belongs to names[i]
+ * names - member usernames
+ * length - number of members in this snapshot
+ * cap - allocated slots in both arrays
+ */
+typedef struct memberlist {
+    uint64_t version;
+    int* fds;
+    char** names;
+    int length;
+    int cap;
+} memberlist_t;
+
+/*
+ * Rooms are linked with atomic next pointers so readers can walk the
+ * list lock-free too; removeRoom unlinks a room and retires it, leaving
+ * its next pointer intact for readers still standing on it.
+ */
 typedef struct room_node {
+    uint64_t id;            // creation order; never reused, unlike the name
     char roomname[STR_MAX];
     char owner[STR_MAX];
-    userlist_t* userlist;
-    struct room_node* next;
+    _Atomic(memberlist_t*) members;
+    _Atomic(struct room_node*) next;
 } room_t;
 
 typedef struct room_list {
-    room_t *head;
+    _Atomic(room_t*) head;
     int length;
 } roomlist_t;
 
@@ -91,6 +130,12 @@ void addUserToRoom(room_t*, user_t);
 room_t* getRoom(roomlist_t*, char*);
 int removeRoom(roomlist_t*, char*);
 int removeUserFromRoom(roomlist_t*, room_t*, user_t);
+int memberIndexByFD(room_t*, int);
+memberlist_t* roomMembers(room_t*);
 void deleteRoomList(roomlist_t*);
 
+/* Node pools behind the lists above */
+extern pool_t user_pool;
+extern pool_t room_pool;
+
 #endif
\ No newline at end of file
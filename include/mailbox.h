@@ -0,0 +1,64 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "linkedList.h"
+#include "resume.h"
+
+#define MAILBOX_KEEP_S (24 * 3600)      // users seen this recently get mail
+#define MAILBOX_MAX_BOXES 65536
+#define MAILBOX_USER_FRAMES 256         // per user quota
+#define MAILBOX_USER_BYTES (256 * 1024)
+#define MAILBOX_USER_MEM (16 * 1024)    // per user in memory; the rest spills
+#define MAILBOX_MEM_BYTES (8 << 20)     // all users in memory; the rest spills
+
+/*
+ * Mailboxes for offline DM recipients. A user who logs out, or whose
+ * parked session runs out, has a mailbox for MAILBOX_KEEP_S: USRSEND and
+ * USRMSEND to them are queued and answered OK instead of EUSRNOTFOUND,
+ * and the next LOGIN gets the queued USRRECV frames in one batch right
+ * after its OK, sent from its own client thread. DMs sent live once it is
+ * back may land among them.
+ *
+ * Mail is held in memory up to the per user and global memory limits,
+ * past them it spills to an append-only segment: a ring in an unlinked
+ * file, mmap'd, whose space is reclaimed from the oldest record once it
+ * has been delivered. Mail past a user's quota, or that neither fits in
+ * memory nor in the segment, is refused: USRSEND gets ESERV and may
+ * retry later, USRMSEND lists the user as not found. Boxes of users not
+ * back within MAILBOX_KEEP_S are dropped with their mail when space runs
+ * out.
+ *
+ * Mailboxes live in this process only and do not survive a hot upgrade.
+ */
+
+enum mail_result {
+    MAIL_QUEUED,
+    MAIL_UNKNOWN, // no mailbox: never seen, long gone, or mailboxes off
+    MAIL_FULL,    // over quota
+};
+
+/*
+ * segment_mb 0 turns mailboxes off. The segment file is made in $TMPDIR,
+ * else /var/tmp.
+ * @return 0, -1 if the segment cannot be made
+ */
+int mailbox_init(int segment_mb, FILE *log);
+
+bool mailbox_enabled(void);
+
+/* name just went offline: it gets mail from now on */
+void mailbox_seen(const char *name);
+
+/* Queue a copy of the USRRECV frame h/body for offline user name */
+enum mail_result mailbox_put(const char *name, petr_header *h, const char *body);
+
+/* Everything queued for name, oldest first; free with resume_free_frames */
+rframe_t *mailbox_take(const char *name);
+
+/* Log queued, spilled, delivered and refused counts */
+void mailbox_report(void);
+
+#endif
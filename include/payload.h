@@ -0,0 +1,16 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+
+/*
+ * Build outgoing payloads in one pass instead of repeated strcat.
+ * Output is truncated to fit size and always null terminated. msg_len is
+ * the message length scan_frame found, so it is not measured again.
+ *
+ * @return length written, not counting the null terminator
+ */
+size_t build_rmrecv(char *buf, size_t size, const char *room, const char *from, const char *msg, size_t msg_len);
+size_t build_usrrecv(char *buf, size_t size, const char *from, const char *msg, size_t msg_len);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef PETR_H
+#define PETR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * libpetr: asynchronous PETR client.
+ *
+ * A petr_conn owns one non-blocking connection. Requests are queued with
+ * petr_request and written in batches whenever the socket is writable,
+ * so any number can be in flight. With tagging on, each request is sent
+ * behind a REQID frame and its reply, which the server echoes the id in
+ * front of, completes exactly that request even if the server answers
+ * out of order; otherwise a reply completes the oldest outstanding
+ * request. RMRECV, USRRECV and RMCLOSED are not replies and go to the
+ * event callback instead.
+ *
+ * The library never blocks and owns no loop. Either drive connections
+ * with petr_poll, or plug them into your own loop: watch petr_fd for
+ * petr_events (or register a watch callback to hear when those change)
+ * and call petr_handle with whatever poll reported.
+ *
+ * Callbacks may queue requests but must not petr_close the connection
+ * they were called for.
+ */
+typedef struct petr_conn petr_conn;
+
+/*
+ * Reply or event. body is NUL terminated and valid only during the call.
+ * h is NULL if the connection failed before the reply arrived.
+ */
+typedef void (*petr_cb)(petr_conn *c, petr_header *h, char *body, void *arg);
+
+/* The poll events c wants have changed to events */
+typedef void (*petr_watch_cb)(petr_conn *c, int fd, short events, void *arg);
+
+/*
+ * Start connecting and queue LOGIN as the first request; on_login gets
+ * its reply. host is a hostname, or an AF_UNIX socket path if it starts
+ * with '/', in which case port is ignored.
+ * @return the connection, NULL if it could not be started
+ */
+petr_conn *petr_connect(const char *host, const char *port, const char *name,
+                        petr_cb on_login, void *arg);
+
+/*
+ * petr_connect, resuming a dropped session: LOGIN "name\r\ntoken" with the
+ * token from the body of an earlier LOGIN reply. on_login gets OK with
+ * "token\r\nrooms rejoined" if the server resumed it, followed by the
+ * events held for it, or OK with just a new token if it logged in afresh.
+ */
+petr_conn *petr_resume(const char *host, const char *port, const char *name,
+                       const char *token, petr_cb on_login, void *arg);
+
+void petr_set_event_cb(petr_conn *c, petr_cb cb, void *arg);
+void petr_set_watch(petr_conn *c, petr_watch_cb cb, void *arg);
+
+/* Tag requests queued from now on with REQID (LOGIN never is) */
+void petr_set_tagging(petr_conn *c, int on);
+
+/*
+ * Queue a request. body is sent as is (len bytes, NUL included if the
+ * message type wants one); petr_request_str sends a C string with its
+ * terminator, or an empty body for NULL.
+ * @return 0, or -1 if the connection is closed
+ */
+int petr_request(petr_conn *c, uint8_t type, const void *body, uint32_t len,
+                 petr_cb cb, void *arg);
+int petr_request_str(petr_conn *c, uint8_t type, const char *body, petr_cb cb, void *arg);
+
+/* Half close once everything queued is written; replies still arrive */
+void petr_shutdown(petr_conn *c);
+
+/* Write as much queued output as the socket takes. @return -1 on error */
+int petr_flush(petr_conn *c);
+
+int petr_fd(petr_conn *c);
+short petr_events(petr_conn *c);
+size_t petr_pending(petr_conn *c); // requests awaiting a reply
+int petr_closed(petr_conn *c);     // connection failed or peer closed
+
+/*
+ * Act on poll results for petr_fd: finish connecting, read and dispatch
+ * every complete frame, write queued output.
+ * @return 0, or -1 once the connection is closed
+ */
+int petr_handle(petr_conn *c, short revents);
+
+/* Fail outstanding requests, close and free c */
+void petr_close(petr_conn *c);
+
+/*
+ * Built-in loop: poll every open connection in conns once, waiting up to
+ * timeout_ms, and handle what is ready. Closed connections are skipped.
+ * @return number of connections still open
+ */
+int petr_poll(petr_conn **conns, int n, int timeout_ms);
+
+#endif
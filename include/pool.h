@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define POOL_SLAB_OBJS 256 // objects carved from each slab allocation
+#define POOL_BATCH 32      // objects moved between a thread and the pool at once
+#define POOL_MAX_TYPES 8   // pools with per-thread caches; later ones go to malloc
+
+/*
+ * Fixed-size object pool. Objects come from contiguous slabs and are
+ * never returned to malloc. Each thread keeps a free list per pool and
+ * only takes the pool lock to move POOL_BATCH objects in or out, so
+ * login/logout and room churn stay off the allocator's arenas. A thread's
+ * cached objects go back to the pool when it exits. Alloc and free counts
+ * are kept per thread and summed by pool_report, which takes no locks.
+ *
+ * Define pools statically:
+ *   pool_t user_pool = POOL_INIT("user_t", sizeof(user_t));
+ */
+typedef struct pool_obj {
+    struct pool_obj *next;
+} pool_obj;
+
+typedef struct {
+    const char *name;
+    size_t size;
+    pthread_mutex_t lock;
+    pool_obj *free;     // shared free list, under lock
+    size_t n_free;
+    atomic_int id;      // 1 + cache slot; 0 until first use, -1 for none
+    atomic_ulong slabs;
+    atomic_ulong allocs; // by threads past POOL_MAX_TYPES pools only
+    atomic_ulong frees;
+    atomic_ulong refills; // batches taken from the shared list or a new slab
+} pool_t;
+
+#define POOL_INIT(n, sz) { .name = (n), .lock = PTHREAD_MUTEX_INITIALIZER, \
+    .size = (sz) < sizeof(pool_obj) ? sizeof(pool_obj) : (sz) }
+
+void *pool_alloc(pool_t *p);
+void pool_free(pool_t *p, void *obj);
+
+/* Log slabs, live objects and how often threads had to refill */
+void pool_report(pool_t *p, FILE *log);
+
+#endif
@@ -8,6 +8,8 @@ enum msg_types {
     OK,
     LOGIN = 0x10,
     LOGOUT,
+    XPSHM,      // switch to shared-memory rings (AF_UNIX only), see transport.h
+    REQID,      // 4 byte request id; tags the next request and is echoed before its reply
     EUSREXISTS = 0x1a,
     RMCREATE = 0x20,
     RMDELETE,
@@ -17,6 +19,7 @@ enum msg_types {
     RMLEAVE,
     RMSEND,
     RMRECV,
+    RMSEARCH,   // "room\r\nwords[\r\ncursor]", replies "next cursor\nid from: message\n...", see search.h
     ERMEXISTS = 0x2a,
     ERMFULL,
     ERMNOTFOUND,
@@ -24,6 +27,7 @@ enum msg_types {
     USRSEND = 0x30,
     USRRECV,
     USRLIST,
+    USRMSEND,   // "user1\nuser2\n...\r\nmessage", one USRRECV per recipient
     EUSRNOTFOUND = 0x3a,
     ESERV = 0xff
 };
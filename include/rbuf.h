@@ -0,0 +1,47 @@
+#ifndef RBUF_H
+#define RBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RBUF_SIZE 65536
+
+/*
+ * Reusable read buffer. Data is read from the fd in large chunks and
+ * split in place; tokens returned by rbuf_next point into buf and stay
+ * valid until the next rbuf_fill.
+ *
+ * buf - backing storage, grows if a single token does not fit
+ * start - first unconsumed byte
+ * end - one past the last byte read
+ */
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+} rbuf_t;
+
+void rbuf_init(rbuf_t *rb, size_t cap);
+void rbuf_free(rbuf_t *rb);
+
+/*
+ * Read whatever is available from fd with a single read().
+ * @return bytes read, 0 on EOF, -1 on error
+ */
+ssize_t rbuf_fill(rbuf_t *rb, int fd);
+
+/*
+ * Next token ending in delim (delimiter included), without copying.
+ * @return pointer into the buffer, or NULL if no complete token is buffered
+ */
+char *rbuf_next(rbuf_t *rb, int delim, size_t *len);
+
+/*
+ * Next "from\n" + "msg\0" pair as sent to petr_chat; consumes nothing
+ * unless both halves are buffered.
+ * @return 1 if a message was returned, 0 if more data is needed
+ */
+int rbuf_next_msg(rbuf_t *rb, char **from, size_t *from_len, char **msg, size_t *msg_len);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "linkedList.h"
+#include "protocol.h"
+
+#define RESUME_TOKEN_LEN 32          // hex digits, 128 random bits
+#define RESUME_MAX_FRAMES 256        // frames held for a parked session
+#define RESUME_MAX_BYTES (64 * 1024) // and their bodies; more are dropped
+#define RESUME_TAKEOVER_MS 1000      // wait for a replaced connection to park
+
+/*
+ * Session resume tokens, off unless a grace period is set; then every
+ * LOGIN is answered OK with a token. When a connection drops without
+ * LOGOUT the session is parked for the grace period instead of being
+ * logged out: the user leaves its rooms and the userlist, but room and
+ * user messages meant for it are buffered here, and the rooms it owns
+ * stay open. LOGIN "name\r\ntoken" within the grace period claims the
+ * session: the server rejoins its rooms, replies OK with a new token and
+ * the rejoined rooms, "token\r\nroom1\nroom2\n...", and delivers the
+ * buffered frames. A token for a connection that has not been reaped yet
+ * takes it over. A LOGIN without a token for a parked name ends the
+ * session, as a logout would have, and starts afresh. Sessions that run
+ * out are ended by the accept loop, woken through resume_doorbell.
+ *
+ * Room messages are buffered by membership version: those sent on a
+ * snapshot taken after the user left a room and before it rejoined. So
+ * nothing sent during the outage is lost or doubled, but live messages
+ * may interleave with the buffered ones while the claim completes.
+ *
+ * Parked sessions are ended before a hot upgrade; tokens of live ones do
+ * not survive it, and those users log out as before when they drop.
+ */
+
+/* A buffered frame, oldest first */
+typedef struct rframe {
+    struct rframe *next;
+    petr_header h;
+    char body[];
+} rframe_t;
+
+/* grace_s 0 turns sessions off: LOGIN replies carry no token */
+void resume_init(int grace_s, FILE *log);
+
+bool resume_enabled(void);
+
+/* eventfd that turns readable when sessions have expired, -1 if off */
+int resume_doorbell(void);
+
+/* Start a live session for a fresh login; false if off */
+bool resume_open(const char *name, char token[RESUME_TOKEN_LEN + 1]);
+
+/* name logged out */
+void resume_close(const char *name);
+
+/* Is name's session live under token */
+bool resume_live(const char *name, const char *token);
+
+/*
+ * Park name's live session after its connection dropped. It owns rooms
+ * (n names) from now on; left[i] is the version of rooms[i] without name.
+ * @return false if name had no live session
+ */
+bool resume_park(const char *name, char (*rooms)[STR_MAX], uint64_t *left, int n);
+
+/*
+ * Claim name's parked session with token, which is replaced by a new one.
+ * *rooms are the rooms to rejoin (closed ones are ""), valid until
+ * resume_finish; report each with resume_rejoined before adding name back.
+ * @return number of rooms, -1 if not parked or the token is wrong
+ */
+int resume_claim(const char *name, char token[RESUME_TOKEN_LEN + 1], char (**rooms)[STR_MAX]);
+void resume_rejoined(const char *name, int i, uint64_t version);
+
+/* Frames buffered so far for a claimed session */
+rframe_t *resume_take(const char *name);
+
+/* Make a claimed session live again; @return frames buffered since resume_take */
+rframe_t *resume_finish(const char *name);
+
+void resume_free_frames(rframe_t *f);
+
+/* End name's parked session now; true if it had one */
+bool resume_evict(const char *name);
+
+/* Pop the next expired session into name; false if there is none */
+bool resume_expired(char name[STR_MAX]);
+
+/* Expire every parked session at once */
+void resume_expire_all(void);
+
+/*
+ * Buffer a frame for a parked user / for parked users who were in room
+ * when a snapshot of version was taken. RMCLOSED also forgets the room.
+ * @return resume_buffer_user: true if name is parked
+ */
+bool resume_buffer_user(const char *name, petr_header *h, const char *body);
+void resume_buffer_room(const char *room, uint64_t version, petr_header *h, const char *body);
+
+/* Log parked, resumed, expired and dropped counts */
+void resume_report(void);
+
+#endif
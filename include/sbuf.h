@@ -2,10 +2,12 @@
 #define SBUF_H
 
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include "protocol.h"
 #include "server.h"
 #include "linkedList.h"
+#include "scan.h"
 
 // P -> semwait
 // V -> sem_post
@@ -14,22 +16,57 @@
 typedef struct {
     user_t user;
     petr_header header;
+    uint64_t t_enq; // monotonic ns when queued, for queue delay
+    uint32_t trace_id; // nonzero if this request is sampled for tracing
+    int node;       // NUMA node of the connection's I/O thread
+    bool tagged;    // preceded by REQID; reply is tagged with reqid
+    uint32_t reqid;
+    uint32_t ticket;  // RMSEND order on its connection
+    fields_t fields;  // msg split into its fields, see scan.h
     char msg[BUFFER_SIZE];
 } j_msg;
 
+// priority lanes: control requests are not stuck behind broadcast traffic
+enum sbuf_lanes {
+    LANE_CONTROL,  // RMCREATE, RMJOIN, RMLEAVE, RMLIST, USRLIST, ...
+    LANE_BULK,     // RMSEND, USRSEND, USRMSEND
+    SBUF_LANES
+};
+#define LANE_CONTROL_WEIGHT 4   // control jobs dequeued per bulk job under load
+#define LANE_BULK_WEIGHT 1
+#define SBUF_HIST_BUCKETS 24    // log2(us) queue time buckets, last is open ended
+
 typedef struct {
     j_msg *buf;
     int n;
     int front;
     int rear;
-    sem_t mutex;
+    int weight;  // dequeues per round
+    int credit;  // dequeues left this round
     sem_t slots;
-    sem_t items;
+    atomic_ulong hist[SBUF_HIST_BUCKETS]; // queue time histogram; written under mutex, read without
+} sbuf_lane_t;
+
+/*
+ * One set of lanes per NUMA node. Jobs are queued on their connection's
+ * node and job threads serve their own node first, stealing from other
+ * nodes only when theirs is empty.
+ */
+typedef struct {
+    sbuf_lane_t *lane; // nodes * SBUF_LANES, node major
+    int *cur;          // lane currently being served, per node
+    int nodes;
+    sem_t mutex;
+    sem_t items;       // items across all lanes
 } sbuf_t;
 
-void sbuf_init(sbuf_t *sp, int n);
+int sbuf_lane(uint8_t msg_type);
+void sbuf_init(sbuf_t *sp, int n, int nodes);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, j_msg item);
+int sbuf_tryinsert(sbuf_t *sp, j_msg *item);
 j_msg sbuf_remove(sbuf_t *sp);
+int sbuf_remove_timed(sbuf_t *sp, j_msg *item, int timeout_ms, int node);
+void sbuf_report(sbuf_t *sp, FILE *out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_FIELDS 3
+
+/*
+ * Request payload validation and field splitting, in one pass.
+ *
+ * Text payloads are fields separated by "\r\n" and end in a NUL that
+ * msg_len counts. scan_frame checks a payload against the shape its
+ * message type expects and splits it in place: each "\r" becomes the
+ * terminator of its field, so handlers get NUL terminated fields and
+ * their lengths without calling strtok or strlen. A payload is malformed
+ * if it holds a NUL before its end, a "\r" not followed by "\n", the
+ * wrong number of fields, or an empty or over-long name field.
+ *
+ * The delimiter search compares 32 (AVX2) or 16 (SSE2) bytes at a time
+ * against '\r' and '\0' and only looks at the bytes that hit; the best
+ * the CPU supports is picked by scan_use, else libc's strnlen and memchr.
+ *
+ * Message types without a text payload (RMLIST, USRLIST, LOGOUT, REQID,
+ * XPSHM, ...) pass unchecked with no fields.
+ */
+typedef struct {
+    uint16_t off[SCAN_MAX_FIELDS]; // field starts in the payload
+    uint16_t len[SCAN_MAX_FIELDS];
+    uint8_t n;
+} fields_t;
+
+/*
+ * Validate and split buf, the len byte payload of a msg_type frame. A
+ * payload missing its final NUL gets one at buf[len] if cap allows.
+ * @return number of fields, -1 if malformed
+ */
+int scan_frame(uint8_t msg_type, char *buf, size_t len, size_t cap, fields_t *f);
+
+/*
+ * Split without a shape: up to max fields, -1 if malformed or there are
+ * more. For tools and benches; scan_frame is this plus the shape checks.
+ */
+int scan_fields(char *buf, size_t len, size_t cap, fields_t *f, int max);
+
+/*
+ * Pick the delimiter search: "avx2", "sse2", "scalar", or NULL for the
+ * best this CPU supports.
+ * @return 0, or -1 if the CPU or build lacks it
+ */
+int scan_use(const char *impl);
+
+/* Name of the delimiter search in use */
+const char *scan_impl(void);
+
+#endif
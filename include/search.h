@@ -0,0 +1,71 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SEARCH_PAGE 20          // hits per RMSEARCH reply
+#define SEARCH_MAX_TERMS 8      // query words past this are ignored
+#define SEARCH_MIN_WORD 2       // shorter words are not indexed
+#define SEARCH_MAX_WORD 32      // longer words are cut to this
+#define SEARCH_QUEUE 4096       // messages waiting for the indexer before new ones are dropped
+#define SEARCH_BODY_MAX 32768   // reply buffer; a page that does not fit is cut short
+
+/*
+ * Inverted index over recent room messages, for RMSEARCH.
+ *
+ * roomSend hands each delivered message to search_submit, which copies it
+ * onto a queue and returns. One indexer thread splits it into words
+ * (lowercased runs of letters and digits) and appends the message id to
+ * each word's postings in that room. Rooms are known by their room_t id,
+ * not their name, so a room deleted and created again under the same
+ * name starts with an empty history. Nothing is indexed on the broadcast
+ * path; if the indexer falls SEARCH_QUEUE messages behind, new messages
+ * are left out of the index rather than holding up the sender.
+ *
+ * Memory is bounded: messages, postings and the word table count against
+ * the budget, and the oldest messages are evicted, postings and all, once
+ * it is exceeded. Ids only grow, so postings are sorted and evicting the
+ * oldest message only ever pops the front of its words' lists. A query
+ * ANDs its words and walks the shortest list from newest to oldest.
+ *
+ * Results lag sends by however far behind the indexer is. The index is
+ * not carried across a hot upgrade.
+ */
+
+/* Start the indexer with a budget in bytes; 0 leaves search off */
+void search_init(size_t budget, FILE *log);
+
+bool search_enabled(void);
+
+/* Queue a delivered message of room (its room_t id) for indexing; false if it was dropped */
+bool search_submit(uint64_t room, const char *from, const char *msg);
+
+/*
+ * Forget a deleted room, after any of its messages already queued. A
+ * message submitted after this, by a send that raced the delete, is
+ * indexed under the dead id where no query looks, and ages out.
+ */
+void search_drop_room(uint64_t room);
+
+/*
+ * Find messages in room containing every word of query, newest first,
+ * with ids below cursor (0 = start from the newest). Writes an RMSEARCH
+ * body to buf: the cursor for the next page on the first line (0 if there
+ * is none), then one "id from: message" line per hit.
+ * @return body length, not counting the null terminator
+ */
+size_t search_query(uint64_t room, const char *query, uint64_t cursor, char *buf, size_t size);
+
+/* Wait until everything submitted so far has been indexed */
+void search_flush(void);
+
+/* Bytes counted against the budget */
+size_t search_bytes(void);
+
+/* Log index size, drops, evictions and query latency */
+void search_report(void);
+
+#endif
@@ -15,6 +15,24 @@
 #define BUFFER_SIZE 1024
 #define SA struct sockaddr
 
-void run_server(int server_port, int j_threads);
+typedef struct {
+    int port;
+    int j_threads;    // job threads at startup, pool minimum
+    int j_max;        // job pool maximum
+    int handoff_fd;   // hot upgrade channel, -1 for a fresh start
+    int rate;         // per-user request rate limit, 0 = off
+    int max_delay_ms; // queue delay target for load shedding
+    char *io_cpus;    // CPU list for I/O threads, NULL = unpinned
+    char *job_cpus;   // CPU list for job threads, NULL = unpinned
+    int fanout;       // room broadcast workers, -1 = one per spare CPU
+    int idle_s;       // idle client timeout, 0 = off
+    int heartbeat_s;  // liveness check period, 0 = off
+    int login_ms;     // deadline for LOGIN after accept
+    int search_mb;    // room message search index budget, 0 = off
+    int grace_s;      // how long a dropped session stays resumable, 0 = off
+    int mailbox_mb;   // offline DM spill segment size, 0 = mailboxes off
+} server_config;
+
+void run_server(server_config *cfg);
 
 #endif
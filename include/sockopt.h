@@ -0,0 +1,46 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Per-connection socket tuning, set with -o as a comma separated list:
+ *
+ *   nodelay[=0|1]  TCP_NODELAY, default on; replies are coalesced by
+ *                  corking instead of by Nagle's delay
+ *   sndbuf=BYTES   SO_SNDBUF, default kernel autotuning
+ *   rcvbuf=BYTES   SO_RCVBUF, default kernel autotuning
+ *   busypoll=US    SO_BUSY_POLL, default off; may need CAP_NET_ADMIN
+ *   sndtimeo=MS    SO_SNDTIMEO, default SOCKOPT_SNDTIMEO_MS; a write that
+ *                  blocks this long drops the client (0 = wait forever)
+ *
+ * TCP-only options are skipped on AF_UNIX connections.
+ *
+ * A client thread that finds more input waiting after a frame corks the
+ * socket (TCP_CORK) so the replies to a pipelined batch, its own and the
+ * job threads', leave in full segments. Once the input is drained the
+ * socket is uncorked by whichever comes last: the client thread, or the
+ * job thread that finishes the connection's last queued request.
+ */
+
+#define SOCKOPT_SNDTIMEO_MS 2000
+
+/* Parse a -o spec into the options applied to new connections; -1 if invalid */
+int sockopt_parse(char *spec);
+
+void sockopt_init(FILE *log);
+
+/* Apply the configured options to a connected socket */
+void sockopt_apply(int fd);
+
+bool sockopt_is_tcp(int fd);
+
+/* Hold back partial segments on fd / flush them; frames is the batch size */
+void sockopt_cork(int fd);
+void sockopt_uncork(int fd, int frames);
+
+/* Log corked batches and the options in use */
+void sockopt_report(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TIMER_TICK_MS 10   // wheel resolution
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6  // 64 slots per level, ~46h range at 10ms ticks
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/*
+ * Hierarchical timing wheel. Timers are intrusive list nodes, so insert
+ * and cancel are O(1) and allocation free; a timer lives in whatever
+ * struct owns it, e.g. a client thread's stack. One thread advances the
+ * wheel every tick, cascading outer levels down as their slot comes due,
+ * and runs everything that expired in that tick as one batch, outside the
+ * wheel lock.
+ *
+ * Callbacks run on the wheel thread and must not block. A callback may
+ * re-add its own timer. Any other thread may only re-add a timer once
+ * timer_cancel_sync has returned for it.
+ */
+typedef struct wtimer {
+    struct wtimer *next;
+    struct wtimer *prev;
+    uint64_t expires;        // tick
+    void (*fn)(void *arg);
+    void *arg;
+} wtimer_t;
+
+/* Start the wheel thread */
+void timer_start(FILE *log);
+
+/* Arm t to call fn(arg) in ms milliseconds. t must not be pending. */
+void timer_add(wtimer_t *t, uint32_t ms, void (*fn)(void *), void *arg);
+
+/*
+ * Disarm t. timer_cancel returns at once; timer_cancel_sync also waits for
+ * a callback already running in the current batch, and disarms t again if
+ * that callback re-added it, so the caller may free t and whatever the
+ * callback uses.
+ * @return true if t was pending
+ */
+bool timer_cancel(wtimer_t *t);
+bool timer_cancel_sync(wtimer_t *t);
+
+/* Log armed and expired counts */
+void timer_report(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_BUF_EVENTS 65536 // per buffer; recording stops when full
+
+// stages a sampled request is stamped at
+enum trace_stage {
+    TR_LOCK_WAIT,  // reader waiting for buffer_lock
+    TR_READ,       // reading the frame off the socket
+    TR_QUEUE,      // sitting in j_buf
+    TR_JOB_LOCK,   // job thread waiting for buffer_lock
+    TR_HANDLE,     // running the handler
+    TR_WRITE,      // one frame write inside the handler
+    TR_NSTAGES
+};
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint32_t id;      // request id, shared by all stages of one request
+    uint8_t stage;
+    uint8_t msg_type;
+} trace_ev;
+
+/*
+ * Trace one in every sample_every requests (0 disables tracing) and
+ * write Chrome trace-event JSON to path on trace_export.
+ */
+void trace_init(int sample_every, const char *path);
+
+/* Request id for a new frame, 0 if it is not sampled */
+uint32_t trace_sample(void);
+
+/* Record a stage in the calling thread's buffer; no-op for id 0 */
+void trace_event(uint32_t id, uint8_t stage, uint8_t msg_type, uint64_t start_ns, uint64_t end_ns);
+
+/* Request the calling job thread is handling, for TR_WRITE events */
+void trace_set_current(uint32_t id, uint8_t msg_type);
+void trace_write(uint64_t start_ns, uint64_t end_ns);
+
+/* Dump every thread's events as Chrome trace JSON (chrome://tracing, Perfetto) */
+void trace_export(void);
+
+#endif
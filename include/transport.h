@@ -0,0 +1,84 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "protocol.h"
+
+#define XP_RING_SIZE (1 << 20) // bytes per direction, power of two
+
+/*
+ * Shared-memory transport for clients on the same host. After LOGIN on
+ * the AF_UNIX listener a client may send XPSHM; the reply carries three
+ * fds (SCM_RIGHTS): a memfd holding an xp_shm, and eventfd doorbells for
+ * the c2s and s2c rings. From then on the server writes frames to s2c
+ * and also reads them from c2s; the socket stays open and its EOF still
+ * ends the session.
+ *
+ * Each ring is single producer, single consumer. Frames are a
+ * petr_header followed by msg_len bytes, wrapping at XP_RING_SIZE.
+ * head and tail are free running byte offsets. A consumer about to sleep
+ * sets waiting and rechecks tail; a producer that publishes a frame and
+ * finds waiting set clears it and rings the doorbell. A client that lets
+ * s2c fill up is dropped at once rather than waited for.
+ */
+typedef struct {
+    _Atomic uint32_t head; // consumer position
+    char pad1[60];
+    _Atomic uint32_t tail; // producer position
+    char pad2[60];
+    _Atomic uint32_t waiting; // consumer sleeps on the doorbell
+    char pad3[60];
+    char data[XP_RING_SIZE];
+} xp_ring;
+
+typedef struct {
+    xp_ring c2s;
+    xp_ring s2c;
+} xp_shm;
+
+/* Size the per-fd tables (rings, write locks) from RLIMIT_NOFILE */
+void xp_init(FILE *log);
+
+/*
+ * Answer XPSHM on fd: create the rings and doorbells, send them back and
+ * switch fd's writes to the ring. Only AF_UNIX sockets can carry the fds.
+ * @return 0 on success, -1 if fd stays on the socket
+ */
+int xp_negotiate(int fd);
+
+/* Adopt rings inherited over a hot upgrade */
+int xp_attach(int fd, int memfd, int c2s_bell, int s2c_bell);
+
+/* memfd and doorbells of fd, for a hot upgrade. @return -1 if fd has none */
+int xp_fds(int fd, int fds[3]);
+
+/* Drop fd's rings; fd must have no writer running and no job still queued */
+void xp_detach(int fd);
+
+/*
+ * Write one frame to fd, through its ring if it has one. Writers to the
+ * same fd are serialised per fd, so room broadcasts running outside
+ * buffer_lock cannot interleave their frames with a reply.
+ */
+int xp_write(int fd, petr_header *h, char *msg);
+
+/* Write n frames back to back, with no other writer's frame in between */
+int xp_write_frames(int fd, petr_header *h, char **msg, int n);
+
+/* Doorbell to poll for incoming ring frames, -1 if fd has no rings */
+int xp_doorbell(int fd);
+
+/*
+ * Whether a frame is waiting in fd's c2s ring. If not, the ring is armed
+ * so the next frame rings the doorbell.
+ */
+bool xp_pending(int fd);
+
+/* Read one frame from fd's c2s ring. @return 0, or -1 if it does not fit */
+int xp_read(int fd, petr_header *h, char *buf, size_t size);
+
+#endif
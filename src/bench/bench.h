@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// population sizes every data structure bench runs at
+static const int bench_sizes[] = { 10, 100, 1000, 10000 };
+#define BENCH_NSIZES (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Iterations for an O(n) op at population n, so each run takes similar time */
+static inline long bench_iters(int n)
+{
+    long iters = 20000000L / (n > 0 ? n : 1);
+    return iters < 1000 ? 1000 : iters > 1000000 ? 1000000 : iters;
+}
+
+/* Emit one JSON result line: bench, op, population n, iterations, time */
+static inline void bench_result(const char *bench, const char *op, long n, long iters, double sec)
+{
+    printf("{\"bench\": \"%s\", \"op\": \"%s\", \"n\": %ld, \"iters\": %ld, "
+           "\"sec\": %.6f, \"ns_per_op\": %.1f}\n",
+           bench, op, n, iters, sec, sec * 1e9 / iters);
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Pinned vs unpinned job handoff: producer/consumer pairs pass full
+ * j_msg payloads through sbuf_t, the way client threads hand jobs to job
+ * threads. Pinned runs place each pair on one NUMA node and route the
+ * job through that node's lanes, as petr_server does with -p/-P.
+ */
+#include "affinity.h"
+#include "bench.h"
+#include "sbuf.h"
+#include <pthread.h>
+#include <string.h>
+
+#define N_ITEMS 200000
+#define N_SLOTS 16
+
+static sbuf_t sb;
+static long per_thread;
+
+static void *producer(void *arg)
+{
+    int node = aff_pin_io((intptr_t)arg);
+    j_msg m = { .header = { .msg_len = BUFFER_SIZE, .msg_type = RMSEND }, .node = node };
+    for (long i = 0; i < per_thread; ++i) {
+        memset(m.msg, (int)i, sizeof(m.msg)); // build the payload on this core
+        sbuf_insert(&sb, m);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    int node = aff_pin_job((intptr_t)arg);
+    volatile unsigned long sink = 0;
+    j_msg m;
+    for (long i = 0; i < per_thread; ++i) {
+        sbuf_remove_timed(&sb, &m, 1000, node);
+        for (int j = 0; j < BUFFER_SIZE; j += 64) // read it on the other
+            sink += m.msg[j];
+    }
+    return NULL;
+}
+
+static void run(const char *mode, int pairs)
+{
+    pthread_t p[pairs], c[pairs];
+    per_thread = N_ITEMS / pairs;
+    sbuf_init(&sb, N_SLOTS, aff_nodes());
+
+    double t = bench_now();
+    for (intptr_t i = 0; i < pairs; ++i) {
+        pthread_create(&p[i], NULL, producer, (void *)i);
+        pthread_create(&c[i], NULL, consumer, (void *)i);
+    }
+    for (int i = 0; i < pairs; ++i) {
+        pthread_join(p[i], NULL);
+        pthread_join(c[i], NULL);
+    }
+    bench_result("affinity", mode, pairs, per_thread * pairs, bench_now() - t);
+
+    sbuf_deinit(&sb);
+}
+
+int main(int argc, char *argv[])
+{
+    int pairs[] = { 1, 2, 4 };
+
+    for (int i = 0; i < 3; ++i)
+        run("unpinned", pairs[i]);
+
+    // every online CPU, for both kinds of thread
+    char cpus[1024] = "0";
+    FILE *f = fopen("/sys/devices/system/cpu/online", "r");
+    if (f) {
+        if (fgets(cpus, sizeof(cpus), f))
+            cpus[strcspn(cpus, "\n")] = '\0';
+        fclose(f);
+    }
+    FILE *log = fopen("/dev/null", "w");
+    if (aff_init(cpus, cpus, log) < 0)
+        return 1;
+
+    for (int i = 0; i < 3; ++i)
+        run("pinned", pairs[i]);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Room broadcast throughput by fan-out worker count. Every member fd is
+ * /dev/null, so each frame costs the one writev the server makes and
+ * nothing else; the rate should grow with workers up to the core count.
+ * Each worker count runs in its own process since fanout_init is once only.
+ */
+#include "bench.h"
+#include "fanout.h"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define N_MEMBERS 50000
+#define N_BCASTS 20
+
+static int send_null(int fd, petr_header *h, char *msg)
+{
+    struct iovec iov[2] = {
+        { .iov_base = h, .iov_len = sizeof(*h) },
+        { .iov_base = msg, .iov_len = h->msg_len },
+    };
+    return writev(fd, iov, 2) < 0 ? -1 : 0;
+}
+
+static void run(int workers)
+{
+    int null_fd = open("/dev/null", O_WRONLY);
+    int *fds = malloc(N_MEMBERS * sizeof(int));
+    for (int i = 0; i < N_MEMBERS; ++i)
+        fds[i] = null_fd;
+    char msg[] = "room\r\nsender\r\nhello everyone";
+    petr_header h = { .msg_len = sizeof(msg), .msg_type = RMRECV };
+
+    fanout_init(workers, send_null, NULL);
+
+    char op[32];
+    snprintf(op, sizeof(op), "workers=%d", workers);
+    double t = bench_now();
+    for (int i = 0; i < N_BCASTS; ++i)
+        fanout(fds, N_MEMBERS, -1, &h, msg);
+    bench_result("fanout", op, N_MEMBERS, (long)N_BCASTS * N_MEMBERS, bench_now() - t);
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = { 0, 1, 3, 7, 15 };
+
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(counts[i]);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
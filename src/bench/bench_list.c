@@ -0,0 +1,81 @@
+/*
+ * linkedList.c operations at several population sizes.
+ */
+#include "bench.h"
+#include "linkedList.h"
+#include <string.h>
+
+static void fill(userlist_t *list, int n)
+{
+    char name[STR_MAX];
+    for (int i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "user%d", i);
+        addUser(list, name, i + 3);
+    }
+}
+
+static void bench_users(int n)
+{
+    userlist_t list = { .head = NULL, .length = 0 };
+    char name[STR_MAX];
+    long iters = bench_iters(n);
+    volatile long sink = 0;
+
+    double t = bench_now();
+    fill(&list, n);
+    bench_result("list", "addUser", n, n, bench_now() - t);
+
+    t = bench_now();
+    for (long i = 0; i < iters; ++i) {
+        snprintf(name, sizeof(name), "user%ld", (i * 7919) % n);
+        sink += getUserByName(&list, name) != NULL;
+    }
+    bench_result("list", "getUserByName", n, iters, bench_now() - t);
+
+    t = bench_now();
+    for (long i = 0; i < iters; ++i)
+        sink += getIndexByFD(&list, (i * 7919) % n + 3);
+    bench_result("list", "getIndexByFD", n, iters, bench_now() - t);
+
+    // remove from the middle and put it back so the population holds
+    t = bench_now();
+    for (long i = 0; i < iters; ++i) {
+        removeByIndex(&list, (i * 7919) % n);
+        addUser(&list, "again", 0);
+    }
+    bench_result("list", "removeByIndex+addUser", n, iters, bench_now() - t);
+
+    deleteUserList(&list);
+}
+
+static void bench_rooms(int n)
+{
+    roomlist_t rooms = { .head = NULL, .length = 0 };
+    user_t owner = { .username = "owner", .user_fd = 3 };
+    char name[STR_MAX];
+    long iters = bench_iters(n);
+    volatile long sink = 0;
+
+    for (int i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "room%d", i);
+        addRoom(&rooms, name, owner);
+    }
+
+    double t = bench_now();
+    for (long i = 0; i < iters; ++i) {
+        snprintf(name, sizeof(name), "room%ld", (i * 7919) % n);
+        sink += getRoom(&rooms, name) != NULL;
+    }
+    bench_result("list", "getRoom", n, iters, bench_now() - t);
+
+    deleteRoomList(&rooms);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 0; i < BENCH_NSIZES; ++i) {
+        bench_users(bench_sizes[i]);
+        bench_rooms(bench_sizes[i]);
+    }
+    return 0;
+}
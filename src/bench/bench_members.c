@@ -0,0 +1,113 @@
+/*
+ * Room broadcast readers against membership churn: reader threads walk
+ * every fd of a room of n members, as roomSend does, while one writer
+ * thread keeps joining and leaving it. Compares readers behind a
+ * pthread rwlock with lock-free readers on epoch-protected snapshots
+ * (writers serialised by a mutex either way). Reports ns per walk, and
+ * ns per join and leave of the writer alone, which copies the snapshot.
+ */
+#include "bench.h"
+#include "epoch.h"
+#include "linkedList.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define N_READERS 3
+
+static roomlist_t list = { .head = NULL, .length = 0 };
+static room_t *room;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t wlock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool stop;
+static int use_epoch;
+static long walks;
+
+static void *reader(void *arg)
+{
+    long sum = 0;
+    for (long i = 0; i < walks; ++i) {
+        if (use_epoch)
+            epoch_enter();
+        else
+            pthread_rwlock_rdlock(&rwlock);
+        memberlist_t *m = roomMembers(room);
+        for (int k = 0; k < m->length; ++k)
+            sum += m->fds[k];
+        if (use_epoch)
+            epoch_exit();
+        else
+            pthread_rwlock_unlock(&rwlock);
+    }
+    return (void *)sum;
+}
+
+static void *writer(void *arg)
+{
+    user_t u = { .username = "churn", .user_fd = -1 };
+    while (!atomic_load(&stop)) {
+        if (use_epoch)
+            pthread_mutex_lock(&wlock);
+        else
+            pthread_rwlock_wrlock(&rwlock);
+        addUserToRoom(room, u);
+        removeUserFromRoom(&list, room, u);
+        if (use_epoch)
+            pthread_mutex_unlock(&wlock);
+        else
+            pthread_rwlock_unlock(&rwlock);
+    }
+    return NULL;
+}
+
+static void run(const char *op, int epoch, int n)
+{
+    pthread_t tid[N_READERS], wtid;
+    use_epoch = epoch;
+    walks = bench_iters(n) / N_READERS;
+    atomic_store(&stop, false);
+
+    pthread_create(&wtid, NULL, writer, NULL);
+    double t = bench_now();
+    for (int i = 0; i < N_READERS; ++i)
+        pthread_create(&tid[i], NULL, reader, NULL);
+    for (int i = 0; i < N_READERS; ++i)
+        pthread_join(tid[i], NULL);
+    double sec = bench_now() - t;
+    atomic_store(&stop, true);
+    pthread_join(wtid, NULL);
+    bench_result("members", op, n, walks * N_READERS, sec);
+}
+
+static void churn(int n)
+{
+    user_t u = { .username = "churn", .user_fd = -1 };
+    long iters = bench_iters(n);
+    double t = bench_now();
+    for (long i = 0; i < iters; ++i) {
+        addUserToRoom(room, u);
+        removeUserFromRoom(&list, room, u);
+    }
+    bench_result("members", "join+leave", n, iters, bench_now() - t);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 0; i < BENCH_NSIZES; ++i) {
+        int n = bench_sizes[i];
+        user_t owner = { .username = "owner", .user_fd = 0 };
+        addRoom(&list, "room", owner);
+        room = getRoom(&list, "room");
+        for (int k = 1; k < n; ++k) {
+            user_t u = { .user_fd = k };
+            snprintf(u.username, STR_MAX, "user%d", k);
+            addUserToRoom(room, u);
+        }
+
+        run("rwlock walk under churn", 0, n);
+        run("epoch walk under churn", 1, n);
+        churn(n);
+        deleteRoomList(&list);
+    }
+    epoch_report(stdout);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * RMRECV payload building: the old strcat chain against build_rmrecv,
+ * at several message sizes.
+ */
+#include "bench.h"
+#include "payload.h"
+#include "server.h"
+#include <string.h>
+
+#define ITERS 2000000
+
+static size_t build_strcat(char *buf, const char *room, const char *from, const char *msg)
+{
+    bzero(buf, BUFFER_SIZE);
+    strcat(buf, room);
+    strcat(buf, "\r\n");
+    strcat(buf, from);
+    strcat(buf, "\r\n");
+    strcat(buf, msg);
+    return strlen(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes[] = { 16, 128, 512, 900 };
+    char buf[BUFFER_SIZE];
+    char msg[BUFFER_SIZE];
+    volatile size_t sink = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        memset(msg, 'm', sizes[i]);
+        msg[sizes[i]] = '\0';
+
+        double t = bench_now();
+        for (long j = 0; j < ITERS; ++j)
+            sink += build_strcat(buf, "general", "someuser", msg) + strlen(buf);
+        bench_result("payload", "strcat", sizes[i], ITERS, bench_now() - t);
+
+        t = bench_now();
+        for (long j = 0; j < ITERS; ++j)
+            sink += build_rmrecv(buf, sizeof(buf), "general", "someuser", msg, sizes[i]);
+        bench_result("payload", "build_rmrecv", sizes[i], ITERS, bench_now() - t);
+    }
+    return 0;
+}
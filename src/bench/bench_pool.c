@@ -0,0 +1,91 @@
+/*
+ * Allocation rate under login/logout style churn: each thread holds a
+ * population of n live user_t-sized objects and repeatedly frees one and
+ * allocates a replacement, through malloc and through pool_t. Also times
+ * the real linkedList.c path (insertFront + removeFront) on the user pool.
+ */
+#include "bench.h"
+#include "linkedList.h"
+#include "pool.h"
+#include <pthread.h>
+
+#define N_THREADS 4
+
+static pool_t bench_pool = POOL_INIT("bench", sizeof(user_t));
+static int population;
+static long iters;
+static int use_pool;
+
+static void *churn(void *arg)
+{
+    void **live = calloc(population, sizeof(void *));
+    for (int i = 0; i < population; ++i)
+        live[i] = use_pool ? pool_alloc(&bench_pool) : malloc(sizeof(user_t));
+
+    for (long i = 0; i < iters; ++i) {
+        int k = (i * 7919) % population;
+        if (use_pool) {
+            pool_free(&bench_pool, live[k]);
+            live[k] = pool_alloc(&bench_pool);
+        } else {
+            free(live[k]);
+            live[k] = malloc(sizeof(user_t));
+        }
+        ((user_t *)live[k])->user_fd = i; // touch it like a real node
+    }
+
+    for (int i = 0; i < population; ++i) {
+        if (use_pool)
+            pool_free(&bench_pool, live[i]);
+        else
+            free(live[i]);
+    }
+    free(live);
+    return NULL;
+}
+
+static void run(const char *op, int pool, int threads, int n)
+{
+    pthread_t tid[N_THREADS];
+    use_pool = pool;
+    population = n;
+    iters = 2000000 / threads;
+
+    double t = bench_now();
+    for (int i = 0; i < threads; ++i)
+        pthread_create(&tid[i], NULL, churn, NULL);
+    for (int i = 0; i < threads; ++i)
+        pthread_join(tid[i], NULL);
+    bench_result("pool", op, n, iters * threads, bench_now() - t);
+}
+
+static void bench_list_churn(int n)
+{
+    userlist_t list = { .head = NULL, .length = 0 };
+    long list_iters = 1000000;
+    for (int i = 0; i < n; ++i)
+        insertFront(&list, "user", i);
+
+    double t = bench_now();
+    for (long i = 0; i < list_iters; ++i) {
+        removeFront(&list);
+        insertFront(&list, "again", i);
+    }
+    bench_result("pool", "list insertFront+removeFront", n, list_iters, bench_now() - t);
+    deleteUserList(&list);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 0; i < BENCH_NSIZES; ++i) {
+        int n = bench_sizes[i];
+        run("malloc churn x1", 0, 1, n);
+        run("pool churn x1", 1, 1, n);
+        run("malloc churn x4", 0, N_THREADS, n);
+        run("pool churn x4", 1, N_THREADS, n);
+        bench_list_churn(n);
+    }
+    pool_report(&bench_pool, stdout);
+    pool_report(&user_pool, stdout);
+    return 0;
+}
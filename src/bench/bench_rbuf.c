@@ -0,0 +1,129 @@
+/*
+ * Replays a high-rate RMRECV stream, as petr_client forwards it to
+ * petr_chat ("from\r\n" + "msg\0"), through the chat window read path.
+ *
+ *   getdelimfd - getdelimfd-style byte reads, malloc per field, flush per print
+ *   rbuf     - chunked rbuf reads split in place, one flush per read
+ */
+#include "bench.h"
+#include "rbuf.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define N_MSGS 50000
+
+static char *stream;
+static size_t stream_len;
+
+static void *writer(void *arg)
+{
+    int fd = *(int *)arg;
+    size_t off = 0;
+    while (off < stream_len) {
+        ssize_t n = write(fd, stream + off, stream_len - off);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    close(fd);
+    return NULL;
+}
+
+static ssize_t getdelim_bytes(char **line, int delim, int fd)
+{
+    size_t n = 64, i = 0;
+    char c;
+    *line = malloc(n);
+    while (read(fd, &c, 1) == 1) {
+        if (i + 1 == n)
+            *line = realloc(*line, n *= 2);
+        (*line)[i++] = c;
+        if (c == delim) {
+            (*line)[i] = '\0';
+            return i;
+        }
+    }
+    free(*line);
+    return -1;
+}
+
+static long run_baseline(int fd, FILE *out)
+{
+    long msgs = 0;
+    char *from, *msg;
+    while (getdelim_bytes(&from, '\n', fd) > 0) {
+        fprintf(out, "%s", from);
+        fflush(out);
+        free(from);
+        if (getdelim_bytes(&msg, '\0', fd) < 0)
+            break;
+        fprintf(out, "%s", msg);
+        fflush(out);
+        free(msg);
+        msgs++;
+    }
+    return msgs;
+}
+
+static long run_rbuf(int fd, FILE *out)
+{
+    long msgs = 0;
+    rbuf_t rb;
+    rbuf_init(&rb, RBUF_SIZE);
+    char *from, *msg;
+    size_t from_len, msg_len;
+    while (rbuf_fill(&rb, fd) > 0) {
+        while (rbuf_next_msg(&rb, &from, &from_len, &msg, &msg_len)) {
+            fprintf(out, "%.*s%.*s", (int)from_len, from, (int)msg_len - 1, msg);
+            msgs++;
+        }
+        fflush(out);
+    }
+    rbuf_free(&rb);
+    return msgs;
+}
+
+static void bench(const char *name, long (*fn)(int, FILE *), FILE *out)
+{
+    int sv[2];
+    pthread_t tid;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    pthread_create(&tid, NULL, writer, &sv[1]);
+
+    double t = bench_now();
+    long msgs = fn(sv[0], out);
+    t = bench_now() - t;
+
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    bench_result("rbuf", name, N_MSGS, msgs, t);
+}
+
+int main(int argc, char *argv[])
+{
+    // build the stream once: varying senders and message sizes
+    size_t cap = (size_t)N_MSGS * 128;
+    stream = malloc(cap);
+    for (int i = 0; i < N_MSGS; ++i) {
+        stream_len += sprintf(stream + stream_len, "user%d\r\n", i % 50);
+        int len = 8 + (i * 7) % 80;
+        memset(stream + stream_len, 'a' + i % 26, len);
+        stream_len += len;
+        stream[stream_len++] = '\0';
+    }
+
+    FILE *out = fopen("/dev/null", "w");
+    static char out_buf[RBUF_SIZE];
+    setvbuf(out, out_buf, _IOFBF, sizeof(out_buf));
+
+    bench("getdelimfd", run_baseline, out);
+    bench("rbuf", run_rbuf, out);
+
+    fclose(out);
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * sbuf_t insert/remove throughput with several producer/consumer counts.
+ */
+#include "bench.h"
+#include "sbuf.h"
+#include "clock.h"
+#include <pthread.h>
+
+#define N_ITEMS 400000
+#define N_SLOTS 16
+
+static sbuf_t sb;
+static long per_producer;
+
+static void *producer(void *arg)
+{
+    j_msg m = { .header = { .msg_len = 0, .msg_type = (uintptr_t)arg } };
+    for (long i = 0; i < per_producer; ++i) {
+        m.t_enq = mono_ns();
+        sbuf_insert(&sb, m);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    long n = (long)arg;
+    for (long i = 0; i < n; ++i)
+        sbuf_remove(&sb);
+    return NULL;
+}
+
+static void run(int threads)
+{
+    pthread_t p[threads], c[threads];
+    per_producer = N_ITEMS / threads;
+    sbuf_init(&sb, N_SLOTS, 1);
+
+    double t = bench_now();
+    for (int i = 0; i < threads; ++i) {
+        // mix control and bulk lanes
+        pthread_create(&p[i], NULL, producer, (void *)(uintptr_t)(i % 2 ? RMSEND : RMJOIN));
+        pthread_create(&c[i], NULL, consumer, (void *)per_producer);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(p[i], NULL);
+        pthread_join(c[i], NULL);
+    }
+    bench_result("sbuf", "insert+remove", threads, per_producer * threads, bench_now() - t);
+
+    sbuf_deinit(&sb);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < 4; ++i)
+        run(threads[i]);
+    return 0;
+}
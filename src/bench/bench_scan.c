@@ -0,0 +1,60 @@
+/*
+ * Request payload splitting: the old strtok path (split "room\r\nmsg" at
+ * '\r', skip the '\n', strlen the message) against scan_frame with each
+ * delimiter search, at several message sizes. Both copy the payload in
+ * first, as splitting is in place; the copy is the same for every row.
+ */
+#include "bench.h"
+#include "protocol.h"
+#include "scan.h"
+#include "server.h"
+#include <string.h>
+
+#define ITERS 2000000
+
+static size_t split_strtok(char *buf, char **room, char **msg)
+{
+    char *save;
+    *room = strtok_r(buf, "\r", &save);
+    *msg = strtok_r(NULL, "\r", &save);
+    ++*msg; // skip newline
+    return strlen(*msg);
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes[] = { 16, 128, 512, 900 };
+    const char *impls[] = { "scalar", "sse2", "avx2" };
+    char payload[BUFFER_SIZE], buf[BUFFER_SIZE];
+    volatile size_t sink = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        int len = snprintf(payload, sizeof(payload), "general\r\n");
+        memset(payload + len, 'm', sizes[i]);
+        len += sizes[i];
+        payload[len++] = '\0';
+
+        double t = bench_now();
+        for (long j = 0; j < ITERS; ++j) {
+            char *room, *msg;
+            memcpy(buf, payload, len);
+            sink += split_strtok(buf, &room, &msg) + (room != NULL);
+        }
+        bench_result("scan", "strtok", sizes[i], ITERS, bench_now() - t);
+
+        for (int k = 0; k < 3; ++k) {
+            if (scan_use(impls[k]) < 0)
+                continue; // not on this CPU
+            fields_t f;
+            t = bench_now();
+            for (long j = 0; j < ITERS; ++j) {
+                memcpy(buf, payload, len);
+                sink += scan_frame(RMSEND, buf, len, sizeof(buf), &f) + f.len[1];
+            }
+            char op[32];
+            snprintf(op, sizeof(op), "scan_frame %s", impls[k]);
+            bench_result("scan", op, sizes[i], ITERS, bench_now() - t);
+        }
+    }
+    return sink == 0;
+}
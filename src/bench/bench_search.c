@@ -0,0 +1,77 @@
+/*
+ * Room message search index: indexing cost per message, index bytes per
+ * message and RMSEARCH latency, at room histories of n messages. Each
+ * size gets its own room, so rooms grow independently in one index.
+ * Messages are 12 words drawn from a skewed 5000 word vocabulary; "rare"
+ * queries AND a common word with an uncommon one.
+ */
+#include "bench.h"
+#include "search.h"
+#include <string.h>
+
+#define VOCAB 5000
+#define WORDS_PER_MSG 12
+
+static uint32_t rng = 2463534242u;
+
+/* xorshift32 */
+static uint32_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Low word numbers come up far more often, like real chat */
+static int pick_word(void)
+{
+    uint32_t r = next_rand() % VOCAB;
+    return (int)((uint64_t)r * r / VOCAB);
+}
+
+int main(int argc, char *argv[])
+{
+    char msg[256], out[SEARCH_BODY_MAX];
+    search_init((size_t)1 << 30, NULL); // large enough that nothing is evicted
+
+    for (int i = 0; i < BENCH_NSIZES; ++i) {
+        int n = bench_sizes[i];
+        uint64_t room = i + 1; // a fresh room per size
+
+        size_t before = search_bytes();
+        double t = bench_now();
+        for (int k = 0; k < n; ++k) {
+            int len = 0;
+            for (int w = 0; w < WORDS_PER_MSG; ++w)
+                len += snprintf(msg + len, sizeof(msg) - len, "word%d ", pick_word());
+            while (!search_submit(room, "bench", msg))
+                search_flush(); // queue full: let the indexer catch up
+        }
+        search_flush();
+        double sec = bench_now() - t;
+        bench_result("search", "index message", n, n, sec);
+        printf("{\"bench\": \"search\", \"op\": \"index bytes per message\", \"n\": %d, \"bytes\": %.1f}\n",
+               n, (double)(search_bytes() - before) / n);
+
+        const char *queries[][2] = {
+            { "common word", "word0" },
+            { "two common words", "word0 word1" },
+            { "common and rare word", "word0 word4000" },
+        };
+        for (int q = 0; q < 3; ++q) {
+            long iters = bench_iters(n);
+            size_t sink = 0;
+            t = bench_now();
+            for (long k = 0; k < iters; ++k)
+                sink += search_query(room, queries[q][1], 0, out, sizeof(out));
+            sec = bench_now() - t;
+            char op[64];
+            snprintf(op, sizeof(op), "query %s", queries[q][0]);
+            bench_result("search", op, n, iters, sec);
+            if (sink == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
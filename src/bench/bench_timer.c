@@ -0,0 +1,40 @@
+/*
+ * Timer wheel insert and cancel cost at several populations of pending
+ * timers; both should stay flat as the population grows.
+ */
+#include "bench.h"
+#include "timer.h"
+
+static void noop(void *arg)
+{
+}
+
+static void bench_wheel(int n)
+{
+    wtimer_t *t = calloc(n, sizeof(wtimer_t));
+    wtimer_t probe = { 0 };
+    long iters = 1000000;
+
+    // spread pending timers over every level
+    for (int i = 0; i < n; ++i)
+        timer_add(&t[i], 60000 + (uint32_t)i * 997 % 3600000, noop, NULL);
+
+    double start = bench_now();
+    for (long i = 0; i < iters; ++i) {
+        timer_add(&probe, (uint32_t)(i * 7919 % 600000) + 1000, noop, NULL);
+        timer_cancel(&probe);
+    }
+    bench_result("timer", "add+cancel", n, iters, bench_now() - start);
+
+    for (int i = 0; i < n; ++i)
+        timer_cancel(&t[i]);
+    free(t);
+}
+
+int main(int argc, char *argv[])
+{
+    timer_start(NULL);
+    for (int i = 0; i < BENCH_NSIZES; ++i)
+        bench_wheel(bench_sizes[i]);
+    return 0;
+}
@@ -1,10 +1,12 @@
 #include "chat.h"
 #include "debug.h"
 #include "protocol.h"
+#include "rbuf.h"
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,16 +15,17 @@
 #define YELLOW "\x1B[1;33m"
 #define BLUE "\x1B[1;34m"
 
+// stdout is flushed once per poll iteration, not per message
+static char out_buf[RBUF_SIZE];
+
 // you can customize this print here!
-void print_username(char *name) {
-    printf(YELLOW "%s" KNRM, name);
-    fflush(stdout);
+void print_username(char *name, size_t len) {
+    printf(YELLOW "%.*s" KNRM, (int)len, name);
 }
 
 // you can customize this print here!
-void print_msg(char *msg) {
-    printf(BLUE "%s" KNRM, msg);
-    fflush(stdout);
+void print_msg(char *msg, size_t len) {
+    printf(BLUE "%.*s" KNRM, (int)len, msg);
 }
 
 int main(int argc, char *argv[]) {
@@ -39,6 +42,14 @@ int main(int argc, char *argv[]) {
     fds[1].fd = sockfd;
     fds[1].events = POLLIN;
 
+    // socket and stdin are read in large chunks and split in place
+    rbuf_t sock_in, std_in;
+    rbuf_init(&sock_in, RBUF_SIZE);
+    rbuf_init(&std_in, RBUF_SIZE);
+    char *send_buf = malloc(RBUF_SIZE);
+    size_t send_cap = RBUF_SIZE;
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
     while (1) {
         // poll on the two descriptors we care about until some event occurs (no timing out)
         int ret = poll(fds, 2, -1);
@@ -50,6 +61,7 @@ int main(int argc, char *argv[]) {
         for (int i = 0; i < 2; i++) {
             // if the file descriptor encountered an error or a hangup, close everything but stay open
             if (fds[i].revents & POLLERR || fds[i].revents & POLLHUP) {
+                fflush(stdout);
                 close(STDIN_FILENO);
                 close(sockfd);
                 // go to sleep forever
@@ -59,45 +71,45 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
             if (fds[i].revents & POLLIN && fds[i].fd == STDIN_FILENO) {
-                char *buf = NULL;
-                size_t n = 0;
-                ssize_t len = getline(&buf, &n, stdin);
-                if (len < 0) {
-                    perror("getline error");
-                    fatal("Unexpected getline failure.\n");
+                ssize_t len = rbuf_fill(&std_in, STDIN_FILENO);
+                if (len <= 0) {
+                    perror("read error");
+                    fatal("Unexpected stdin failure.\n");
+                }
+                // send every complete line, each with its null terminator, in one go
+                size_t send_len = 0;
+                size_t line_len;
+                char *line;
+                while ((line = rbuf_next(&std_in, '\n', &line_len)) != NULL) {
+                    if (send_len + line_len + 1 > send_cap) {
+                        send_cap = 2 * (send_len + line_len + 1);
+                        send_buf = realloc(send_buf, send_cap);
+                    }
+                    memcpy(send_buf + send_len, line, line_len);
+                    send_len += line_len;
+                    send_buf[send_len++] = '\0';
                 }
-                // send the line including the null terminator
-                if (send(sockfd, buf, len + 1, 0) < 0) {
+                if (send_len > 0 && send(sockfd, send_buf, send_len, 0) < 0) {
                     error("Send failed\n");
                 }
-                free(buf);
             }
             if (fds[i].revents & POLLIN && fds[i].fd == sockfd) {
-                // first get the user
-                char *from_user = NULL;
-                size_t n = 0;
-                ssize_t len = getdelimfd(&from_user, &n, '\n', sockfd);
-                if (len < 0) {
-                    perror("getdelimfd error");
-                    fatal("Unexpected getdelimfd failure.\n");
+                ssize_t len = rbuf_fill(&sock_in, sockfd);
+                if (len <= 0) {
+                    perror("read error");
+                    fatal("Unexpected socket read failure.\n");
                 }
-                // the from_user string will have \r\n in it if the protocol
-                // is implemented correctly
-                print_username(from_user);
-                free(from_user);
-                // then get the rest of message
-                char *msg = NULL;
-                len = getdelimfd(&msg, &n, '\0', sockfd);
-                if (len < 0) {
-                    perror("getdelimfd error");
-                    fatal("Unexpected getdelimfd failure.\n");
+                // the from_user string will have \r\n in it and the msg string
+                // a null terminator if the protocol is implemented correctly
+                char *from_user, *msg;
+                size_t from_len, msg_len;
+                while (rbuf_next_msg(&sock_in, &from_user, &from_len, &msg, &msg_len)) {
+                    print_username(from_user, from_len);
+                    print_msg(msg, msg_len - 1); // without the null terminator
                 }
-                // the msg string will have a null terminator if the protocol
-                // is implemented correctly
-                print_msg(msg);
-                free(msg);
             }
         }
+        fflush(stdout);
     }
     return EXIT_SUCCESS;
 }
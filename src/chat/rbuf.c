@@ -0,0 +1,63 @@
+#include "rbuf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void rbuf_init(rbuf_t *rb, size_t cap)
+{
+    rb->buf = malloc(cap);
+    rb->cap = cap;
+    rb->start = rb->end = 0;
+}
+
+void rbuf_free(rbuf_t *rb)
+{
+    free(rb->buf);
+    rb->buf = NULL;
+    rb->cap = rb->start = rb->end = 0;
+}
+
+ssize_t rbuf_fill(rbuf_t *rb, int fd)
+{
+    // move the partial token to the front, grow only if it fills the buffer
+    if (rb->start > 0) {
+        memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+    if (rb->end == rb->cap) {
+        rb->cap *= 2;
+        rb->buf = realloc(rb->buf, rb->cap);
+    }
+
+    ssize_t n = read(fd, rb->buf + rb->end, rb->cap - rb->end);
+    if (n > 0)
+        rb->end += n;
+    return n;
+}
+
+char *rbuf_next(rbuf_t *rb, int delim, size_t *len)
+{
+    char *p = rb->buf + rb->start;
+    char *d = memchr(p, delim, rb->end - rb->start);
+    if (d == NULL)
+        return NULL;
+
+    *len = d - p + 1;
+    rb->start += *len;
+    return p;
+}
+
+int rbuf_next_msg(rbuf_t *rb, char **from, size_t *from_len, char **msg, size_t *msg_len)
+{
+    size_t start = rb->start;
+    *from = rbuf_next(rb, '\n', from_len);
+    if (*from == NULL)
+        return 0;
+    *msg = rbuf_next(rb, '\0', msg_len);
+    if (*msg == NULL) {
+        rb->start = start; // wait for the rest of the message
+        return 0;
+    }
+    return 1;
+}
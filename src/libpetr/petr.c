@@ -0,0 +1,395 @@
+#include "petr.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PETR_READ_CHUNK 65536
+
+typedef struct {
+    petr_cb cb;
+    void *arg;
+    int done; // answered out of order, waiting for older ones
+} pending_t;
+
+typedef struct {
+    char *buf;
+    size_t start, end, cap;
+} pbuf_t;
+
+struct petr_conn {
+    int fd;
+    int connecting;
+    int closed;
+    int shut;              // petr_shutdown requested
+    pbuf_t in, out;
+    pending_t *pending;    // requests by sequence number, seq % p_cap
+    size_t p_head, p_tail, p_cap;
+    size_t n_pending;      // not yet answered
+    int tagging;           // send REQID before each request
+    int in_tagged;         // a REQID arrived for the next reply
+    uint32_t in_tag;
+    petr_cb on_event;
+    void *event_arg;
+    petr_watch_cb watch;
+    void *watch_arg;
+    short watched;         // events last reported to watch
+};
+
+static void pbuf_reserve(pbuf_t *b, size_t n)
+{
+    if (b->cap - b->end >= n)
+        return;
+    // slide unread bytes to the front before growing
+    memmove(b->buf, b->buf + b->start, b->end - b->start);
+    b->end -= b->start;
+    b->start = 0;
+    if (b->cap - b->end < n) {
+        while (b->cap - b->end < n)
+            b->cap = b->cap ? 2 * b->cap : PETR_READ_CHUNK;
+        b->buf = realloc(b->buf, b->cap);
+    }
+}
+
+static void notify_watch(petr_conn *c)
+{
+    short ev = petr_events(c);
+    if (c->watch && ev != c->watched) {
+        c->watched = ev;
+        c->watch(c, c->fd, ev, c->watch_arg);
+    }
+}
+
+static int open_socket(const char *host, const char *port)
+{
+    int fd;
+    if (host[0] == '/') {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(host) >= sizeof(sun.sun_path))
+            return -1;
+        strcpy(sun.sun_path, host);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        // we batch frames ourselves; Nagle would only add latency
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+petr_conn *petr_connect(const char *host, const char *port, const char *name,
+                        petr_cb on_login, void *arg)
+{
+    int fd = open_socket(host, port);
+    if (fd < 0)
+        return NULL;
+
+    petr_conn *c = calloc(1, sizeof(petr_conn));
+    c->fd = fd;
+    c->connecting = 1;
+    petr_request_str(c, LOGIN, name, on_login, arg);
+    return c;
+}
+
+petr_conn *petr_resume(const char *host, const char *port, const char *name,
+                       const char *token, petr_cb on_login, void *arg)
+{
+    size_t len = strlen(name) + 2 + strlen(token) + 1;
+    char *login = malloc(len);
+    snprintf(login, len, "%s\r\n%s", name, token);
+    petr_conn *c = petr_connect(host, port, login, on_login, arg);
+    free(login);
+    return c;
+}
+
+void petr_set_event_cb(petr_conn *c, petr_cb cb, void *arg)
+{
+    c->on_event = cb;
+    c->event_arg = arg;
+}
+
+void petr_set_watch(petr_conn *c, petr_watch_cb cb, void *arg)
+{
+    c->watch = cb;
+    c->watch_arg = arg;
+    c->watched = 0;
+    notify_watch(c);
+}
+
+int petr_request(petr_conn *c, uint8_t type, const void *body, uint32_t len,
+                 petr_cb cb, void *arg)
+{
+    if (c->closed || c->shut)
+        return -1;
+
+    petr_header h = { .msg_len = len, .msg_type = type };
+    if (c->tagging) {
+        // request id is its sequence number + 1
+        petr_header t = { .msg_len = sizeof(uint32_t), .msg_type = REQID };
+        uint32_t id = c->p_tail + 1;
+        pbuf_reserve(&c->out, sizeof(t) + sizeof(id));
+        memcpy(c->out.buf + c->out.end, &t, sizeof(t));
+        memcpy(c->out.buf + c->out.end + sizeof(t), &id, sizeof(id));
+        c->out.end += sizeof(t) + sizeof(id);
+    }
+    pbuf_reserve(&c->out, sizeof(h) + len);
+    memcpy(c->out.buf + c->out.end, &h, sizeof(h));
+    if (len)
+        memcpy(c->out.buf + c->out.end + sizeof(h), body, len);
+    c->out.end += sizeof(h) + len;
+
+    if (c->p_tail - c->p_head == c->p_cap) {
+        // grow the ring, keeping every entry at seq % cap
+        size_t cap = c->p_cap ? 2 * c->p_cap : 64;
+        pending_t *p = malloc(cap * sizeof(pending_t));
+        for (size_t i = c->p_head; i != c->p_tail; ++i)
+            p[i % cap] = c->pending[i % c->p_cap];
+        free(c->pending);
+        c->pending = p;
+        c->p_cap = cap;
+    }
+    c->pending[c->p_tail++ % c->p_cap] = (pending_t){ .cb = cb, .arg = arg };
+    c->n_pending++;
+
+    notify_watch(c);
+    return 0;
+}
+
+void petr_set_tagging(petr_conn *c, int on)
+{
+    c->tagging = on;
+}
+
+int petr_request_str(petr_conn *c, uint8_t type, const char *body, petr_cb cb, void *arg)
+{
+    return petr_request(c, type, body, body ? strlen(body) + 1 : 0, cb, arg);
+}
+
+void petr_shutdown(petr_conn *c)
+{
+    c->shut = 1;
+    if (!c->connecting && c->out.start == c->out.end && !c->closed)
+        shutdown(c->fd, SHUT_WR);
+    notify_watch(c);
+}
+
+static void fail(petr_conn *c)
+{
+    if (c->closed)
+        return;
+    c->closed = 1;
+    while (c->p_head != c->p_tail) {
+        pending_t p = c->pending[c->p_head++ % c->p_cap];
+        if (p.cb && !p.done)
+            p.cb(c, NULL, NULL, p.arg);
+    }
+    c->n_pending = 0;
+    notify_watch(c);
+}
+
+int petr_flush(petr_conn *c)
+{
+    if (c->closed)
+        return -1;
+    if (c->connecting)
+        return 0;
+
+    // one send for everything queued since the last flush
+    while (c->out.start < c->out.end) {
+        ssize_t n = send(c->fd, c->out.buf + c->out.start, c->out.end - c->out.start, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            fail(c);
+            return -1;
+        }
+        c->out.start += n;
+    }
+    if (c->out.start == c->out.end) {
+        c->out.start = c->out.end = 0;
+        if (c->shut)
+            shutdown(c->fd, SHUT_WR);
+    }
+    notify_watch(c);
+    return 0;
+}
+
+static void dispatch(petr_conn *c, petr_header *h, char *body)
+{
+    if (h->msg_type == REQID) {
+        c->in_tagged = h->msg_len == sizeof(uint32_t);
+        memcpy(&c->in_tag, body, sizeof(uint32_t));
+        return;
+    }
+    if (h->msg_type == RMRECV || h->msg_type == USRRECV || h->msg_type == RMCLOSED) {
+        if (c->on_event)
+            c->on_event(c, h, body, c->event_arg);
+        return;
+    }
+
+    // a tagged reply names its request; an untagged one answers the oldest
+    size_t seq = c->p_head;
+    if (c->in_tagged) {
+        seq = c->p_head + (uint32_t)(c->in_tag - 1 - (uint32_t)c->p_head);
+        c->in_tagged = 0;
+    } else {
+        while (seq != c->p_tail && c->pending[seq % c->p_cap].done)
+            seq++;
+    }
+    if (seq >= c->p_tail || c->pending[seq % c->p_cap].done)
+        return; // unexpected reply
+
+    pending_t *p = &c->pending[seq % c->p_cap];
+    p->done = 1;
+    c->n_pending--;
+    petr_cb cb = p->cb;
+    void *arg = p->arg;
+    while (c->p_head != c->p_tail && c->pending[c->p_head % c->p_cap].done)
+        c->p_head++;
+    if (cb)
+        cb(c, h, body, arg); // may queue requests and move the ring
+}
+
+static int read_frames(petr_conn *c)
+{
+    while (1) {
+        pbuf_reserve(&c->in, PETR_READ_CHUNK);
+        // keep one spare byte so the last body can be terminated in place
+        ssize_t n = read(c->fd, c->in.buf + c->in.end, c->in.cap - c->in.end - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->in.end += n;
+
+        // every complete frame; bodies are terminated in place for the callback
+        petr_header h;
+        while (c->in.end - c->in.start >= sizeof(h)) {
+            memcpy(&h, c->in.buf + c->in.start, sizeof(h));
+            if (c->in.end - c->in.start < sizeof(h) + h.msg_len) {
+                pbuf_reserve(&c->in, sizeof(h) + h.msg_len + 1);
+                break;
+            }
+            char *body = c->in.buf + c->in.start + sizeof(h);
+            c->in.start += sizeof(h) + h.msg_len;
+
+            // the byte after the body belongs to the next frame, if any
+            char saved = body[h.msg_len];
+            body[h.msg_len] = '\0';
+            dispatch(c, &h, body);
+            body[h.msg_len] = saved;
+        }
+        if (c->in.start == c->in.end)
+            c->in.start = c->in.end = 0;
+        if (c->closed)
+            return -1;
+    }
+}
+
+int petr_handle(petr_conn *c, short revents)
+{
+    if (c->closed)
+        return -1;
+
+    if (c->connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            fail(c);
+            return -1;
+        }
+        c->connecting = 0;
+    }
+    if (c->connecting)
+        return 0;
+
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && read_frames(c) < 0) {
+        fail(c);
+        return -1;
+    }
+    // callbacks may have queued more; send it all now rather than next round
+    return petr_flush(c);
+}
+
+int petr_fd(petr_conn *c)
+{
+    return c->fd;
+}
+
+short petr_events(petr_conn *c)
+{
+    if (c->closed)
+        return 0;
+    if (c->connecting)
+        return POLLOUT;
+    return POLLIN | (c->out.start < c->out.end ? POLLOUT : 0);
+}
+
+size_t petr_pending(petr_conn *c)
+{
+    return c->n_pending;
+}
+
+int petr_closed(petr_conn *c)
+{
+    return c->closed;
+}
+
+void petr_close(petr_conn *c)
+{
+    fail(c);
+    close(c->fd);
+    free(c->in.buf);
+    free(c->out.buf);
+    free(c->pending);
+    free(c);
+}
+
+int petr_poll(petr_conn **conns, int n, int timeout_ms)
+{
+    struct pollfd *pfds = malloc(n * sizeof(struct pollfd));
+    int open = 0;
+    for (int i = 0; i < n; ++i) {
+        pfds[i].fd = conns[i] && !conns[i]->closed ? conns[i]->fd : -1;
+        pfds[i].events = pfds[i].fd >= 0 ? petr_events(conns[i]) : 0;
+        pfds[i].revents = 0;
+    }
+
+    if (poll(pfds, n, timeout_ms) >= 0) {
+        for (int i = 0; i < n; ++i)
+            if (pfds[i].revents)
+                petr_handle(conns[i], pfds[i].revents);
+    }
+    for (int i = 0; i < n; ++i)
+        open += conns[i] && !conns[i]->closed;
+    free(pfds);
+    return open;
+}
@@ -0,0 +1,150 @@
+#include "admit.h"
+#include "clock.h"
+#include "protocol.h"
+#include <stdatomic.h>
+
+static int rate;
+static int burst;
+static uint64_t max_delay_ns;
+static int quota[256];  // max queued jobs per message type
+static FILE *a_log;
+
+static atomic_int queued[256];          // jobs currently queued per type
+static atomic_int queued_total;
+static atomic_uint_fast64_t delay_ewma; // smoothed queue delay, ns
+static atomic_uint_fast64_t rejected[ADMIT_NREASONS];
+static atomic_uint_fast64_t last_log_ns;
+
+static const char *reason_str[ADMIT_NREASONS] = {
+    "ok", "rate", "quota", "delay", "full"
+};
+
+static bool is_bulk(uint8_t msg_type)
+{
+    return msg_type == RMSEND || msg_type == USRSEND || msg_type == USRMSEND;
+}
+
+void admit_init(int n, int r, int b, int max_delay_ms, FILE *log)
+{
+    rate = r;
+    burst = b > 0 ? b : 1;
+    max_delay_ns = (uint64_t)max_delay_ms * NS_PER_MS;
+    a_log = log;
+
+    // neither bulk type may fill the bulk lane on its own
+    for (int i = 0; i < 256; ++i)
+        quota[i] = n;
+    int bulk = n * ADMIT_BULK_SHARE / 100;
+    quota[RMSEND] = quota[USRSEND] = quota[USRMSEND] = bulk > 0 ? bulk : 1;
+}
+
+void tbucket_init(tbucket_t *b)
+{
+    b->tokens = burst;
+    b->last_ns = mono_ns();
+}
+
+static bool tbucket_take(tbucket_t *b)
+{
+    if (rate == 0)
+        return true;
+
+    uint64_t now = mono_ns();
+    b->tokens += (double)(now - b->last_ns) * rate / NS_PER_SEC;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    b->last_ns = now;
+
+    if (b->tokens < 1.0)
+        return false;
+    b->tokens -= 1.0;
+    return true;
+}
+
+enum admit_reason admit_check(tbucket_t *b, uint8_t msg_type)
+{
+    if (!tbucket_take(b))
+        return ADMIT_RATE_LIMITED;
+
+    if (atomic_load_explicit(&queued[msg_type], memory_order_relaxed) >= quota[msg_type])
+        return ADMIT_QUOTA;
+
+    // an empty queue has no delay, whatever the last samples said
+    if (atomic_load_explicit(&queued_total, memory_order_relaxed) == 0) {
+        atomic_store_explicit(&delay_ewma, 0, memory_order_relaxed);
+        return ADMIT_OK;
+    }
+
+    // shed bulk traffic as soon as queueing delay exceeds the target,
+    // control traffic only once it is far past it
+    uint64_t delay = atomic_load_explicit(&delay_ewma, memory_order_relaxed);
+    uint64_t limit = is_bulk(msg_type) ? max_delay_ns : 4 * max_delay_ns;
+    if (max_delay_ns && delay > limit)
+        return ADMIT_DELAY;
+
+    return ADMIT_OK;
+}
+
+void admit_enqueued(uint8_t msg_type)
+{
+    atomic_fetch_add_explicit(&queued[msg_type], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queued_total, 1, memory_order_relaxed);
+}
+
+void admit_dequeued(uint8_t msg_type)
+{
+    atomic_fetch_sub_explicit(&queued[msg_type], 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&queued_total, 1, memory_order_relaxed);
+}
+
+void admit_sample_delay(uint64_t queued_ns, uint64_t now)
+{
+    uint64_t sample = now > queued_ns ? now - queued_ns : 0;
+
+    // ewma with alpha 1/8; a lost update under contention is harmless
+    uint64_t old = atomic_load_explicit(&delay_ewma, memory_order_relaxed);
+    uint64_t ewma = old - (old >> 3) + (sample >> 3);
+    atomic_store_explicit(&delay_ewma, ewma, memory_order_relaxed);
+}
+
+uint64_t admit_delay_ns(void)
+{
+    return atomic_load_explicit(&delay_ewma, memory_order_relaxed);
+}
+
+uint64_t admit_target_delay_ns(void)
+{
+    return max_delay_ns;
+}
+
+int admit_queued(void)
+{
+    return atomic_load_explicit(&queued_total, memory_order_relaxed);
+}
+
+void admit_reject(enum admit_reason why)
+{
+    atomic_fetch_add_explicit(&rejected[why], 1, memory_order_relaxed);
+
+    // at most one summary line per second, whichever thread wins the race
+    uint64_t now = mono_ns();
+    uint64_t last = atomic_load_explicit(&last_log_ns, memory_order_relaxed);
+    if (now - last < NS_PER_SEC)
+        return;
+    if (!atomic_compare_exchange_strong(&last_log_ns, &last, now))
+        return;
+
+    admit_report();
+}
+
+void admit_report(void)
+{
+    if (a_log == NULL)
+        return;
+
+    fprintf(a_log, "Admission: queue delay %lu us, rejected",
+            (unsigned long)(atomic_load(&delay_ewma) / NS_PER_US));
+    for (int i = ADMIT_RATE_LIMITED; i < ADMIT_NREASONS; ++i)
+        fprintf(a_log, " %s=%lu", reason_str[i], (unsigned long)atomic_load(&rejected[i]));
+    fprintf(a_log, "\n");
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    bool on;
+    cpu_set_t all;                      // the whole configured set
+    cpu_set_t node_set[AFF_MAX_NODES];  // configured CPUs on each node
+    int nodes[AFF_MAX_NODES];           // nodes with at least one CPU
+    int n;
+} aff_class;
+
+static aff_class io, job;
+static int n_nodes = 1;
+static int cpu_node[CPU_SETSIZE];
+
+/* "0-3,8,10-11" */
+static int aff_parse_cpus(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (lo < 0 || hi >= CPU_SETSIZE || lo > hi)
+            return -1;
+        for (long c = lo; c <= hi; ++c)
+            CPU_SET(c, set);
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* Map every CPU to its NUMA node from sysfs; everything is node 0 without it */
+static void read_topology(void)
+{
+    memset(cpu_node, 0, sizeof(cpu_node));
+    n_nodes = 1;
+    for (int node = 0; node < AFF_MAX_NODES; ++node) {
+        char path[64], list[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        cpu_set_t set;
+        if (fgets(list, sizeof(list), f)) {
+            list[strcspn(list, "\n")] = '\0';
+            if (aff_parse_cpus(list, &set) == 0) {
+                for (int c = 0; c < CPU_SETSIZE; ++c)
+                    if (CPU_ISSET(c, &set))
+                        cpu_node[c] = node;
+                if (node + 1 > n_nodes)
+                    n_nodes = node + 1;
+            }
+        }
+        fclose(f);
+    }
+}
+
+static int class_init(aff_class *k, const char *cpus, const char *name, FILE *log)
+{
+    if (cpus == NULL)
+        return 0;
+    if (aff_parse_cpus(cpus, &k->all) < 0)
+        return -1;
+
+    k->on = true;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &k->all))
+            CPU_SET(c, &k->node_set[cpu_node[c]]);
+    for (int node = 0; node < n_nodes; ++node) {
+        if (CPU_COUNT(&k->node_set[node]) > 0) {
+            k->nodes[k->n++] = node;
+            fprintf(log, "Pinning %s threads on node %d to %d CPUs\n",
+                    name, node, CPU_COUNT(&k->node_set[node]));
+        }
+    }
+    return 0;
+}
+
+int aff_init(const char *io_cpus, const char *job_cpus, FILE *log)
+{
+    if (io_cpus == NULL && job_cpus == NULL)
+        return 0; // one node, nothing pinned
+
+    read_topology();
+    if (class_init(&io, io_cpus, "I/O", log) < 0 || class_init(&job, job_cpus, "job", log) < 0)
+        return -1;
+    return 0;
+}
+
+int aff_nodes(void)
+{
+    return (io.on || job.on) ? n_nodes : 1;
+}
+
+static int pin(aff_class *k, int seq)
+{
+    if (!k->on)
+        return -1;
+    int node = k->nodes[seq % k->n];
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &k->node_set[node]);
+    return node;
+}
+
+int aff_pin_io(int seq)
+{
+    return pin(&io, seq);
+}
+
+int aff_pin_job(int seq)
+{
+    return pin(&job, seq);
+}
+
+void aff_pin_accept(void)
+{
+    if (io.on)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &io.all);
+}
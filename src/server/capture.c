@@ -0,0 +1,78 @@
+#include "capture.h"
+#include "clock.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static FILE *cap_file;
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cap_start;
+static uint32_t next_conn = 1;
+static uint32_t conn_of_fd[CAPTURE_MAX_FD];
+
+int capture_open(const char *path)
+{
+    cap_file = fopen(path, "we");
+    if (cap_file == NULL)
+        return -1;
+    setvbuf(cap_file, NULL, _IOFBF, 1 << 20);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap_file_hdr h = {
+        .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION,
+        .start_unix_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec
+    };
+    fwrite(&h, sizeof(h), 1, cap_file);
+    cap_start = mono_ns();
+    return 0;
+}
+
+void capture_close(void)
+{
+    if (cap_file == NULL)
+        return;
+    pthread_mutex_lock(&cap_lock);
+    fclose(cap_file);
+    cap_file = NULL;
+    pthread_mutex_unlock(&cap_lock);
+}
+
+static void capture_write(int fd, uint8_t type, uint32_t len, const char *payload)
+{
+    if (fd < 0 || fd >= CAPTURE_MAX_FD)
+        return;
+
+    pthread_mutex_lock(&cap_lock);
+    if (cap_file) {
+        cap_rec r = {
+            .t_ns = mono_ns() - cap_start, .conn_id = conn_of_fd[fd],
+            .msg_len = len, .msg_type = type
+        };
+        fwrite(&r, sizeof(r), 1, cap_file);
+        if (len)
+            fwrite(payload, 1, len, cap_file);
+    }
+    pthread_mutex_unlock(&cap_lock);
+}
+
+void capture_conn(int fd)
+{
+    if (cap_file == NULL || fd < 0 || fd >= CAPTURE_MAX_FD)
+        return;
+    pthread_mutex_lock(&cap_lock);
+    conn_of_fd[fd] = next_conn++;
+    pthread_mutex_unlock(&cap_lock);
+}
+
+void capture_frame(int fd, petr_header *h, const char *payload)
+{
+    if (cap_file)
+        capture_write(fd, h->msg_type, h->msg_len, payload);
+}
+
+void capture_disconnect(int fd)
+{
+    if (cap_file)
+        capture_write(fd, CAPTURE_CLOSE, 0, NULL);
+}
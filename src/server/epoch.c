@@ -0,0 +1,163 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct epoch_rec {
+    _Atomic uint64_t epoch;    // epoch being read in, 0 = not reading
+    int depth;                 // nested enters, owner only
+    atomic_bool used;          // owned by a live thread
+    struct epoch_rec *next;    // registry, never unlinked
+    char pad[64];              // one reader per cache line
+} epoch_rec;
+
+typedef struct limbo {
+    void *p;
+    void (*fn)(void *);
+    uint64_t epoch;            // global epoch when retired
+    struct limbo *next;
+} limbo;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_rec *) recs;
+static __thread epoch_rec *self;
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static limbo *limbo_head;      // newest first, under limbo_lock
+static atomic_ulong n_retired, n_freed;
+
+static void release_rec(void *arg)
+{
+    epoch_rec *r = arg;
+    atomic_store(&r->epoch, 0);
+    atomic_store(&r->used, false);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&exit_key, release_rec);
+}
+
+/* A reader slot for this thread, recycled from exited threads when possible */
+static epoch_rec *get_rec(void)
+{
+    if (self)
+        return self;
+
+    epoch_rec *r;
+    for (r = atomic_load(&recs); r != NULL; r = r->next) {
+        bool expect = false;
+        if (!atomic_load(&r->used) && atomic_compare_exchange_strong(&r->used, &expect, true))
+            break;
+    }
+    if (r == NULL) {
+        r = calloc(1, sizeof(epoch_rec));
+        atomic_init(&r->used, true);
+        r->next = atomic_load(&recs);
+        while (!atomic_compare_exchange_weak(&recs, &r->next, r))
+            ;
+    }
+
+    pthread_once(&exit_once, make_key);
+    pthread_setspecific(exit_key, r);
+    self = r;
+    return r;
+}
+
+void epoch_enter(void)
+{
+    epoch_rec *r = get_rec();
+    if (r->depth++ > 0)
+        return;
+    // seq_cst so a writer scanning slots cannot miss us and still see our loads
+    atomic_store(&r->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void)
+{
+    epoch_rec *r = self;
+    if (--r->depth > 0)
+        return;
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+/* Move the global epoch on if every reader has caught up with it */
+static bool try_advance(void)
+{
+    uint64_t e = atomic_load(&global_epoch);
+    for (epoch_rec *r = atomic_load(&recs); r != NULL; r = r->next) {
+        uint64_t re = atomic_load(&r->epoch);
+        if (re != 0 && re != e)
+            return false;
+    }
+    return atomic_compare_exchange_strong(&global_epoch, &e, e + 1);
+}
+
+/* Free everything retired two or more epochs ago */
+static void reclaim(void)
+{
+    uint64_t e = atomic_load(&global_epoch);
+    limbo *done = NULL;
+
+    pthread_mutex_lock(&limbo_lock);
+    for (limbo **l = &limbo_head; *l != NULL;) {
+        if ((*l)->epoch + 2 <= e) {
+            limbo *x = *l;
+            *l = x->next;
+            x->next = done;
+            done = x;
+        } else {
+            l = &(*l)->next;
+        }
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    while (done) {
+        limbo *x = done;
+        done = x->next;
+        x->fn(x->p);
+        free(x);
+        atomic_fetch_add_explicit(&n_freed, 1, memory_order_relaxed);
+    }
+}
+
+void epoch_retire(void *p, void (*fn)(void *))
+{
+    limbo *l = malloc(sizeof(limbo));
+    l->p = p;
+    l->fn = fn;
+    l->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&limbo_lock);
+    l->next = limbo_head;
+    limbo_head = l;
+    pthread_mutex_unlock(&limbo_lock);
+    atomic_fetch_add_explicit(&n_retired, 1, memory_order_relaxed);
+
+    // writers drive reclamation; readers never wait on it
+    try_advance();
+    reclaim();
+}
+
+void epoch_synchronize(void)
+{
+    uint64_t target = atomic_load(&global_epoch) + 2;
+    while (atomic_load(&global_epoch) < target) {
+        if (!try_advance())
+            sched_yield();
+    }
+    reclaim();
+}
+
+void epoch_report(FILE *log)
+{
+    if (log == NULL)
+        return;
+    unsigned long retired = atomic_load(&n_retired), freed = atomic_load(&n_freed);
+    fprintf(log, "Epoch: %lu, %lu retired, %lu freed, %lu pending\n",
+            (unsigned long)atomic_load(&global_epoch), retired, freed, retired - freed);
+}
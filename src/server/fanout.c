@@ -0,0 +1,157 @@
+#include "fanout.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+typedef struct bcast {
+    const int *fds;
+    int n;
+    int skip_fd;
+    petr_header *h;
+    char *msg;
+    int chunks;        // total chunks
+    int claimed;       // chunks handed out, under lock
+    int done;          // chunks written, under lock
+    atomic_int sent;
+    pthread_cond_t finished;
+    struct bcast *next;
+} bcast_t;
+
+static int n_workers;
+static int (*send_fn)(int, petr_header *, char *);
+static FILE *a_log;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static bcast_t *active; // broadcasts with unclaimed chunks
+
+static atomic_ulong n_serial, n_parallel, n_frames;
+
+/* Claim the next chunk of the oldest active broadcast. Called with lock held. */
+static bcast_t *claim(int *chunk)
+{
+    bcast_t *b = active;
+    if (b == NULL)
+        return NULL;
+    *chunk = b->claimed++;
+    if (b->claimed == b->chunks)
+        active = b->next;
+    return b;
+}
+
+static void run_chunk(bcast_t *b, int chunk)
+{
+    int from = chunk * FANOUT_CHUNK;
+    int to = from + FANOUT_CHUNK < b->n ? from + FANOUT_CHUNK : b->n;
+    int sent = 0;
+
+    for (int i = from; i < to; ++i) {
+        if (b->fds[i] != b->skip_fd) {
+            send_fn(b->fds[i], b->h, b->msg);
+            sent++;
+        }
+    }
+    atomic_fetch_add_explicit(&b->sent, sent, memory_order_relaxed);
+
+    pthread_mutex_lock(&lock);
+    if (++b->done == b->chunks)
+        pthread_cond_signal(&b->finished);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+    // leave signals to the accept loop
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        int chunk;
+        pthread_mutex_lock(&lock);
+        bcast_t *b;
+        while ((b = claim(&chunk)) == NULL)
+            pthread_cond_wait(&work, &lock);
+        pthread_mutex_unlock(&lock);
+
+        run_chunk(b, chunk);
+    }
+    return NULL;
+}
+
+void fanout_init(int threads, int (*send)(int, petr_header *, char *), FILE *log)
+{
+    n_workers = threads > 0 ? threads : 0;
+    send_fn = send;
+    a_log = log;
+
+    for (int i = 0; i < n_workers; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            n_workers = i;
+            break;
+        }
+        pthread_detach(tid);
+    }
+}
+
+int fanout(const int *fds, int n, int skip_fd, petr_header *h, char *msg)
+{
+    if (n < FANOUT_MIN || n_workers == 0) {
+        int sent = 0;
+        for (int i = 0; i < n; ++i) {
+            if (fds[i] != skip_fd) {
+                send_fn(fds[i], h, msg);
+                sent++;
+            }
+        }
+        atomic_fetch_add_explicit(&n_serial, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&n_frames, sent, memory_order_relaxed);
+        return sent;
+    }
+
+    bcast_t b = {
+        .fds = fds, .n = n, .skip_fd = skip_fd, .h = h, .msg = msg,
+        .chunks = (n + FANOUT_CHUNK - 1) / FANOUT_CHUNK,
+        .finished = PTHREAD_COND_INITIALIZER
+    };
+    atomic_init(&b.sent, 0);
+
+    pthread_mutex_lock(&lock);
+    bcast_t **tail = &active;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = &b;
+    pthread_cond_broadcast(&work);
+
+    // help with our own broadcast rather than sleeping on it
+    while (b.claimed < b.chunks) {
+        int chunk = b.claimed++;
+        if (b.claimed == b.chunks) {
+            bcast_t **p = &active;
+            while (*p != &b)
+                p = &(*p)->next;
+            *p = b.next;
+        }
+        pthread_mutex_unlock(&lock);
+        run_chunk(&b, chunk);
+        pthread_mutex_lock(&lock);
+    }
+    while (b.done < b.chunks)
+        pthread_cond_wait(&b.finished, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_cond_destroy(&b.finished);
+
+    int sent = atomic_load(&b.sent);
+    atomic_fetch_add_explicit(&n_parallel, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&n_frames, sent, memory_order_relaxed);
+    return sent;
+}
+
+void fanout_report(void)
+{
+    if (a_log == NULL)
+        return;
+    fprintf(a_log, "Fan-out: %d workers, %lu serial and %lu parallel broadcasts, %lu frames\n",
+            n_workers, atomic_load(&n_serial), atomic_load(&n_parallel), atomic_load(&n_frames));
+}
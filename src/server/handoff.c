@@ -0,0 +1,195 @@
+#include "handoff.h"
+#include "transport.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Send one packet, optionally carrying fd as SCM_RIGHTS */
+static int ho_send(int chan, void *buf, size_t len, int fd)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (fd >= 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+
+    return sendmsg(chan, &msg, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* Receive one packet of exactly len bytes; *fd is -1 if none was attached */
+static int ho_recv(int chan, void *buf, size_t len, int *fd)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+    };
+
+    // received fds stay close-on-exec so the next upgrade does not leak them
+    ssize_t n = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+
+    // take the fd even off a short packet, so the caller can close it
+    int got = -1;
+    struct cmsghdr *c = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        memcpy(&got, CMSG_DATA(c), sizeof(int));
+    if (fd)
+        *fd = got;
+    else if (got >= 0)
+        close(got);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/* Send the three fds behind a shared-memory client */
+static int ho_send_xp(int chan, int fds[3])
+{
+    for (uint32_t i = 0; i < 3; ++i) {
+        ho_fd hf = { .which = i };
+        if (ho_send(chan, &hf, sizeof(hf), fds[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int handoff_send(int chan, int listen_fd, int unix_fd, userlist_t *users, roomlist_t *rooms,
+                 bool (*pending_tag)(int, uint32_t *))
+{
+    ho_hdr h = {
+        .magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+        .n_users = users->length, .n_rooms = rooms->length,
+        .has_unix = unix_fd >= 0
+    };
+    if (ho_send(chan, &h, sizeof(h), listen_fd) < 0)
+        return -1;
+    ho_fd hf = { .which = 0 };
+    if (unix_fd >= 0 && ho_send(chan, &hf, sizeof(hf), unix_fd) < 0)
+        return -1;
+
+    for (user_t *u = users->head; u != NULL; u = u->next) {
+        ho_user hu = { 0 };
+        int xp[3];
+        strcpy(hu.username, u->username);
+        hu.has_xp = xp_fds(u->user_fd, xp) == 0;
+        hu.tagged = pending_tag(u->user_fd, &hu.tag);
+        if (ho_send(chan, &hu, sizeof(hu), u->user_fd) < 0)
+            return -1;
+        if (hu.has_xp && ho_send_xp(chan, xp) < 0)
+            return -1;
+    }
+
+    for (room_t *r = rooms->head; r != NULL; r = r->next) {
+        memberlist_t *m = roomMembers(r);
+        ho_room hr = { .n_members = m->length };
+        strcpy(hr.roomname, r->roomname);
+        strcpy(hr.owner, r->owner);
+        if (ho_send(chan, &hr, sizeof(hr), -1) < 0)
+            return -1;
+        for (int i = 0; i < m->length; ++i) {
+            ho_user hu = { 0 };
+            strcpy(hu.username, m->names[i]);
+            if (ho_send(chan, &hu, sizeof(hu), -1) < 0)
+                return -1;
+        }
+    }
+
+    // new process acks once it has rebuilt everything
+    char ack;
+    return read(chan, &ack, 1) == 1 ? 0 : -1;
+}
+
+/* A handoff_recv that failed partway: close every fd it took in */
+static int drop_received(int listen_fd, int unix_fd, userlist_t *users, int *xp, int n_xp)
+{
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (unix_fd >= 0)
+        close(unix_fd);
+    for (user_t *u = users->head; u != NULL; u = u->next) {
+        xp_detach(u->user_fd);
+        close(u->user_fd);
+    }
+    for (int i = 0; i < n_xp; ++i)
+        if (xp[i] >= 0)
+            close(xp[i]);
+    return -1;
+}
+
+int handoff_recv(int chan, int *unix_fd, userlist_t *users, roomlist_t *rooms,
+                 void (*restore_tag)(int, uint32_t))
+{
+    ho_hdr h;
+    ho_fd hf;
+    int listen_fd;
+    *unix_fd = -1;
+    if (ho_recv(chan, &h, sizeof(h), &listen_fd) < 0 || listen_fd < 0
+        || h.magic != HANDOFF_MAGIC || h.version != HANDOFF_VERSION)
+        return drop_received(listen_fd, -1, users, NULL, 0);
+    if (h.has_unix && ho_recv(chan, &hf, sizeof(hf), unix_fd) < 0)
+        return drop_received(listen_fd, *unix_fd, users, NULL, 0);
+
+    for (uint32_t i = 0; i < h.n_users; ++i) {
+        ho_user hu;
+        int fd;
+        if (ho_recv(chan, &hu, sizeof(hu), &fd) < 0 || fd < 0) {
+            if (fd >= 0)
+                close(fd);
+            return drop_received(listen_fd, *unix_fd, users, NULL, 0);
+        }
+        hu.username[STR_MAX - 1] = '\0';
+        addUser(users, hu.username, fd);
+        if (hu.tagged)
+            restore_tag(fd, hu.tag);
+
+        if (hu.has_xp) {
+            int xp[3] = { -1, -1, -1 };
+            for (int j = 0; j < 3; ++j)
+                if (ho_recv(chan, &hf, sizeof(hf), &xp[j]) < 0 || xp[j] < 0)
+                    return drop_received(listen_fd, *unix_fd, users, xp, 3);
+            if (xp_attach(fd, xp[0], xp[1], xp[2]) < 0)
+                return drop_received(listen_fd, *unix_fd, users, xp, 3);
+        }
+    }
+
+    for (uint32_t i = 0; i < h.n_rooms; ++i) {
+        ho_room hr;
+        if (ho_recv(chan, &hr, sizeof(hr), NULL) < 0)
+            return drop_received(listen_fd, *unix_fd, users, NULL, 0);
+        hr.roomname[STR_MAX - 1] = hr.owner[STR_MAX - 1] = '\0';
+
+        user_t *owner = getUserByName(users, hr.owner);
+        if (owner)
+            addRoom(rooms, hr.roomname, *owner); // adds owner to room as well
+
+        for (uint32_t j = 0; j < hr.n_members; ++j) {
+            ho_user hu;
+            if (ho_recv(chan, &hu, sizeof(hu), NULL) < 0)
+                return drop_received(listen_fd, *unix_fd, users, NULL, 0);
+            hu.username[STR_MAX - 1] = '\0';
+
+            user_t *u = getUserByName(users, hu.username);
+            if (owner && u && strcmp(hu.username, hr.owner) != 0)
+                addUserToRoom(getRoom(rooms, hr.roomname), *u);
+        }
+    }
+
+    char ack = 1;
+    if (write(chan, &ack, 1) != 1)
+        return drop_received(listen_fd, *unix_fd, users, NULL, 0);
+    return listen_fd;
+}
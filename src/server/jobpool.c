@@ -0,0 +1,137 @@
+#include "jobpool.h"
+#include "admit.h"
+#include "audit.h"
+#include "clock.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static int pool_min, pool_max;
+static void *(*pool_worker)(void *);
+static FILE *a_log;
+
+static atomic_int threads;  // live workers
+static atomic_int busy;     // workers handling a job
+static atomic_int retiring; // idle workers asked to exit
+static atomic_ulong grows, shrinks;
+static atomic_long spawned; // passed to each worker, e.g. for CPU placement
+
+void jobpool_init(int min, int max, void *(*worker)(void *), FILE *log)
+{
+    pool_min = min > 0 ? min : 1;
+    pool_max = max > pool_min ? max : pool_min;
+    pool_worker = worker;
+    a_log = log;
+}
+
+static void spawn(void)
+{
+    pthread_t tid;
+    atomic_fetch_add(&threads, 1);
+    intptr_t seq = atomic_fetch_add(&spawned, 1);
+    if (pthread_create(&tid, NULL, pool_worker, (void *)seq) != 0) {
+        atomic_fetch_sub(&threads, 1);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void jobpool_busy(void)
+{
+    atomic_fetch_add_explicit(&busy, 1, memory_order_relaxed);
+}
+
+void jobpool_idle(void)
+{
+    atomic_fetch_sub_explicit(&busy, 1, memory_order_relaxed);
+}
+
+bool jobpool_retire(void)
+{
+    int r = atomic_load(&retiring);
+    while (r > 0) {
+        if (atomic_compare_exchange_weak(&retiring, &r, r - 1)) {
+            atomic_fetch_sub(&threads, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NS_PER_SEC
+         + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * NS_PER_US;
+}
+
+static void *controller(void *arg)
+{
+    // housekeeping only; leave signals to the accept loop
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t last_wall = mono_ns(), last_cpu = cpu_ns();
+    uint64_t target = admit_target_delay_ns() / 2;
+    if (target < JOBPOOL_MIN_TARGET_US * NS_PER_US)
+        target = JOBPOOL_MIN_TARGET_US * NS_PER_US; // -d 0 must not mean any delay at all
+    int quiet = 0;
+
+    while (1) {
+        usleep(JOBPOOL_TICK_MS * 1000);
+
+        uint64_t wall = mono_ns(), cpu = cpu_ns();
+        int util = (int)(100 * (cpu - last_cpu) / ((wall - last_wall) * (ncpu > 0 ? ncpu : 1)));
+        last_wall = wall;
+        last_cpu = cpu;
+
+        uint64_t delay = admit_delay_ns();
+        int queued = admit_queued();
+        int n = atomic_load(&threads) - atomic_load(&retiring);
+        int idle = n - atomic_load(&busy);
+
+        if ((delay > target || queued > n) && idle == 0 && util < JOBPOOL_MAX_CPU && n < pool_max) {
+            // requests are waiting and every worker is busy: add one
+            spawn();
+            atomic_fetch_add(&grows, 1);
+            quiet = 0;
+            audit(AUDIT_EVENT, "Job pool grow %d -> %d (queue delay %lu us, cpu %d%%)\n",
+                  n, n + 1, (unsigned long)(delay / NS_PER_US), util);
+        } else if (delay <= target / 4 && queued == 0 && idle > 1 && n > pool_min) {
+            if (++quiet >= JOBPOOL_SHRINK_TICKS) {
+                atomic_fetch_add(&retiring, 1);
+                atomic_fetch_add(&shrinks, 1);
+                quiet = 0;
+                audit(AUDIT_EVENT, "Job pool shrink %d -> %d (queue delay %lu us, cpu %d%%)\n",
+                      n, n - 1, (unsigned long)(delay / NS_PER_US), util);
+            }
+        } else {
+            quiet = 0;
+        }
+    }
+    return NULL;
+}
+
+void jobpool_start(void)
+{
+    for (int i = 0; i < pool_min; ++i)
+        spawn();
+
+    if (pool_max > pool_min) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, controller, NULL);
+        pthread_detach(tid);
+    }
+}
+
+void jobpool_report(void)
+{
+    fprintf(a_log, "Job pool: %d threads (min %d, max %d), %lu grows, %lu shrinks\n",
+            atomic_load(&threads), pool_min, pool_max,
+            atomic_load(&grows), atomic_load(&shrinks));
+}
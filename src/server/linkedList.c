@@ -1,5 +1,9 @@
 #include "linkedList.h"
+#include "epoch.h"
 #include <string.h>
+
+pool_t user_pool = POOL_INIT("user_t", sizeof(user_t));
+pool_t room_pool = POOL_INIT("room_t", sizeof(room_t));
 /*
     What is a linked list?
     A linked list is a set of dynamically allocated nodes, arranged in
@@ -28,7 +32,7 @@ void insertFront(userlist_t* list, char* un, int fd) {
 
     user_t** head = &(list->head);
     user_t* new_node;
-    new_node = malloc(sizeof(user_t));
+    new_node = pool_alloc(&user_pool);
 
     strcpy(new_node->username, un);
     new_node->user_fd = fd;
@@ -50,7 +54,7 @@ void addUser(userlist_t* list, char* un, int fd) {
         current = current->next;
     }
 
-    current->next = malloc(sizeof(user_t));
+    current->next = pool_alloc(&user_pool);
     strcpy(current->next->username, un);
     current->next->user_fd = fd;
     current->next->next = NULL;
@@ -70,7 +74,7 @@ void removeFront(userlist_t* list) {
 
     user_t* temp = *head;
     *head = next_node;
-    free(temp);
+    pool_free(&user_pool, temp);
 }
 
 void removeRear(userlist_t* list) {
@@ -88,7 +92,7 @@ void removeRear(userlist_t* list) {
         current = current->next;
     }
 
-    free(current->next);
+    pool_free(&user_pool, current->next);
     current->next = NULL;
 
     list->length--;
@@ -108,7 +112,7 @@ void removeByIndex(userlist_t* list, int index) {
     if (index == 0) {
 		user_t* temp = *head;
         *head = current->next;
-        free(temp);
+        pool_free(&user_pool, temp);
         
 		list->length--;
 		return;
@@ -120,7 +124,7 @@ void removeByIndex(userlist_t* list, int index) {
     }
 
     prev->next = current->next;
-    free(current);
+    pool_free(&user_pool, current);
 
     list->length--;
 }
@@ -191,30 +195,93 @@ int nameExists(userlist_t *list, char *name)
     return exists;
 }
 
+memberlist_t* roomMembers(room_t* room) {
+    return atomic_load_explicit(&room->members, memory_order_acquire);
+}
+
+static memberlist_t* newMembers(uint64_t version, int cap) {
+    memberlist_t *m = malloc(sizeof(memberlist_t));
+    m->version = version;
+    m->fds = malloc(cap * sizeof(int));
+    m->names = malloc(cap * sizeof(char*));
+    m->length = 0;
+    m->cap = cap;
+    return m;
+}
+
+static void freeHeader(void* p) {
+    free(p);
+}
+
+static void freeMembers(void* p) {
+    memberlist_t *m = p;
+    free(m->fds);
+    free(m->names);
+    free(m);
+}
+
 void addUserToRoom(room_t* room, user_t user) {
-    addUser(room->userlist, user.username, user.user_fd);
+    memberlist_t *old = roomMembers(room), *m;
+    if (old->length < old->cap) {
+        // slots past old->length are invisible to anyone holding old
+        m = malloc(sizeof(memberlist_t));
+        *m = *old;
+        m->version++;
+    } else {
+        m = newMembers(old->version + 1, old->cap ? 2 * old->cap : 8);
+        memcpy(m->fds, old->fds, old->length * sizeof(int));
+        memcpy(m->names, old->names, old->length * sizeof(char*));
+        m->length = old->length;
+    }
+    m->fds[m->length] = user.user_fd;
+    m->names[m->length] = strdup(user.username);
+    m->length++;
+
+    atomic_store_explicit(&room->members, m, memory_order_release);
+    // a header sharing the arrays goes alone; the arrays go with the last one
+    epoch_retire(old, m->fds == old->fds ? freeHeader : freeMembers);
 }
 
-// rooms
-void addRoomFront(roomlist_t* list, char* name, user_t owner) {
-    if (list->length == 0)
-        list->head = NULL;
+int memberIndexByFD(room_t* room, int fd) {
+    memberlist_t *m = roomMembers(room);
+    for (int i = 0; i < m->length; ++i) {
+        if (m->fds[i] == fd)
+            return i;
+    }
+    return -1;
+}
 
-    room_t** head = &(list->head);
-    room_t* new_node;
-    new_node = malloc(sizeof(room_t));
+static void freeRoom(void* p) {
+    room_t *r = p;
+    memberlist_t *m = atomic_load(&r->members);
+    for (int i = 0; i < m->length; ++i)
+        free(m->names[i]); // names outlive snapshots; they go with the member
+    freeMembers(m);
+    pool_free(&room_pool, r);
+}
 
-    strcpy(new_node->roomname, name);
-    strcpy(new_node->owner, owner.username);
+static room_t* newRoom(char* name, user_t owner) {
+    static atomic_ulong created;
+    room_t *r = pool_alloc(&room_pool);
+    r->id = atomic_fetch_add_explicit(&created, 1, memory_order_relaxed) + 1;
+    strcpy(r->roomname, name);
+    strcpy(r->owner, owner.username);
+    memberlist_t *m = newMembers(0, 8);
+    m->fds[0] = owner.user_fd; // owner is the first member
+    m->names[0] = strdup(owner.username);
+    m->length = 1;
+    atomic_init(&r->members, m);
+    atomic_init(&r->next, NULL);
+    return r;
+}
 
-    // create new userlist
-    new_node->userlist = malloc(sizeof(userlist_t));
-    new_node->userlist->head = NULL;
-    new_node->userlist->length = 0;
-    addUserToRoom(new_node, owner); // add owner to room
+// rooms
+void addRoomFront(roomlist_t* list, char* name, user_t owner) {
+    room_t* new_node = newRoom(name, owner);
 
-    new_node->next = *head;
-    *head = new_node;
+    // fully built before readers can reach it
+    new_node->next = list->head;
+    list->head = new_node;
     list->length++; 
 }
 
@@ -230,15 +297,7 @@ void addRoom(roomlist_t* list, char* name, user_t owner) {
         current = current->next;
     }
 
-    current->next = malloc(sizeof(room_t));
-    strcpy(current->next->roomname, name);
-    strcpy(current->next->owner, owner.username);
-    // create new userlist
-    current->next->userlist = malloc(sizeof(userlist_t));
-    current->next->userlist->head = NULL;
-    current->next->userlist->length = 0;
-    addUserToRoom(current->next, owner); // add owner to room
-    current->next->next = NULL;
+    current->next = newRoom(name, owner); // fully built before readers can reach it
 
     list->length++;
 }
@@ -257,17 +316,16 @@ int removeRoom(roomlist_t* list, char* name) {
     
     for (room_t* c = list->head; c != NULL; c = c->next) {
         if (c->roomname == name) {
+            // readers may still be on c; it keeps its next until reclaimed
             if (c == list->head) {
                 list->head = c->next;
-                deleteUserList(c->userlist);
-                free(c);
+                epoch_retire(c, freeRoom);
 
                 list->length--;
                 return 0;
             } else {
                 prev->next = c->next;
-                deleteUserList(c->userlist);
-                free(c);
+                epoch_retire(c, freeRoom);
 
                 list->length--;
                 return 0;
@@ -280,31 +338,37 @@ int removeRoom(roomlist_t* list, char* name) {
 }
 
 int removeUserFromRoom(roomlist_t* list, room_t* room, user_t u) {
-    int index = getIndexByFD(room->userlist, u.user_fd);
+    int index = memberIndexByFD(room, u.user_fd);
     
     if (index < 0) {
         return -1;
     } else {
-        removeByIndex(room->userlist, index);
+        // readers keep the old snapshot; build one without index
+        memberlist_t *old = roomMembers(room);
+        memberlist_t *m = newMembers(old->version + 1, old->cap);
+        memcpy(m->fds, old->fds, index * sizeof(int));
+        memcpy(m->fds + index, old->fds + index + 1, (old->length - index - 1) * sizeof(int));
+        memcpy(m->names, old->names, index * sizeof(char*));
+        memcpy(m->names + index, old->names + index + 1, (old->length - index - 1) * sizeof(char*));
+        m->length = old->length - 1;
+
+        atomic_store_explicit(&room->members, m, memory_order_release);
+        epoch_retire(old->names[index], free);
+        epoch_retire(old, freeMembers);
         return 0;
     }
 }
 
 void removeRoomListFront(roomlist_t* list) {
-    room_t** head = &(list->head);
-    room_t* next_node = NULL;
-
     if (list->length == 0) {
         return;
     }
 
-    next_node = (*head)->next;
+    room_t* temp = list->head;
+    list->head = temp->next;
     list->length--;
 
-    room_t* temp = *head;
-    *head = next_node;
-    deleteUserList(temp->userlist);
-    free(temp);
+    freeRoom(temp); // shutdown only, no readers left
 }
 
 
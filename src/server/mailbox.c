@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "mailbox.h"
+#include "clock.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAILBOX_BUCKETS 4096 // boxes by name
+#define IN_MEMORY UINT32_MAX
+
+typedef struct mail {
+    struct mail *next;
+    uint32_t off; // record in the segment, IN_MEMORY if f holds the frame
+    rframe_t *f;
+    petr_header h;
+} mail_t;
+
+typedef struct box {
+    struct box *next; // hash chain
+    char name[STR_MAX];
+    uint64_t seen;    // mono ns went offline
+    mail_t *mail, **tail;
+    int n;
+    size_t bytes, mem;
+} box_t;
+
+/* Segment record, 8 byte aligned. A dead one pads out the end before a wrap. */
+typedef struct {
+    uint32_t size; // whole record
+    uint32_t dead; // delivered or dropped
+    char body[];
+} rec_t;
+
+static FILE *a_log;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static box_t *table[MAILBOX_BUCKETS];
+static int n_boxes;
+static size_t mem; // bodies held in memory
+static uint64_t last_sweep;
+
+// the spill segment: live records run from head to tail, wrapping
+static char *seg;
+static size_t seg_size, seg_head, seg_tail, seg_used;
+
+static atomic_ulong n_queued, n_spilled, n_delivered, n_full, n_dropped;
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % MAILBOX_BUCKETS;
+}
+
+static box_t **find(const char *name)
+{
+    box_t **p = &table[name_hash(name)];
+    while (*p && strcmp((*p)->name, name) != 0)
+        p = &(*p)->next;
+    return p;
+}
+
+/* @return offset of the new record, IN_MEMORY if the segment is full */
+static uint32_t seg_append(const char *body, uint32_t len)
+{
+    size_t need = (sizeof(rec_t) + len + 7) & ~(size_t)7;
+    size_t at = seg_tail;
+    if (seg_used == 0 || seg_tail > seg_head) {
+        // free: [tail, end) and [0, head)
+        if (seg_size - seg_tail < need) {
+            if (seg_head < need)
+                return IN_MEMORY;
+            rec_t *pad = (rec_t *)(seg + seg_tail);
+            pad->size = seg_size - seg_tail;
+            pad->dead = 1;
+            seg_used += pad->size;
+            at = 0;
+        }
+    } else if (seg_head - seg_tail < need) {
+        return IN_MEMORY; // free: [tail, head)
+    }
+
+    rec_t *r = (rec_t *)(seg + at);
+    r->size = need;
+    r->dead = 0;
+    memcpy(r->body, body, len);
+    seg_used += need;
+    seg_tail = at + need == seg_size ? 0 : at + need;
+    return at;
+}
+
+/* Free the record at off, and every dead one from the head on */
+static void seg_release(uint32_t off)
+{
+    ((rec_t *)(seg + off))->dead = 1;
+    while (seg_used > 0) {
+        rec_t *r = (rec_t *)(seg + seg_head);
+        if (!r->dead)
+            break;
+        seg_used -= r->size;
+        seg_head = seg_head + r->size == seg_size ? 0 : seg_head + r->size;
+    }
+    if (seg_used == 0)
+        seg_head = seg_tail = 0;
+}
+
+static void empty(box_t *b)
+{
+    b->mail = NULL;
+    b->tail = &b->mail;
+    b->n = 0;
+    b->bytes = b->mem = 0;
+}
+
+static void free_mail(box_t *b)
+{
+    for (mail_t *m = b->mail, *next; m != NULL; m = next) {
+        next = m->next;
+        if (m->off == IN_MEMORY) {
+            mem -= m->h.msg_len;
+            free(m->f);
+        } else {
+            seg_release(m->off);
+        }
+        free(m);
+    }
+    empty(b);
+}
+
+/* Drop boxes of users gone longer than MAILBOX_KEEP_S, at most once a second */
+static void sweep(uint64_t now)
+{
+    if (now - last_sweep < NS_PER_SEC)
+        return;
+    last_sweep = now;
+    for (int i = 0; i < MAILBOX_BUCKETS; ++i) {
+        for (box_t **p = &table[i]; *p != NULL;) {
+            box_t *b = *p;
+            if (now - b->seen <= MAILBOX_KEEP_S * NS_PER_SEC) {
+                p = &b->next;
+                continue;
+            }
+            atomic_fetch_add_explicit(&n_dropped, b->n, memory_order_relaxed);
+            *p = b->next;
+            free_mail(b);
+            free(b);
+            n_boxes--;
+        }
+    }
+}
+
+int mailbox_init(int segment_mb, FILE *log)
+{
+    a_log = log;
+    if (segment_mb <= 0)
+        return 0;
+    const char *dir = getenv("TMPDIR");
+    int fd = open(dir ? dir : "/var/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    seg_size = (size_t)segment_mb << 20;
+    if (ftruncate(fd, seg_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    seg = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps it
+    if (seg == MAP_FAILED) {
+        seg = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+bool mailbox_enabled(void)
+{
+    return seg != NULL;
+}
+
+void mailbox_seen(const char *name)
+{
+    if (seg == NULL)
+        return;
+    uint64_t now = mono_ns();
+    pthread_mutex_lock(&lock);
+    box_t **p = find(name), *b = *p;
+    if (b == NULL && n_boxes >= MAILBOX_MAX_BOXES)
+        sweep(now);
+    if (b == NULL && n_boxes < MAILBOX_MAX_BOXES) {
+        b = calloc(1, sizeof(box_t));
+        strcpy(b->name, name);
+        b->tail = &b->mail;
+        b->next = table[name_hash(name)];
+        table[name_hash(name)] = b;
+        n_boxes++;
+    }
+    if (b)
+        b->seen = now;
+    pthread_mutex_unlock(&lock);
+}
+
+enum mail_result mailbox_put(const char *name, petr_header *h, const char *body)
+{
+    if (seg == NULL)
+        return MAIL_UNKNOWN;
+    uint64_t now = mono_ns();
+    uint32_t len = h->msg_len;
+    pthread_mutex_lock(&lock);
+    box_t *b = *find(name);
+    if (b == NULL || now - b->seen > MAILBOX_KEEP_S * NS_PER_SEC) {
+        pthread_mutex_unlock(&lock);
+        return MAIL_UNKNOWN;
+    }
+    if (b->n >= MAILBOX_USER_FRAMES || b->bytes + len > MAILBOX_USER_BYTES) {
+        pthread_mutex_unlock(&lock);
+        atomic_fetch_add_explicit(&n_full, 1, memory_order_relaxed);
+        return MAIL_FULL;
+    }
+
+    mail_t *m = malloc(sizeof(mail_t));
+    m->next = NULL;
+    m->h = *h;
+    m->f = NULL;
+    m->off = IN_MEMORY;
+    if (b->mem + len <= MAILBOX_USER_MEM && mem + len <= MAILBOX_MEM_BYTES) {
+        m->f = malloc(sizeof(rframe_t) + len);
+        m->f->next = NULL;
+        m->f->h = *h;
+        memcpy(m->f->body, body, len);
+        b->mem += len;
+        mem += len;
+    } else {
+        m->off = seg_append(body, len);
+        if (m->off == IN_MEMORY) {
+            sweep(now); // b itself is recent, so survives this
+            m->off = seg_append(body, len);
+        }
+        if (m->off == IN_MEMORY) {
+            pthread_mutex_unlock(&lock);
+            free(m);
+            atomic_fetch_add_explicit(&n_full, 1, memory_order_relaxed);
+            return MAIL_FULL;
+        }
+        atomic_fetch_add_explicit(&n_spilled, 1, memory_order_relaxed);
+    }
+    *b->tail = m;
+    b->tail = &m->next;
+    b->n++;
+    b->bytes += len;
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&n_queued, 1, memory_order_relaxed);
+    return MAIL_QUEUED;
+}
+
+rframe_t *mailbox_take(const char *name)
+{
+    if (seg == NULL)
+        return NULL;
+    rframe_t *frames = NULL, **tail = &frames;
+    pthread_mutex_lock(&lock);
+    box_t *b = *find(name);
+    if (b == NULL || b->mail == NULL) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    int n = b->n;
+    for (mail_t *m = b->mail, *next; m != NULL; m = next) {
+        next = m->next;
+        rframe_t *f = m->f;
+        if (m->off == IN_MEMORY) {
+            mem -= m->h.msg_len;
+        } else {
+            f = malloc(sizeof(rframe_t) + m->h.msg_len);
+            f->next = NULL;
+            f->h = m->h;
+            memcpy(f->body, ((rec_t *)(seg + m->off))->body, m->h.msg_len);
+            seg_release(m->off);
+        }
+        *tail = f;
+        tail = &f->next;
+        free(m);
+    }
+    empty(b);
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&n_delivered, n, memory_order_relaxed);
+    return frames;
+}
+
+void mailbox_report(void)
+{
+    if (a_log == NULL || seg == NULL)
+        return;
+    pthread_mutex_lock(&lock);
+    fprintf(a_log, "Mailboxes: %lu queued (%lu spilled), %lu delivered, %lu refused over quota, "
+            "%lu dropped unread; %d boxes, %zu bytes in memory, %zu of %zu segment bytes used\n",
+            atomic_load(&n_queued), atomic_load(&n_spilled), atomic_load(&n_delivered),
+            atomic_load(&n_full), atomic_load(&n_dropped), n_boxes, mem, seg_used, seg_size);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,33 @@
+#include "payload.h"
+#include <string.h>
+
+/* Copy s to buf at off, leaving room for the null terminator */
+static size_t append(char *buf, size_t size, size_t off, const char *s, size_t len)
+{
+    if (off + len >= size)
+        len = off < size ? size - off - 1 : 0;
+    memcpy(buf + off, s, len);
+    return off + len;
+}
+
+/* "room\r\nfrom\r\nmsg" */
+size_t build_rmrecv(char *buf, size_t size, const char *room, const char *from, const char *msg, size_t msg_len)
+{
+    size_t off = append(buf, size, 0, room, strlen(room));
+    off = append(buf, size, off, "\r\n", 2);
+    off = append(buf, size, off, from, strlen(from));
+    off = append(buf, size, off, "\r\n", 2);
+    off = append(buf, size, off, msg, msg_len);
+    buf[off] = '\0';
+    return off;
+}
+
+/* "from\r\nmsg" */
+size_t build_usrrecv(char *buf, size_t size, const char *from, const char *msg, size_t msg_len)
+{
+    size_t off = append(buf, size, 0, from, strlen(from));
+    off = append(buf, size, off, "\r\n", 2);
+    off = append(buf, size, off, msg, msg_len);
+    buf[off] = '\0';
+    return off;
+}
@@ -0,0 +1,217 @@
+#include "pool.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    pool_t *pool;
+    pool_obj *free;
+    size_t n_free;
+} pool_cache;
+
+/*
+ * A thread's alloc and free counts, by pool id. Only the owning thread
+ * writes them, so a relaxed load and store is enough and the fast path
+ * takes no locked instruction. Nodes are never freed: a thread's node is
+ * handed to the next new thread when it exits, counts and all, so the
+ * report can walk the list without locks and sum exact totals.
+ */
+typedef struct pool_stats {
+    struct pool_stats *next;
+    atomic_bool busy;
+    atomic_ulong allocs[POOL_MAX_TYPES];
+    atomic_ulong frees[POOL_MAX_TYPES];
+} pool_stats;
+
+static __thread pool_cache caches[POOL_MAX_TYPES];
+static __thread pool_stats *stats;
+static _Atomic(pool_stats *) all_stats;
+static atomic_int n_pools;
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static inline void bump(atomic_ulong *n)
+{
+    atomic_store_explicit(n, atomic_load_explicit(n, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/* Hand a thread's cached objects back, and its stats node on, when it exits */
+static void flush_caches(void *arg)
+{
+    pool_cache *c = arg;
+    for (int i = 0; i < POOL_MAX_TYPES; ++i) {
+        if (c[i].free == NULL)
+            continue;
+        pool_obj *last = c[i].free;
+        while (last->next)
+            last = last->next;
+        pthread_mutex_lock(&c[i].pool->lock);
+        last->next = c[i].pool->free;
+        c[i].pool->free = c[i].free;
+        c[i].pool->n_free += c[i].n_free;
+        pthread_mutex_unlock(&c[i].pool->lock);
+        c[i].free = NULL;
+        c[i].n_free = 0;
+    }
+    atomic_store_explicit(&stats->busy, false, memory_order_release);
+    stats = NULL;
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&exit_key, flush_caches);
+}
+
+/* Claim a node a finished thread left behind, else add a new one */
+static pool_stats *claim_stats(void)
+{
+    for (pool_stats *s = atomic_load(&all_stats); s != NULL; s = s->next) {
+        bool idle = false;
+        if (!atomic_load_explicit(&s->busy, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&s->busy, &idle, true))
+            return s;
+    }
+    pool_stats *s = calloc(1, sizeof(pool_stats));
+    if (s == NULL)
+        return NULL;
+    s->busy = true;
+    s->next = atomic_load(&all_stats);
+    while (!atomic_compare_exchange_weak(&all_stats, &s->next, s))
+        ;
+    return s;
+}
+
+/* Pools get a cache slot on first use; past POOL_MAX_TYPES they have none (-1) */
+static int pool_id(pool_t *p)
+{
+    int id = atomic_load_explicit(&p->id, memory_order_acquire);
+    if (id != 0)
+        return id > 0 ? id - 1 : -1;
+    pthread_mutex_lock(&p->lock);
+    if ((id = atomic_load(&p->id)) == 0) {
+        int n = atomic_fetch_add(&n_pools, 1);
+        id = n < POOL_MAX_TYPES ? n + 1 : -1;
+        atomic_store_explicit(&p->id, id, memory_order_release);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return id > 0 ? id - 1 : -1;
+}
+
+static pool_cache *cache_for(pool_t *p)
+{
+    int id = pool_id(p);
+    if (id < 0)
+        return NULL;
+    if (stats == NULL) {
+        // first use of any pool on this thread registers the exit hook
+        if ((stats = claim_stats()) == NULL)
+            return NULL;
+        pthread_once(&exit_once, make_key);
+        pthread_setspecific(exit_key, caches);
+    }
+    caches[id].pool = p;
+    return &caches[id];
+}
+
+/* Move up to POOL_BATCH objects from the shared list, carving a slab if it is empty */
+static void refill(pool_t *p, pool_cache *c)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->free == NULL) {
+        char *slab = malloc(p->size * POOL_SLAB_OBJS);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        for (int i = POOL_SLAB_OBJS - 1; i >= 0; --i) {
+            pool_obj *o = (pool_obj *)(slab + i * p->size);
+            o->next = p->free;
+            p->free = o;
+        }
+        p->n_free += POOL_SLAB_OBJS;
+        atomic_fetch_add_explicit(&p->slabs, 1, memory_order_relaxed);
+    }
+    for (int i = 0; i < POOL_BATCH && p->free; ++i) {
+        pool_obj *o = p->free;
+        p->free = o->next;
+        p->n_free--;
+        o->next = c->free;
+        c->free = o;
+        c->n_free++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    atomic_fetch_add_explicit(&p->refills, 1, memory_order_relaxed);
+}
+
+void *pool_alloc(pool_t *p)
+{
+    pool_cache *c = cache_for(p);
+    if (c == NULL) {
+        void *o = malloc(p->size); // never freed to the pool; see POOL_MAX_TYPES
+        if (o)
+            atomic_fetch_add_explicit(&p->allocs, 1, memory_order_relaxed);
+        return o;
+    }
+
+    if (c->free == NULL)
+        refill(p, c);
+    pool_obj *o = c->free;
+    if (o == NULL)
+        return NULL;
+    c->free = o->next;
+    c->n_free--;
+    bump(&stats->allocs[p->id - 1]);
+    return o;
+}
+
+void pool_free(pool_t *p, void *obj)
+{
+    if (obj == NULL)
+        return;
+    pool_cache *c = cache_for(p);
+    pool_obj *o = obj;
+    if (c == NULL) {
+        atomic_fetch_add_explicit(&p->frees, 1, memory_order_relaxed);
+        pthread_mutex_lock(&p->lock);
+        o->next = p->free;
+        p->free = o;
+        p->n_free++;
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    o->next = c->free;
+    c->free = o;
+    c->n_free++;
+    bump(&stats->frees[p->id - 1]);
+
+    // keep at most two batches locally; return one so other threads can use it
+    if (c->n_free > 2 * POOL_BATCH) {
+        pool_obj *head = c->free, *last = head;
+        for (int i = 1; i < POOL_BATCH; ++i)
+            last = last->next;
+        c->free = last->next;
+        c->n_free -= POOL_BATCH;
+
+        pthread_mutex_lock(&p->lock);
+        last->next = p->free;
+        p->free = head;
+        p->n_free += POOL_BATCH;
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void pool_report(pool_t *p, FILE *log)
+{
+    if (log == NULL)
+        return;
+    // allocs and frees on threads without a cache slot, then every thread's
+    unsigned long allocs = atomic_load(&p->allocs), frees = atomic_load(&p->frees);
+    int id = atomic_load(&p->id) - 1;
+    for (pool_stats *s = id < 0 ? NULL : atomic_load(&all_stats); s != NULL; s = s->next) {
+        allocs += atomic_load_explicit(&s->allocs[id], memory_order_relaxed);
+        frees += atomic_load_explicit(&s->frees[id], memory_order_relaxed);
+    }
+    unsigned long slabs = atomic_load(&p->slabs);
+    fprintf(log, "Pool %s: %lu slabs (%lu KiB), %ld live, %lu allocs, %lu frees, %lu refills\n",
+            p->name, slabs, slabs * POOL_SLAB_OBJS * p->size / 1024, (long)(allocs - frees),
+            allocs, frees, atomic_load(&p->refills));
+}
@@ -0,0 +1,384 @@
+#include "resume.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#define RESUME_BUCKETS 4096 // sessions by name
+
+enum { S_LIVE, S_PARKED, S_CLAIMED, S_EXPIRED };
+
+typedef struct session {
+    struct session *next;     // hash chain
+    struct session *p_next;   // parked list, while not live
+    char name[STR_MAX];
+    char token[RESUME_TOKEN_LEN + 1];
+    int state;
+    char (*rooms)[STR_MAX];   // rooms to rejoin, "" once closed
+    uint64_t *left, *joined;  // buffer room messages on versions in [left, joined)
+    int n_rooms;
+    rframe_t *frames, **f_tail;
+    int n_frames;
+    size_t n_bytes;
+    wtimer_t grace;
+} session_t;
+
+static FILE *a_log;
+static uint32_t grace_ms; // 0 = off
+static int doorbell = -1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static session_t *table[RESUME_BUCKETS];
+static session_t *parked;
+static atomic_int n_parked; // lets room sends skip the lock when nobody is parked
+
+static atomic_ulong n_opened, n_parks, n_resumed, n_expired, n_evicted, n_buffered, n_lost;
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % RESUME_BUCKETS;
+}
+
+static session_t **find(const char *name)
+{
+    session_t **p = &table[name_hash(name)];
+    while (*p && strcmp((*p)->name, name) != 0)
+        p = &(*p)->next;
+    return p;
+}
+
+static void new_token(char token[RESUME_TOKEN_LEN + 1])
+{
+    unsigned char raw[RESUME_TOKEN_LEN / 2];
+    if (getrandom(raw, sizeof(raw), 0) != sizeof(raw))
+        abort(); // never with a seeded kernel pool and a small read
+    for (size_t i = 0; i < sizeof(raw); ++i)
+        sprintf(token + 2 * i, "%02x", raw[i]);
+}
+
+static void unpark(session_t *s)
+{
+    session_t **p = &parked;
+    while (*p != s)
+        p = &(*p)->p_next;
+    *p = s->p_next;
+    s->p_next = NULL;
+    atomic_fetch_sub(&n_parked, 1);
+}
+
+static void free_rooms(session_t *s)
+{
+    free(s->rooms);
+    free(s->left);
+    free(s->joined);
+    s->rooms = NULL;
+    s->left = s->joined = NULL;
+    s->n_rooms = 0;
+}
+
+/* Unlinked already; wait out a grace callback that may be running */
+static void free_session(session_t *s)
+{
+    timer_cancel_sync(&s->grace);
+    resume_free_frames(s->frames);
+    free_rooms(s);
+    free(s);
+}
+
+static void grace_expired(void *arg)
+{
+    session_t *s = arg;
+    pthread_mutex_lock(&lock);
+    bool expired = s->state == S_PARKED;
+    if (expired)
+        s->state = S_EXPIRED;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t one = 1;
+    if (expired)
+        write(doorbell, &one, sizeof(one));
+}
+
+void resume_init(int grace_s, FILE *log)
+{
+    a_log = log;
+    grace_ms = grace_s > 0 ? grace_s * 1000 : 0;
+    if (grace_ms)
+        doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+bool resume_enabled(void)
+{
+    return grace_ms > 0;
+}
+
+int resume_doorbell(void)
+{
+    return doorbell;
+}
+
+bool resume_open(const char *name, char token[RESUME_TOKEN_LEN + 1])
+{
+    if (!grace_ms)
+        return false;
+    session_t *s = calloc(1, sizeof(session_t));
+    strcpy(s->name, name);
+    new_token(s->token);
+    strcpy(token, s->token);
+
+    pthread_mutex_lock(&lock);
+    session_t **p = find(name);
+    if (*p) {
+        // a session the caller has just ended, e.g. a logout racing a login
+        session_t *old = *p;
+        *p = old->next;
+        if (old->state != S_LIVE)
+            unpark(old);
+        pthread_mutex_unlock(&lock);
+        free_session(old);
+        pthread_mutex_lock(&lock);
+        p = find(name);
+    }
+    s->next = *p;
+    *p = s;
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&n_opened, 1, memory_order_relaxed);
+    return true;
+}
+
+void resume_close(const char *name)
+{
+    pthread_mutex_lock(&lock);
+    session_t **p = find(name), *s = *p;
+    if (s == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    *p = s->next;
+    if (s->state != S_LIVE)
+        unpark(s);
+    pthread_mutex_unlock(&lock);
+    free_session(s);
+}
+
+bool resume_live(const char *name, const char *token)
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    bool live = s && s->state == S_LIVE && strcmp(s->token, token) == 0;
+    pthread_mutex_unlock(&lock);
+    return live;
+}
+
+bool resume_park(const char *name, char (*rooms)[STR_MAX], uint64_t *left, int n)
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    if (s == NULL || s->state != S_LIVE) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    s->state = S_PARKED;
+    s->rooms = rooms;
+    s->left = left;
+    s->joined = malloc(n * sizeof(uint64_t));
+    for (int i = 0; i < n; ++i)
+        s->joined[i] = UINT64_MAX;
+    s->n_rooms = n;
+    s->frames = NULL;
+    s->f_tail = &s->frames;
+    s->n_frames = 0;
+    s->n_bytes = 0;
+    s->p_next = parked;
+    parked = s;
+    atomic_fetch_add(&n_parked, 1);
+    timer_add(&s->grace, grace_ms, grace_expired, s);
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&n_parks, 1, memory_order_relaxed);
+    return true;
+}
+
+int resume_claim(const char *name, char token[RESUME_TOKEN_LEN + 1], char (**rooms)[STR_MAX])
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    if (s == NULL || s->state != S_PARKED || strcmp(s->token, token) != 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    s->state = S_CLAIMED; // from here the grace callback leaves it alone
+    new_token(s->token);
+    strcpy(token, s->token);
+    *rooms = s->rooms;
+    int n = s->n_rooms;
+    pthread_mutex_unlock(&lock);
+
+    timer_cancel_sync(&s->grace);
+    return n;
+}
+
+void resume_rejoined(const char *name, int i, uint64_t version)
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    if (s && s->state == S_CLAIMED && i < s->n_rooms)
+        s->joined[i] = version;
+    pthread_mutex_unlock(&lock);
+}
+
+rframe_t *resume_take(const char *name)
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    rframe_t *f = NULL;
+    if (s && s->state == S_CLAIMED) {
+        f = s->frames;
+        s->frames = NULL;
+        s->f_tail = &s->frames;
+        s->n_frames = 0;
+        s->n_bytes = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return f;
+}
+
+rframe_t *resume_finish(const char *name)
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    rframe_t *f = NULL;
+    if (s && s->state == S_CLAIMED) {
+        f = s->frames;
+        s->frames = NULL;
+        s->state = S_LIVE;
+        unpark(s);
+        free_rooms(s);
+        atomic_fetch_add_explicit(&n_resumed, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+    return f;
+}
+
+void resume_free_frames(rframe_t *f)
+{
+    while (f) {
+        rframe_t *next = f->next;
+        free(f);
+        f = next;
+    }
+}
+
+bool resume_evict(const char *name)
+{
+    pthread_mutex_lock(&lock);
+    session_t **p = find(name), *s = *p;
+    if (s == NULL || (s->state != S_PARKED && s->state != S_EXPIRED)) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    *p = s->next;
+    unpark(s);
+    pthread_mutex_unlock(&lock);
+    free_session(s);
+    atomic_fetch_add_explicit(&n_evicted, 1, memory_order_relaxed);
+    return true;
+}
+
+bool resume_expired(char name[STR_MAX])
+{
+    pthread_mutex_lock(&lock);
+    session_t *s = parked;
+    while (s && s->state != S_EXPIRED)
+        s = s->p_next;
+    if (s == NULL) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    session_t **p = find(s->name);
+    *p = s->next;
+    unpark(s);
+    pthread_mutex_unlock(&lock);
+
+    strcpy(name, s->name);
+    free_session(s);
+    atomic_fetch_add_explicit(&n_expired, 1, memory_order_relaxed);
+    return true;
+}
+
+void resume_expire_all(void)
+{
+    pthread_mutex_lock(&lock);
+    for (session_t *s = parked; s != NULL; s = s->p_next)
+        if (s->state == S_PARKED)
+            s->state = S_EXPIRED;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Append a copy of h/body to s; past the limits it is dropped */
+static void buffer(session_t *s, petr_header *h, const char *body)
+{
+    if (s->n_frames >= RESUME_MAX_FRAMES || s->n_bytes + h->msg_len > RESUME_MAX_BYTES) {
+        atomic_fetch_add_explicit(&n_lost, 1, memory_order_relaxed);
+        return;
+    }
+    rframe_t *f = malloc(sizeof(rframe_t) + h->msg_len);
+    f->next = NULL;
+    f->h = *h;
+    memcpy(f->body, body, h->msg_len);
+    *s->f_tail = f;
+    s->f_tail = &f->next;
+    s->n_frames++;
+    s->n_bytes += h->msg_len;
+    atomic_fetch_add_explicit(&n_buffered, 1, memory_order_relaxed);
+}
+
+bool resume_buffer_user(const char *name, petr_header *h, const char *body)
+{
+    if (atomic_load(&n_parked) == 0)
+        return false;
+    pthread_mutex_lock(&lock);
+    session_t *s = *find(name);
+    bool away = s && (s->state == S_PARKED || s->state == S_CLAIMED);
+    if (away)
+        buffer(s, h, body);
+    pthread_mutex_unlock(&lock);
+    return away;
+}
+
+void resume_buffer_room(const char *room, uint64_t version, petr_header *h, const char *body)
+{
+    if (atomic_load(&n_parked) == 0)
+        return;
+    pthread_mutex_lock(&lock);
+    for (session_t *s = parked; s != NULL; s = s->p_next) {
+        if (s->state != S_PARKED && s->state != S_CLAIMED)
+            continue;
+        for (int i = 0; i < s->n_rooms; ++i) {
+            if (strcmp(s->rooms[i], room) != 0 || version < s->left[i] || version >= s->joined[i])
+                continue;
+            buffer(s, h, body);
+            if (h->msg_type == RMCLOSED)
+                s->rooms[i][0] = '\0';
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void resume_report(void)
+{
+    if (a_log == NULL || !grace_ms)
+        return;
+    fprintf(a_log, "Sessions: %lu opened, %lu parked, %lu resumed, %lu expired, %lu replaced; "
+            "%lu frames buffered, %lu dropped; %d parked now\n",
+            atomic_load(&n_opened), atomic_load(&n_parks), atomic_load(&n_resumed),
+            atomic_load(&n_expired), atomic_load(&n_evicted), atomic_load(&n_buffered),
+            atomic_load(&n_lost), atomic_load(&n_parked));
+}
@@ -1,41 +1,190 @@
 #include "sbuf.h"
 #include "protocol.h"
+#include "clock.h"
 
-/* Create an empty, bounded, shared FIFO buffer with n slots */
-void sbuf_init(sbuf_t *sp, int n)
+static const char *lane_str[SBUF_LANES] = { "control", "bulk" };
+
+/* Lane a message type is queued on */
+int sbuf_lane(uint8_t msg_type)
+{
+    return (msg_type == RMSEND || msg_type == USRSEND || msg_type == USRMSEND) ? LANE_BULK : LANE_CONTROL;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots per lane and node */
+void sbuf_init(sbuf_t *sp, int n, int nodes)
 {
-    sp->buf = calloc(n, sizeof(j_msg)); 
-    sp->n = n;                       /* Buffer holds max of n items */
-    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    sp->nodes = nodes > 0 ? nodes : 1;
+    sp->lane = calloc(sp->nodes * SBUF_LANES, sizeof(sbuf_lane_t));
+    sp->cur = calloc(sp->nodes, sizeof(int));
+    for (int i = 0; i < sp->nodes * SBUF_LANES; ++i) {
+        sbuf_lane_t *l = &sp->lane[i];
+        l->buf = calloc(n, sizeof(j_msg));
+        l->n = n;                    /* Lane holds max of n items */
+        l->front = l->rear = 0;      /* Empty lane iff front == rear */
+        l->weight = l->credit = (i % SBUF_LANES == LANE_CONTROL) ? LANE_CONTROL_WEIGHT : LANE_BULK_WEIGHT;
+        sem_init(&l->slots, 0, n);   /* Initially, lane has n empty slots */
+    }
     sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
-    sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
     sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
 }
 
 /* Clean up buffer sp */
 void sbuf_deinit(sbuf_t *sp)
 {
-    free(sp->buf);
+    for (int i = 0; i < sp->nodes * SBUF_LANES; ++i)
+        free(sp->lane[i].buf);
+    free(sp->lane);
+    free(sp->cur);
 }
 
-/* Insert item onto the rear of shared buffer sp */
+/* Lane for item: its class on its connection's node */
+static sbuf_lane_t *sbuf_lane_for(sbuf_t *sp, j_msg *item)
+{
+    int node = (item->node >= 0 && item->node < sp->nodes) ? item->node : 0;
+    return &sp->lane[node * SBUF_LANES + sbuf_lane(item->header.msg_type)];
+}
+
+/* Insert item onto the rear of its lane in shared buffer sp */
 void sbuf_insert(sbuf_t *sp, j_msg item)
 {
-    sem_wait(&sp->slots);                          /* Wait for available slot */
+    sbuf_lane_t *l = sbuf_lane_for(sp, &item);
+    sem_wait(&l->slots);                           /* Wait for available slot */
+    sem_wait(&sp->mutex);                          /* Lock the buffer */
+    l->buf[(++l->rear)%(l->n)] = item;             /* Insert the item */
+    sem_post(&sp->mutex);                          /* Unlock the buffer */
+    sem_post(&sp->items);                          /* Announce available item */
+}
+
+/* Insert item unless its lane is full; returns -1 instead of blocking */
+int sbuf_tryinsert(sbuf_t *sp, j_msg *item)
+{
+    sbuf_lane_t *l = sbuf_lane_for(sp, item);
+    if (sem_trywait(&l->slots) < 0)                /* No slot, don't wait */
+        return -1;
     sem_wait(&sp->mutex);                          /* Lock the buffer */
-    sp->buf[(++sp->rear)%(sp->n)] = item;          /* Insert the item */
+    l->buf[(++l->rear)%(l->n)] = *item;            /* Insert the item */
     sem_post(&sp->mutex);                          /* Unlock the buffer */
     sem_post(&sp->items);                          /* Announce available item */
+    return 0;
+}
+
+/*
+ * Weighted round robin over the non-empty lanes of one node: the current
+ * lane is served until its credit for this round runs out or it empties.
+ * Returns NULL if every lane of the node is empty.
+ */
+static sbuf_lane_t *sbuf_pick_node(sbuf_t *sp, int node)
+{
+    sbuf_lane_t *lanes = &sp->lane[node * SBUF_LANES];
+    int any = 0;
+    for (int i = 0; i < SBUF_LANES; ++i)
+        any |= lanes[i].front != lanes[i].rear;
+    if (!any)
+        return NULL;
+
+    for (;;) {
+        sbuf_lane_t *l = &lanes[sp->cur[node]];
+        if (l->front != l->rear && l->credit > 0) {
+            l->credit--;
+            return l;
+        }
+        l->credit = l->weight;
+        sp->cur[node] = (sp->cur[node] + 1) % SBUF_LANES;
+    }
+}
+
+/*
+ * Serve node's lanes first, then steal from the others. node -1 has no
+ * preference. Caller holds sp->mutex and an item is known to be available.
+ */
+static sbuf_lane_t *sbuf_pick(sbuf_t *sp, int node)
+{
+    if (node < 0 || node >= sp->nodes)
+        node = 0;
+    for (int i = 0; i < sp->nodes; ++i) {
+        sbuf_lane_t *l = sbuf_pick_node(sp, (node + i) % sp->nodes);
+        if (l)
+            return l;
+    }
+    return NULL; /* unreachable while items is accurate */
 }
 
-/* Remove and return the first item from buffer sp */
+static void sbuf_record(sbuf_lane_t *l, uint64_t t_enq)
+{
+    uint64_t now = mono_ns();
+    uint64_t us = now > t_enq ? (now - t_enq) / NS_PER_US : 0;
+    int b = 0;
+    while (us > 0 && b < SBUF_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    // writers hold mutex, so a plain load and store will do
+    unsigned long n = atomic_load_explicit(&l->hist[b], memory_order_relaxed);
+    atomic_store_explicit(&l->hist[b], n + 1, memory_order_relaxed);
+}
+
+/* Remove and return the next item from buffer sp */
 j_msg sbuf_remove(sbuf_t *sp)
 {
     j_msg item;
     sem_wait(&sp->items);                          /* Wait for available item */
     sem_wait(&sp->mutex);                          /* Lock the buffer */
-    item = sp->buf[(++sp->front)%(sp->n)];         /* Remove the item */
+    sbuf_lane_t *l = sbuf_pick(sp, -1);
+    item = l->buf[(++l->front)%(l->n)];            /* Remove the item */
+    sbuf_record(l, item.t_enq);
     sem_post(&sp->mutex);                          /* Unlock the buffer */
-    sem_post(&sp->slots);                          /* Announce available slot */
+    sem_post(&l->slots);                           /* Announce available slot */
     return item;
 }
+
+/*
+ * Remove the next item into *item, preferring node's lanes; gives up
+ * after timeout_ms and returns -1
+ */
+int sbuf_remove_timed(sbuf_t *sp, j_msg *item, int timeout_ms, int node)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * NS_PER_MS;
+    if (ts.tv_nsec >= NS_PER_SEC) {
+        ts.tv_sec++;
+        ts.tv_nsec -= NS_PER_SEC;
+    }
+    if (sem_timedwait(&sp->items, &ts) < 0)        /* Wait for available item */
+        return -1;
+    sem_wait(&sp->mutex);                          /* Lock the buffer */
+    sbuf_lane_t *l = sbuf_pick(sp, node);
+    *item = l->buf[(++l->front)%(l->n)];           /* Remove the item */
+    sbuf_record(l, item->t_enq);
+    sem_post(&sp->mutex);                          /* Unlock the buffer */
+    sem_post(&l->slots);                           /* Announce available slot */
+    return 0;
+}
+
+/*
+ * Print queue time histograms per lane class, summed over nodes. Reads
+ * the counters without taking mutex, as it runs on the SIGINT path.
+ */
+void sbuf_report(sbuf_t *sp, FILE *out)
+{
+    for (int i = 0; i < SBUF_LANES; ++i) {
+        unsigned long hist[SBUF_HIST_BUCKETS] = { 0 };
+        for (int node = 0; node < sp->nodes; ++node)
+            for (int b = 0; b < SBUF_HIST_BUCKETS; ++b)
+                hist[b] += atomic_load_explicit(&sp->lane[node * SBUF_LANES + i].hist[b], memory_order_relaxed);
+
+        fprintf(out, "Queue time, %s lane (us: count):", lane_str[i]);
+        for (int b = 0; b < SBUF_HIST_BUCKETS; ++b) {
+            if (hist[b] == 0)
+                continue;
+            if (b == 0)
+                fprintf(out, " <1: %lu", hist[b]);
+            else if (b == SBUF_HIST_BUCKETS - 1)
+                fprintf(out, " >=%lu: %lu", 1UL << (b - 1), hist[b]);
+            else
+                fprintf(out, " <%lu: %lu", 1UL << b, hist[b]);
+        }
+        fprintf(out, "\n");
+    }
+}
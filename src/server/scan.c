@@ -0,0 +1,182 @@
+#include "scan.h"
+#include "linkedList.h"
+#include "protocol.h"
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/*
+ * Payload shapes by message type; max 0 = not a text payload. named:
+ * the first field is a user or room name.
+ */
+static const struct {
+    uint8_t min, max;
+    bool named;
+} shapes[256] = {
+    [LOGIN] = { 1, 2, true },    // name[\r\ntoken]
+    [RMCREATE] = { 1, 1, true },
+    [RMDELETE] = { 1, 1, true },
+    [RMJOIN] = { 1, 1, true },
+    [RMLEAVE] = { 1, 1, true },
+    [RMSEND] = { 2, 2, true },   // room\r\nmessage
+    [RMSEARCH] = { 2, 3, true }, // room\r\nwords[\r\ncursor]
+    [USRSEND] = { 2, 2, true },  // user\r\nmessage
+    [USRMSEND] = { 2, 2, false }, // user1\nuser2...\r\nmessage
+};
+
+/*
+ * Delimiter search: positions of the "\r\n" pairs in p[0, len) into cr,
+ * at most max of them.
+ * @return number found, -1 on a NUL, a bare '\r' or more than max
+ */
+typedef int (*find_fn)(const char *p, size_t len, uint16_t *cr, int max);
+
+/* A '\r' or NUL at p[i] */
+static inline int hit(const char *p, size_t len, size_t i, uint16_t *cr, int *n, int max)
+{
+    if (p[i] == '\0' || i + 1 >= len || p[i + 1] != '\n' || *n == max)
+        return -1;
+    cr[(*n)++] = i;
+    return 0;
+}
+
+/*
+ * Portable fallback: libc's strnlen and memchr already go a word or a
+ * vector at a time, so one pass of each beats a byte loop testing both.
+ */
+static int find_scalar(const char *p, size_t len, uint16_t *cr, int max)
+{
+    if (strnlen(p, len) != len)
+        return -1;
+    int n = 0;
+    for (const char *q = p; (q = memchr(q, '\r', p + len - q)) != NULL; q += 2)
+        if (hit(p, len, q - p, cr, &n, max) < 0)
+            return -1;
+    return n;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static int find_sse2(const char *p, size_t len, uint16_t *cr, int max)
+{
+    const __m128i vcr = _mm_set1_epi8('\r'), vnul = _mm_setzero_si128();
+    int n = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vcr), _mm_cmpeq_epi8(v, vnul)));
+        for (; mask; mask &= mask - 1)
+            if (hit(p, len, i + __builtin_ctz(mask), cr, &n, max) < 0)
+                return -1;
+    }
+    for (; i < len; ++i)
+        if ((p[i] == '\r' || p[i] == '\0') && hit(p, len, i, cr, &n, max) < 0)
+            return -1;
+    return n;
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const char *p, size_t len, uint16_t *cr, int max)
+{
+    const __m256i vcr = _mm256_set1_epi8('\r'), vnul = _mm256_setzero_si256();
+    int n = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, vcr), _mm256_cmpeq_epi8(v, vnul)));
+        for (; mask; mask &= mask - 1)
+            if (hit(p, len, i + __builtin_ctz(mask), cr, &n, max) < 0)
+                return -1;
+    }
+    // under a vector left: finish with the narrower one
+    int rest = find_sse2(p + i, len - i, cr + n, max - n);
+    if (rest < 0)
+        return -1;
+    for (int k = n; k < n + rest; ++k)
+        cr[k] += i;
+    return n + rest;
+}
+#endif
+
+static find_fn find = find_scalar;
+static const char *impl = "scalar";
+
+int scan_fields(char *buf, size_t len, size_t cap, fields_t *f, int max)
+{
+    if (len > UINT16_MAX || max < 1 || max > SCAN_MAX_FIELDS)
+        return -1;
+    if (len > 0 && buf[len - 1] == '\0')
+        len--; // the terminator msg_len counts
+    else if (len < cap)
+        buf[len] = '\0';
+    else
+        return -1; // unterminated, and nowhere to put one
+
+    uint16_t cr[SCAN_MAX_FIELDS];
+    int seps = find(buf, len, cr, max - 1);
+    if (seps < 0)
+        return -1;
+
+    size_t start = 0;
+    for (int i = 0; i < seps; ++i) {
+        buf[cr[i]] = '\0';
+        f->off[i] = start;
+        f->len[i] = cr[i] - start;
+        start = cr[i] + 2; // past "\r\n"
+    }
+    f->off[seps] = start;
+    f->len[seps] = len - start;
+    f->n = seps + 1;
+    return f->n;
+}
+
+int scan_frame(uint8_t msg_type, char *buf, size_t len, size_t cap, fields_t *f)
+{
+    if (shapes[msg_type].max == 0) {
+        f->n = 0;
+        return 0;
+    }
+    int n = scan_fields(buf, len, cap, f, shapes[msg_type].max);
+    if (n < shapes[msg_type].min)
+        return -1;
+    if (shapes[msg_type].named && (f->len[0] == 0 || f->len[0] >= STR_MAX))
+        return -1;
+    return n;
+}
+
+int scan_use(const char *name)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2"), sse2 = __builtin_cpu_supports("sse2");
+    if (name == NULL)
+        name = avx2 ? "avx2" : sse2 ? "sse2" : "scalar";
+    if (strcmp(name, "avx2") == 0 && avx2) {
+        find = find_avx2;
+        impl = "avx2";
+        return 0;
+    }
+    if (strcmp(name, "sse2") == 0 && sse2) {
+        find = find_sse2;
+        impl = "sse2";
+        return 0;
+    }
+#else
+    if (name == NULL)
+        name = "scalar";
+#endif
+    if (strcmp(name, "scalar") == 0) {
+        find = find_scalar;
+        impl = "scalar";
+        return 0;
+    }
+    return -1;
+}
+
+const char *scan_impl(void)
+{
+    return impl;
+}
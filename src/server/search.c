@@ -0,0 +1,484 @@
+#include "search.h"
+#include "clock.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_BATCH 64 // jobs indexed per write lock hold, so queries never wait long
+#define ROOM_KEY_LEN 17 // a room id in hex
+
+typedef struct {
+    uint64_t id;
+    size_t bytes;             // counted against the budget
+    bool dead;                // its room was deleted
+    char *room, *from, *text; // into data; room is its id in hex
+    char data[];
+} smsg_t;
+
+typedef struct word {
+    struct word *next;        // hash chain
+    uint64_t *ids;            // postings, ascending; live ones are ids[head, head + len)
+    uint32_t head, len, cap;
+    uint32_t hash;
+    char key[];               // "room\nword"
+} word_t;
+
+typedef struct sjob {
+    struct sjob *next;
+    bool drop;                // forget a room rather than index a message
+    char *room, *from, *text; // into data
+    char data[];
+} sjob_t;
+
+static FILE *a_log;
+static size_t budget; // 0 = search off
+
+// the index: written by the indexer thread, read by queries on job threads
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static smsg_t **msgs;          // message id lives at msgs[(msgs_head + id - first_id) % msgs_cap]
+static size_t msgs_cap, msgs_head, n_msgs;
+static uint64_t first_id = 1, next_id = 1;
+static word_t **table;
+static size_t n_buckets, n_words;
+static size_t bytes;
+
+// indexer queue
+static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t q_idle = PTHREAD_COND_INITIALIZER;
+static sjob_t *q_head, **q_tail = &q_head;
+static int q_len;
+static bool q_busy;
+
+static atomic_ulong n_indexed, n_dropped, n_evicted, n_queries, query_ns;
+
+/* Lowercase the next indexable word at or after s into w; where to go on from, NULL at the end */
+static const char *next_word(const char *s, char w[SEARCH_MAX_WORD + 1])
+{
+    for (;;) {
+        while (*s && !isalnum((unsigned char)*s))
+            s++;
+        if (*s == '\0')
+            return NULL;
+        int n = 0;
+        for (; isalnum((unsigned char)*s); ++s)
+            if (n < SEARCH_MAX_WORD)
+                w[n++] = tolower((unsigned char)*s);
+        w[n] = '\0';
+        if (n >= SEARCH_MIN_WORD)
+            return s;
+    }
+}
+
+/* FNV-1a over "room\nword" */
+static uint32_t key_hash(const char *room, const char *w)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = room; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h = (h ^ '\n') * 16777619u;
+    for (const char *p = w; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static bool in_room(const char *key, const char *room, size_t room_len)
+{
+    return strncmp(key, room, room_len) == 0 && key[room_len] == '\n';
+}
+
+/* Link pointing at room's word w, or at the NULL ending its chain */
+static word_t **find(const char *room, const char *w, uint32_t h)
+{
+    size_t rl = strlen(room);
+    word_t **p = &table[h & (n_buckets - 1)];
+    while (*p && !((*p)->hash == h && in_room((*p)->key, room, rl) && strcmp((*p)->key + rl + 1, w) == 0))
+        p = &(*p)->next;
+    return p;
+}
+
+static void grow_table(void)
+{
+    size_t n = n_buckets ? 2 * n_buckets : 1024;
+    word_t **t = calloc(n, sizeof(word_t *));
+    for (size_t i = 0; i < n_buckets; ++i) {
+        for (word_t *wd = table[i], *next; wd != NULL; wd = next) {
+            next = wd->next;
+            wd->next = t[wd->hash & (n - 1)];
+            t[wd->hash & (n - 1)] = wd;
+        }
+    }
+    free(table);
+    bytes += (n - n_buckets) * sizeof(word_t *);
+    table = t;
+    n_buckets = n;
+}
+
+static void free_word(word_t **link)
+{
+    word_t *wd = *link;
+    *link = wd->next;
+    bytes -= sizeof(word_t) + strlen(wd->key) + 1 + wd->cap * sizeof(uint64_t);
+    n_words--;
+    free(wd->ids);
+    free(wd);
+}
+
+/* Append id to room's postings for w, once per message */
+static void post(const char *room, const char *w, uint64_t id)
+{
+    uint32_t h = key_hash(room, w);
+    word_t **link = find(room, w, h);
+    word_t *wd = *link;
+    if (wd == NULL) {
+        size_t klen = strlen(room) + 1 + strlen(w) + 1;
+        wd = calloc(1, sizeof(word_t) + klen);
+        sprintf(wd->key, "%s\n%s", room, w);
+        wd->hash = h;
+        *link = wd;
+        bytes += sizeof(word_t) + klen;
+        if (++n_words > n_buckets)
+            grow_table();
+    } else if (wd->ids[wd->head + wd->len - 1] == id) {
+        return; // repeated within the message
+    }
+
+    if (wd->head + wd->len == wd->cap) {
+        if (wd->head >= wd->cap / 2 && wd->head > 0) {
+            // mostly evicted: slide down instead of growing
+            memmove(wd->ids, wd->ids + wd->head, wd->len * sizeof(uint64_t));
+            wd->head = 0;
+        } else {
+            uint32_t cap = wd->cap ? 2 * wd->cap : 2;
+            wd->ids = realloc(wd->ids, cap * sizeof(uint64_t));
+            bytes += (cap - wd->cap) * sizeof(uint64_t);
+            wd->cap = cap;
+        }
+    }
+    wd->ids[wd->head + wd->len++] = id;
+}
+
+/* Pop id, the oldest message, off the front of room's postings for w */
+static void unpost(const char *room, const char *w, uint64_t id)
+{
+    word_t **link = find(room, w, key_hash(room, w));
+    word_t *wd = *link;
+    if (wd == NULL || wd->ids[wd->head] != id)
+        return; // repeated within the message, already popped
+    wd->head++;
+    if (--wd->len == 0) {
+        free_word(link);
+    } else if (wd->cap > 8 && wd->len < wd->cap / 4) {
+        memmove(wd->ids, wd->ids + wd->head, wd->len * sizeof(uint64_t));
+        wd->head = 0;
+        wd->ids = realloc(wd->ids, wd->cap / 2 * sizeof(uint64_t));
+        bytes -= wd->cap / 2 * sizeof(uint64_t);
+        wd->cap /= 2;
+    }
+}
+
+static smsg_t *msg_at(uint64_t id)
+{
+    if (id < first_id || id >= next_id)
+        return NULL;
+    return msgs[(msgs_head + (id - first_id)) % msgs_cap];
+}
+
+static void evict_oldest(void)
+{
+    smsg_t *m = msgs[msgs_head];
+    char w[SEARCH_MAX_WORD + 1];
+    if (!m->dead)
+        for (const char *s = m->text; (s = next_word(s, w)) != NULL;)
+            unpost(m->room, w, m->id);
+    msgs_head = (msgs_head + 1) % msgs_cap;
+    n_msgs--;
+    first_id++;
+    bytes -= m->bytes;
+    free(m);
+    atomic_fetch_add_explicit(&n_evicted, 1, memory_order_relaxed);
+}
+
+static void index_msg(const char *room, const char *from, const char *text)
+{
+    if (n_msgs == msgs_cap) {
+        size_t cap = msgs_cap ? 2 * msgs_cap : 1024;
+        smsg_t **a = malloc(cap * sizeof(smsg_t *));
+        for (size_t i = 0; i < n_msgs; ++i)
+            a[i] = msgs[(msgs_head + i) % msgs_cap];
+        free(msgs);
+        bytes += (cap - msgs_cap) * sizeof(smsg_t *);
+        msgs = a;
+        msgs_cap = cap;
+        msgs_head = 0;
+    }
+
+    size_t rl = strlen(room) + 1, fl = strlen(from) + 1, tl = strlen(text) + 1;
+    smsg_t *m = malloc(sizeof(smsg_t) + rl + fl + tl);
+    m->id = next_id++;
+    m->bytes = sizeof(smsg_t) + rl + fl + tl;
+    m->dead = false;
+    m->room = memcpy(m->data, room, rl);
+    m->from = memcpy(m->data + rl, from, fl);
+    m->text = memcpy(m->data + rl + fl, text, tl);
+    msgs[(msgs_head + n_msgs++) % msgs_cap] = m;
+    bytes += m->bytes;
+
+    char w[SEARCH_MAX_WORD + 1];
+    for (const char *s = text; (s = next_word(s, w)) != NULL;)
+        post(room, w, m->id);
+    atomic_fetch_add_explicit(&n_indexed, 1, memory_order_relaxed);
+
+    while (bytes > budget && n_msgs > 0)
+        evict_oldest();
+}
+
+/* Free the room's words now; its messages go when they age out */
+static void drop_room(const char *room)
+{
+    size_t rl = strlen(room);
+    for (size_t i = 0; i < n_buckets; ++i) {
+        for (word_t **link = &table[i]; *link != NULL;) {
+            if (in_room((*link)->key, room, rl))
+                free_word(link);
+            else
+                link = &(*link)->next;
+        }
+    }
+    for (size_t i = 0; i < n_msgs; ++i) {
+        smsg_t *m = msgs[(msgs_head + i) % msgs_cap];
+        if (strcmp(m->room, room) == 0)
+            m->dead = true;
+    }
+}
+
+static void *indexer(void *arg)
+{
+    // housekeeping only; leave signals to the accept loop
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&q_lock);
+    while (1) {
+        q_busy = false;
+        while (q_head == NULL) {
+            pthread_cond_broadcast(&q_idle);
+            pthread_cond_wait(&q_ready, &q_lock);
+        }
+
+        // take a batch off the front
+        sjob_t *batch = q_head, *last = q_head;
+        int n = 1;
+        while (n < SEARCH_BATCH && last->next != NULL) {
+            last = last->next;
+            n++;
+        }
+        q_head = last->next;
+        if (q_head == NULL)
+            q_tail = &q_head;
+        last->next = NULL;
+        q_len -= n;
+        q_busy = true;
+        pthread_mutex_unlock(&q_lock);
+
+        pthread_rwlock_wrlock(&lock);
+        for (sjob_t *j = batch; j != NULL; j = j->next) {
+            if (j->drop)
+                drop_room(j->room);
+            else
+                index_msg(j->room, j->from, j->text);
+        }
+        pthread_rwlock_unlock(&lock);
+
+        for (sjob_t *j = batch, *next; j != NULL; j = next) {
+            next = j->next;
+            free(j);
+        }
+        pthread_mutex_lock(&q_lock);
+    }
+    return NULL;
+}
+
+void search_init(size_t max_bytes, FILE *log)
+{
+    a_log = log;
+    budget = max_bytes;
+    if (budget == 0)
+        return;
+    grow_table();
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, indexer, NULL);
+    pthread_detach(tid);
+}
+
+bool search_enabled(void)
+{
+    return budget > 0;
+}
+
+static bool enqueue(bool drop, const char *room, const char *from, const char *text)
+{
+    size_t rl = strlen(room) + 1, fl = strlen(from) + 1, tl = strlen(text) + 1;
+    sjob_t *j = malloc(sizeof(sjob_t) + rl + fl + tl);
+    j->next = NULL;
+    j->drop = drop;
+    j->room = memcpy(j->data, room, rl);
+    j->from = memcpy(j->data + rl, from, fl);
+    j->text = memcpy(j->data + rl + fl, text, tl);
+
+    pthread_mutex_lock(&q_lock);
+    if (!drop && q_len >= SEARCH_QUEUE) {
+        pthread_mutex_unlock(&q_lock);
+        free(j);
+        atomic_fetch_add_explicit(&n_dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    *q_tail = j;
+    q_tail = &j->next;
+    q_len++;
+    pthread_cond_signal(&q_ready);
+    pthread_mutex_unlock(&q_lock);
+    return true;
+}
+
+/* Rooms are keyed by instance id, so a room recreated under a deleted one's name starts empty */
+static void room_key(uint64_t id, char key[ROOM_KEY_LEN])
+{
+    snprintf(key, ROOM_KEY_LEN, "%lx", (unsigned long)id);
+}
+
+bool search_submit(uint64_t room_id, const char *from, const char *msg)
+{
+    char room[ROOM_KEY_LEN];
+    room_key(room_id, room);
+    return budget > 0 && enqueue(false, room, from, msg);
+}
+
+void search_drop_room(uint64_t room_id)
+{
+    char room[ROOM_KEY_LEN];
+    room_key(room_id, room);
+    if (budget > 0)
+        enqueue(true, room, "", "");
+}
+
+/* Position of the first live id >= id in wd's postings */
+static uint32_t lower_bound(const word_t *wd, uint64_t id)
+{
+    uint32_t lo = wd->head, hi = wd->head + wd->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (wd->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool contains(const word_t *wd, uint64_t id)
+{
+    uint32_t i = lower_bound(wd, id);
+    return i < wd->head + wd->len && wd->ids[i] == id;
+}
+
+size_t search_query(uint64_t room_id, const char *query, uint64_t cursor, char *buf, size_t size)
+{
+    uint64_t start = mono_ns();
+    char room[ROOM_KEY_LEN];
+    room_key(room_id, room);
+    word_t *terms[SEARCH_MAX_TERMS];
+    uint64_t hits[SEARCH_PAGE + 1]; // one extra to know whether there is a next page
+    int n_terms = 0, n_hits = 0;
+    bool missing = false;
+    char w[SEARCH_MAX_WORD + 1];
+    char head[24]; // the cursor line, written last once we know what fit
+    size_t off = sizeof(head);
+
+    if (budget == 0 || size <= sizeof(head))
+        return 0;
+
+    pthread_rwlock_rdlock(&lock);
+    for (const char *s = query; n_terms < SEARCH_MAX_TERMS && (s = next_word(s, w)) != NULL;) {
+        word_t *wd = *find(room, w, key_hash(room, w));
+        if (wd == NULL) {
+            missing = true; // AND of the words: no hits
+            break;
+        }
+        terms[n_terms++] = wd;
+    }
+
+    if (!missing && n_terms > 0) {
+        // walk the rarest word's postings down from the cursor, probe the rest
+        int r = 0;
+        for (int k = 1; k < n_terms; ++k)
+            if (terms[k]->len < terms[r]->len)
+                r = k;
+        word_t *rare = terms[r];
+        uint32_t i = cursor ? lower_bound(rare, cursor) : rare->head + rare->len;
+        while (i > rare->head && n_hits <= SEARCH_PAGE) {
+            uint64_t id = rare->ids[--i];
+            int k = 0;
+            while (k < n_terms && (k == r || contains(terms[k], id)))
+                k++;
+            smsg_t *m = msg_at(id);
+            if (k == n_terms && m != NULL && !m->dead)
+                hits[n_hits++] = id;
+        }
+    }
+
+    int shown = 0;
+    for (; shown < n_hits && shown < SEARCH_PAGE; ++shown) {
+        smsg_t *m = msg_at(hits[shown]);
+        int need = snprintf(buf + off, size - off, "%lu %s: %s\n", (unsigned long)m->id, m->from, m->text);
+        if (off + need >= size)
+            break; // page cut short; the cursor resumes after the last one shown
+        off += need;
+    }
+    pthread_rwlock_unlock(&lock);
+
+    uint64_t next = shown > 0 && shown < n_hits ? hits[shown - 1] : 0;
+    int hl = snprintf(head, sizeof(head), "%lu\n", (unsigned long)next);
+    memmove(buf + hl, buf + sizeof(head), off - sizeof(head));
+    memcpy(buf, head, hl);
+    size_t len = hl + off - sizeof(head);
+    buf[len] = '\0';
+
+    atomic_fetch_add_explicit(&n_queries, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&query_ns, mono_ns() - start, memory_order_relaxed);
+    return len;
+}
+
+void search_flush(void)
+{
+    pthread_mutex_lock(&q_lock);
+    while (budget > 0 && (q_head != NULL || q_busy))
+        pthread_cond_wait(&q_idle, &q_lock);
+    pthread_mutex_unlock(&q_lock);
+}
+
+size_t search_bytes(void)
+{
+    pthread_rwlock_rdlock(&lock);
+    size_t b = bytes;
+    pthread_rwlock_unlock(&lock);
+    return b;
+}
+
+void search_report(void)
+{
+    if (a_log == NULL || budget == 0)
+        return;
+    unsigned long queries = atomic_load(&n_queries);
+    pthread_rwlock_rdlock(&lock);
+    fprintf(a_log, "Search index: %zu messages, %zu words, %zu of %zu bytes; %lu indexed, "
+            "%lu dropped, %lu evicted; %lu queries (%.1f us avg)\n", n_msgs, n_words, bytes, budget,
+            atomic_load(&n_indexed), atomic_load(&n_dropped), atomic_load(&n_evicted), queries,
+            queries ? atomic_load(&query_ns) / 1e3 / queries : 0.0);
+    pthread_rwlock_unlock(&lock);
+}
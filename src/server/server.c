@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "linkedList.h"
 #include "protocol.h"
@@ -10,7 +11,32 @@
 #include <strings.h>
 #include <unistd.h>
 #include "sbuf.h"
+#include "handoff.h"
+#include "admit.h"
+#include "capture.h"
+#include "payload.h"
+#include "trace.h"
+#include "jobpool.h"
+#include "affinity.h"
+#include "fanout.h"
+#include "timer.h"
+#include "transport.h"
+#include "epoch.h"
+#include "sockopt.h"
+#include "search.h"
+#include "resume.h"
+#include "scan.h"
+#include "mailbox.h"
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include "clock.h"
 #include "debug.h"
+#include "audit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
 
 const char exit_str[] = "exit";
 
@@ -20,21 +46,87 @@ pthread_mutex_t buffer_lock;
 //pthread_mutex_t rooms_lock;
 
 int listen_fd;
+int unix_fd = -1;     // AF_UNIX listener for same-host clients
+char *unix_path;
 FILE *a_log; // audit log
 
+// hot upgrade
+char **s_argv; // argv to re-exec on upgrade
+volatile sig_atomic_t upgrade_requested = 0;
+
 // userlist
 userlist_t users = { .head = NULL, .length = 0 };
 
 // rooms
-#define MAX_ROOMS 10
 roomlist_t rooms = { .head = NULL, .length = 0};
 
 // jobs
 #define MAX_JOBS 16
 sbuf_t j_buf;
+#define FIELD(m, i) ((m).msg + (m).fields.off[i]) // split by scan_frame
+
+// per client fd job accounting. LOGOUT lets queued jobs answer before
+// the close. Room sends run outside buffer_lock, so they take tickets to
+// keep a sender's messages in order; they share one FIFO lane, so the
+// ticket ahead of a waiting job is always already running.
+#define LOGOUT_DRAIN_MS 1000 // a drain this slow is logged
+typedef struct {
+    atomic_int inflight; // jobs queued or running
+    atomic_uint sends;   // RMSEND tickets handed out by the client thread
+    atomic_uint sent;    // RMSEND tickets finished by job threads
+    atomic_int uncork;   // frames of a corked batch waiting on inflight to reach 0
+    bool tagged;         // a REQID frame is waiting for its request; under buffer_lock
+    uint32_t tag;
+} conn_seq_t;
+conn_seq_t *conn_seqs; // sized from RLIMIT_NOFILE, like the ring table
+atomic_int conn_hwm;   // every fd a client thread has run on is below this
+atomic_bool draining;  // hot upgrade: client threads read no new requests
+atomic_int logging_in; // connections between accept and the end of start_session
+
+/* A job of fd's is done or never queued; the last one out flushes a corked batch */
+void inflight_done(int fd) {
+    conn_seq_t *q = &conn_seqs[fd];
+    if (atomic_fetch_sub(&q->inflight, 1) == 1) {
+        int frames = atomic_exchange(&q->uncork, 0);
+        if (frames > 0)
+            sockopt_uncork(fd, frames);
+    }
+}
+
+/*
+ * Wait until none of fd's jobs are queued or running. A connection is not
+ * logged out, parked or detached before then: its jobs would run for a
+ * user that is gone, and reader jobs still write their reply through fd.
+ */
+void drain_inflight(int fd) {
+    for (int ms = 0; atomic_load(&conn_seqs[fd].inflight) > 0; ++ms) {
+        if (ms == LOGOUT_DRAIN_MS)
+            audit(AUDIT_ERROR, "Jobs of FD %d still running after %d ms\n", fd, LOGOUT_DRAIN_MS);
+        usleep(1000);
+    }
+}
+
+// connection timers
+#define HEARTBEAT_MISSES 3 // unanswered probes before a peer counts as dead
+uint64_t idle_ns;          // reap clients silent this long, 0 = never
+uint32_t heartbeat_ms;     // liveness check period, 0 = off
 
 void sigint_handler(int sig) {
     fprintf(a_log, "Shutting down server\n");
+    admit_report();
+    sbuf_report(&j_buf, a_log);
+    capture_close();
+    trace_export();
+    jobpool_report();
+    fanout_report();
+    timer_report();
+    pool_report(&user_pool, a_log);
+    pool_report(&room_pool, a_log);
+    epoch_report(a_log);
+    sockopt_report();
+    search_report();
+    resume_report();
+    mailbox_report();
 
     sbuf_deinit(&j_buf);
     deleteRoomList(&rooms);
@@ -45,196 +137,459 @@ void sigint_handler(int sig) {
     deleteUserList(&users);
 
     close(listen_fd);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
     exit(0);
 }
 
+void end_parked(char *name); // below, with the rest of session parking
+
+/* REQID tag fd has read for a request it has not sent yet, for the handoff */
+bool pending_tag(int fd, uint32_t *tag) {
+    *tag = conn_seqs[fd].tag;
+    return conn_seqs[fd].tagged;
+}
+
+void restore_tag(int fd, uint32_t tag) {
+    conn_seqs[fd].tagged = true;
+    conn_seqs[fd].tag = tag;
+}
+
+void sigusr2_handler(int sig) {
+    upgrade_requested = 1; // handled by the accept loop
+}
+
+/*
+ * Hand listen_fd, all client fds and user/room state to a new server
+ * process exec'd from the same argv. On success this process exits and the
+ * new one keeps serving the existing connections; on failure we keep going.
+ */
+void upgrade() {
+    audit(AUDIT_EVENT, "Hot upgrade requested\n");
+    fflush(a_log);
+
+    // stop readers, then let every request already read finish: queued,
+    // running, or about to be inserted by its reader. Logins in progress
+    // finish too; a connection not yet in users would not be handed off
+    atomic_store(&draining, true);
+    int pending = 0;
+    for (int tries = 0; tries < 1000; ++tries) {
+        pthread_mutex_lock(&buffer_lock);
+        pending = atomic_load(&logging_in);
+        for (int fd = 0, hwm = atomic_load(&conn_hwm); fd < hwm; ++fd)
+            pending += atomic_load(&conn_seqs[fd].inflight);
+        if (pending == 0)
+            break;
+        pthread_mutex_unlock(&buffer_lock);
+        usleep(1000);
+    }
+    if (pending != 0) {
+        audit(AUDIT_ERROR, "Job queue or logins did not drain, aborting upgrade\n");
+        atomic_store(&draining, false);
+        pthread_mutex_unlock(&buffer_lock);
+        return;
+    }
+    epoch_synchronize(); // broadcasts already running outside the lock
+
+    // parked sessions are not handed off; end them as their grace would
+    char parked_name[STR_MAX];
+    resume_expire_all();
+    while (resume_expired(parked_name))
+        end_parked(parked_name);
+
+    int chan[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, chan) < 0) {
+        audit(AUDIT_ERROR, "Upgrade socketpair failed\n");
+        atomic_store(&draining, false);
+        pthread_mutex_unlock(&buffer_lock);
+        return;
+    }
+
+    // build argv for the new server before forking: -H CHAN, dropping any previous -H
+    int argc = 0;
+    while (s_argv[argc])
+        argc++;
+    char **argv = calloc(argc + 3, sizeof(char *));
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", chan[1]);
+    int n = 0;
+    argv[n++] = s_argv[0];
+    argv[n++] = "-H";
+    argv[n++] = fd_str;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(s_argv[i], "-H") == 0) {
+            i++;
+            continue;
+        }
+        argv[n++] = s_argv[i];
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(chan[1], F_SETFD, 0); // keep our end across exec
+        execv(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+    free(argv);
+    close(chan[1]);
+
+    if (pid < 0 || handoff_send(chan[0], listen_fd, unix_fd, &users, &rooms, pending_tag) < 0) {
+        audit(AUDIT_ERROR, "Handoff to new server failed, continuing\n");
+        close(chan[0]);
+        atomic_store(&draining, false);
+        pthread_mutex_unlock(&buffer_lock);
+        return;
+    }
+
+    // new process owns everything now; exit without closing client sockets
+    audit(AUDIT_EVENT, "Handed off to new server (PID %d), exiting\n", pid);
+    fclose(a_log);
+    _exit(0);
+}
+
+// request being answered on this thread, if the client tagged it with REQID
+__thread struct {
+    bool tagged;
+    int fd;
+    uint32_t id;
+} cur_req;
+
+void set_reply_tag(int fd, bool tagged, uint32_t id) {
+    cur_req.tagged = tagged;
+    cur_req.fd = fd;
+    cur_req.id = id;
+}
+
+// every frame the server writes goes through here
+int send_frame(int fd, petr_header *h, char *msg) {
+    uint64_t start = mono_ns();
+    int ret;
+
+    // the first non-event frame to the requester is the reply: echo its tag
+    // in the same write so no other frame can land in between
+    bool event = h->msg_type == RMRECV || h->msg_type == USRRECV || h->msg_type == RMCLOSED;
+    if (cur_req.tagged && fd == cur_req.fd && !event) {
+        petr_header hs[2] = { { .msg_type = REQID, .msg_len = sizeof(uint32_t) }, *h };
+        char *msgs[2] = { (char *)&cur_req.id, msg };
+        ret = xp_write_frames(fd, hs, msgs, 2);
+        cur_req.tagged = false;
+    } else {
+        ret = xp_write(fd, h, msg);
+    }
+    trace_write(start, mono_ns());
+    return ret;
+}
+
 // locks rooms
 void roomCreate(char* room, user_t user) {
     petr_header r = { .msg_len = 0 };
 
-    fprintf(a_log, "Creating room %s\n", room);
+    audit(AUDIT_EVENT, "Creating room %s\n", room);
     if (getRoom(&rooms, room)) {
-        fprintf(a_log, "Room already exists!\n");
+        audit(AUDIT_TRACE, "Room already exists!\n");
         r.msg_type = ERMEXISTS;
     } else {
         addRoom(&rooms, room, user); // adds owner to room as well
-        fprintf(a_log, "Successfully added room\n");
+        audit(AUDIT_TRACE, "Successfully added room\n");
         r.msg_type = OK;
     }
 
-    wr_msg(user.user_fd, &r, "");
+    send_frame(user.user_fd, &r, "");
 }
 
 void roomDelete(char* room, user_t user, bool write) {
-    fprintf(a_log, "Requesting deletion of room %s by %s\n", room, user.username);
+    audit(AUDIT_TRACE, "Requesting deletion of room %s by %s\n", room, user.username);
     petr_header r = { .msg_len = 0 };
 
     room_t *r_room = getRoom(&rooms, room);
     if (r_room) {
         // must be owner
         if (strcmp(user.username, r_room->owner) == 0) {
-            fprintf(a_log, "Deleting room %s...\n", r_room->roomname);
+            audit(AUDIT_EVENT, "Deleting room %s...\n", r_room->roomname);
             // notify other users of deletion
-            for (user_t *u = r_room->userlist->head; u != NULL; u = u->next) {
-                if (strcmp(u->username, r_room->owner) != 0) {
-                    fprintf(a_log, "Notifying %s of %s closing\n", u->username, r_room->roomname);
-                    petr_header notify = { .msg_type = RMCLOSED, .msg_len = strlen(r_room->roomname) + 1 };
-                    wr_msg(u->user_fd, &notify, r_room->roomname);
-                } 
-            }
+            memberlist_t *m = roomMembers(r_room);
+            audit(AUDIT_TRACE, "Notifying %d members of %s closing\n", m->length - 1, r_room->roomname);
+            petr_header notify = { .msg_type = RMCLOSED, .msg_len = strlen(r_room->roomname) + 1 };
+            fanout(m->fds, m->length, user.user_fd, &notify, r_room->roomname);
+            resume_buffer_room(r_room->roomname, m->version, &notify, r_room->roomname);
+            search_drop_room(r_room->id);
             removeRoom(&rooms, r_room->roomname);
 
             r.msg_type = OK;
         } else {
-            fprintf(a_log, "Room not owned by user\n");
+            audit(AUDIT_TRACE, "Room not owned by user\n");
             r.msg_type = ERMDENIED;
         }
     } else {
-        fprintf(a_log, "Room %s not found\n", r_room->roomname);
+        audit(AUDIT_TRACE, "Room %s not found\n", room);
         r.msg_type = ERMNOTFOUND;
     }
 
     if (write)
-        wr_msg(user.user_fd, &r, "");
+        send_frame(user.user_fd, &r, "");
 }
 
-// locks buffer and room (access)
+// lock-free: walks rooms and member snapshots in an epoch read section
 void roomList(user_t user) {
-    fprintf(a_log, "Roomlist requested by %s\n", user.username);
+    audit(AUDIT_TRACE, "Roomlist requested by %s\n", user.username);
+
+    // member lists are unbounded, so size the listing instead of using buffer;
+    // rooms can change under us, so grow it per room from the snapshot we use
+    size_t size = 1, len = 0;
+    char *list = malloc(size);
+    list[0] = '\0';
 
+    epoch_enter();
     if (rooms.head == NULL) {
-        fprintf(a_log, "No rooms\n");
+        audit(AUDIT_TRACE, "No rooms\n");
     } else {
         for (room_t *c = rooms.head; c != NULL; c = c->next) {
-            strcat(buffer, c->roomname);
-            strcat(buffer, ": ");
-            for (user_t *u = c->userlist->head; u != NULL; u = u->next) {
-                strcat(buffer, u->username);
-                if (u->next)
-                    strcat(buffer, ",");
+            memberlist_t *m = roomMembers(c);
+            size_t need = len + strlen(c->roomname) + 3 + m->length * STR_MAX + 1;
+            if (need > size) {
+                size = 2 * need;
+                list = realloc(list, size);
             }
-            strcat(buffer, "\n");
+            len += sprintf(list + len, "%s: ", c->roomname);
+            for (int i = 0; i < m->length; ++i)
+                len += sprintf(list + len, i + 1 < m->length ? "%s," : "%s", m->names[i]);
+            len += sprintf(list + len, "\n");
         }
-        fprintf(a_log, "Created roomlist\n");
+        audit(AUDIT_TRACE, "Created roomlist\n");
     }
-    // add null terminator if buffer is not empty
-    petr_header r = { .msg_type = RMLIST, .msg_len = strlen(buffer) ? strlen(buffer) + 1 : 0 }; 
-    wr_msg(user.user_fd, &r, buffer);
-    // TODO: zero buffer
+    epoch_exit();
+
+    // add null terminator if list is not empty
+    petr_header r = { .msg_type = RMLIST, .msg_len = len ? len + 1 : 0 }; 
+    send_frame(user.user_fd, &r, list);
+    free(list);
 }
 
 void roomJoin(char *room, user_t user) {
-    fprintf(a_log, "User %s request to join room %s\n", user.username, room);
+    audit(AUDIT_TRACE, "User %s request to join room %s\n", user.username, room);
     petr_header r = { .msg_len = 0 };
     room_t *j_room = getRoom(&rooms, room);
     if (j_room) {
         addUserToRoom(j_room, user);
-        fprintf(a_log, "Added user %s to room %s\n", user.username, room);
+        audit(AUDIT_EVENT, "Added user %s to room %s\n", user.username, room);
         r.msg_type = OK;
     } else {
-        fprintf(a_log, "Room %s requested by %s not found\n", room, user.username);
+        audit(AUDIT_TRACE, "Room %s requested by %s not found\n", room, user.username);
         r.msg_type = ERMNOTFOUND;
     }
 
-    wr_msg(user.user_fd, &r, "");
+    send_frame(user.user_fd, &r, "");
 }
 
 void roomLeave(char* room, user_t user) {
-    fprintf(a_log, "User %s requesting to leave room %s\n", user.username, room);
+    audit(AUDIT_TRACE, "User %s requesting to leave room %s\n", user.username, room);
     petr_header r = { .msg_len = 0 };
     room_t *l_room = getRoom(&rooms, room);
     if (l_room) {
         if (strcmp(l_room->owner, user.username) == 0) {
-            fprintf(a_log, "Owner cannot leave room, must delete\n");
+            audit(AUDIT_TRACE, "Owner cannot leave room, must delete\n");
             r.msg_type = ERMDENIED;
         } else {
             removeUserFromRoom(&rooms, l_room, user); // if user is not in room, nothing happens
-            fprintf(a_log, "Removed user from room\n");
+            audit(AUDIT_EVENT, "Removed user from room\n");
             r.msg_type = OK;
         }
     } else {
-        fprintf(a_log, "Room doesn't exist\n");
+        audit(AUDIT_TRACE, "Room doesn't exist\n");
         r.msg_type = ERMNOTFOUND;
     }
  
-    wr_msg(user.user_fd, &r, "");
+    send_frame(user.user_fd, &r, "");
 }
 
-// locks buffer, users
-void roomSend(char *user_str, user_t user) {
+// lock-free: sends to a member snapshot in an epoch read section, so
+// uses its own payload buffer rather than the shared one
+void roomSend(char *room, char *message, size_t msg_len, user_t user) {
     petr_header r = { .msg_len = 0 };
+    char payload[BUFFER_SIZE];
 
-    char *room = strtok(user_str, "\r");
+    epoch_enter();
     room_t *s_room = getRoom(&rooms, room);
     if (s_room) {
-        if (getIndexByFD(s_room->userlist, user.user_fd) >= 0) {
-            char *message = strtok(NULL, "\r");
-            message++; // skip newline
-
-            // write response to buffer
-            strcat(buffer, s_room->roomname);
-            strcat(buffer, "\r\n");
-            strcat(buffer, user.username);
-            strcat(buffer, "\r\n");
-            strcat(buffer, message);
-
-            fprintf(a_log, "Room message %s from %s in %s\n", message, user.username, room);
-
-            // send to all users
-            for (user_t *u = s_room->userlist->head; u != NULL; u = u->next) {
-                if (strcmp(u->username, user.username) != 0) {
-                    fprintf(a_log, "Sending message to %s\n", message);
-                    petr_header send = { .msg_type = RMRECV, .msg_len = strlen(buffer) + 1 };
-                    wr_msg(u->user_fd, &send, buffer);
-                }
-            }
-            bzero(buffer, BUFFER_SIZE); // zero buffer after sending to other users
+        memberlist_t *m = roomMembers(s_room);
+        int i = 0;
+        while (i < m->length && m->fds[i] != user.user_fd)
+            i++;
+        if (i < m->length) {
+            // write response once for all recipients
+            size_t len = build_rmrecv(payload, BUFFER_SIZE, s_room->roomname, user.username, message, msg_len);
+
+            audit(AUDIT_TRACE, "Room message %s from %s in %s\n", message, user.username, room);
+
+            // send to all other members, split across fan-out workers in large rooms
+            petr_header send = { .msg_type = RMRECV, .msg_len = len + 1 };
+            int sent = fanout(m->fds, m->length, user.user_fd, &send, payload);
+            resume_buffer_room(s_room->roomname, m->version, &send, payload);
+            audit(AUDIT_TRACE, "Sent message to %d members (version %lu)\n", sent, (unsigned long)m->version);
+            search_submit(s_room->id, user.username, message); // indexed later, off this path
             r.msg_type = OK;
         } else {
-            fprintf(a_log, "User %s not in room %s\n", user.username, room);
+            audit(AUDIT_TRACE, "User %s not in room %s\n", user.username, room);
             r.msg_type = ERMDENIED;
         }
     } else {
-        fprintf(a_log, "Room %s not found\n", room);
+        audit(AUDIT_TRACE, "Room %s not found\n", room);
         r.msg_type = ERMNOTFOUND;
     }
+    epoch_exit();
 
-    wr_msg(user.user_fd, &r, "");
+    send_frame(user.user_fd, &r, "");
+}
+
+// lock-free like roomSend: membership is checked on a snapshot, the
+// index has its own lock. Only members may search a room's history.
+void roomSearch(char *room, char *query, char *cursor, user_t user) {
+    petr_header r = { .msg_len = 0 };
+
+    if (!search_enabled()) {
+        audit(AUDIT_ERROR, "Search by %s while search is off\n", user.username);
+        r.msg_type = ESERV;
+        send_frame(user.user_fd, &r, "");
+        return;
+    }
+
+    epoch_enter();
+    room_t *s_room = getRoom(&rooms, room);
+    bool member = false;
+    uint64_t room_id = 0;
+    if (s_room) {
+        room_id = s_room->id; // s_room is not ours to touch after epoch_exit
+        memberlist_t *m = roomMembers(s_room);
+        for (int i = 0; i < m->length && !member; ++i)
+            member = m->fds[i] == user.user_fd;
+    }
+    epoch_exit();
+
+    if (s_room == NULL || !member) {
+        audit(AUDIT_TRACE, "Search of room %s by %s refused\n", room, user.username);
+        r.msg_type = s_room ? ERMDENIED : ERMNOTFOUND;
+        send_frame(user.user_fd, &r, "");
+        return;
+    }
+
+    // pages of long messages outgrow buffer
+    char *body = malloc(SEARCH_BODY_MAX);
+    size_t len = search_query(room_id, query, cursor ? strtoull(cursor, NULL, 10) : 0, body, SEARCH_BODY_MAX);
+    audit(AUDIT_TRACE, "User %s searched room %s for %s\n", user.username, room, query);
+    r.msg_type = RMSEARCH;
+    r.msg_len = len + 1;
+    send_frame(user.user_fd, &r, body);
+    free(body);
 }
 
 // locks buffer, userlist
-void userSend(char *user_str, user_t user) {
+void userSend(char *usr_str, char *message, size_t msg_len, user_t user) {
     petr_header r = { .msg_len = 0 };
 
-    char *usr_str = strtok(user_str, "\r");
+    // write response to buffer
+    size_t len = build_usrrecv(buffer, BUFFER_SIZE, user.username, message, msg_len);
     user_t *s_user = getUserByName(&users, usr_str);
     if (s_user) {
-        char *message = strtok(NULL, "\r");
-        message++; // skip newline
-
-        // write response to buffer
-        strcat(buffer, user.username);
-        strcat(buffer, "\r\n");
-        strcat(buffer, message);
-
         // send message
-        petr_header send = { .msg_type = USRRECV, .msg_len = strlen(buffer) + 1 };
-        wr_msg(s_user->user_fd, &send, buffer);
-        fprintf(a_log, "User %s sent user %s message %s\n", user.username, s_user->username, message);
+        petr_header send = { .msg_type = USRRECV, .msg_len = len + 1 };
+        send_frame(s_user->user_fd, &send, buffer);
+        audit(AUDIT_TRACE, "User %s sent user %s message %s\n", user.username, s_user->username, message);
 
         bzero(buffer, BUFFER_SIZE); // zero buffer after sending
         r.msg_type = OK;
     } else {
-        fprintf(a_log, "User %s requested by user %s not found\n", usr_str, user.username);
-        r.msg_type = EUSRNOTFOUND;
+        // a parked user gets it on resuming
+        petr_header send = { .msg_type = USRRECV, .msg_len = len + 1 };
+        // and one gone offline recently at its next login
+        enum mail_result mail = MAIL_UNKNOWN;
+        if (resume_buffer_user(usr_str, &send, buffer)) {
+            audit(AUDIT_TRACE, "User %s sent parked user %s message %s\n", user.username, usr_str, message);
+            r.msg_type = OK;
+        } else if ((mail = mailbox_put(usr_str, &send, buffer)) != MAIL_UNKNOWN) {
+            audit(AUDIT_TRACE, "User %s mailed offline user %s message %s%s\n", user.username, usr_str, message,
+                  mail == MAIL_FULL ? ": mailbox full" : "");
+            r.msg_type = mail == MAIL_QUEUED ? OK : ESERV;
+        } else {
+            audit(AUDIT_TRACE, "User %s requested by user %s not found\n", usr_str, user.username);
+            r.msg_type = EUSRNOTFOUND;
+        }
+        bzero(buffer, BUFFER_SIZE);
+    }
+
+    send_frame(user.user_fd, &r, "");
+}
+
+int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * USRMSEND: deliver one message to a list of users. Recipients are
+ * resolved in a single walk of the userlist and the USRRECV payload is
+ * built once. Replies OK if everyone was found, else EUSRNOTFOUND with the
+ * missing names, one per line.
+ */
+void userMultiSend(char *user_str, char *message, size_t msg_len, user_t user) {
+    petr_header r = { .msg_type = OK, .msg_len = 0 };
+
+    // split, sort and dedupe recipient names
+    char *names[BUFFER_SIZE / 2];
+    int n = 0;
+    for (char *name = strtok(user_str, "\n"); name != NULL; name = strtok(NULL, "\n"))
+        names[n++] = name;
+    qsort(names, n, sizeof(char *), cmp_name);
+    int k = 0;
+    for (int i = 0; i < n; ++i)
+        if (k == 0 || strcmp(names[k - 1], names[i]) != 0)
+            names[k++] = names[i];
+    n = k;
+
+    char found[BUFFER_SIZE / 2] = { 0 };
+    user_t *to[BUFFER_SIZE / 2];
+    for (user_t *u = users.head; u != NULL; u = u->next) {
+        char *key = u->username;
+        char **hit = bsearch(&key, names, n, sizeof(char *), cmp_name);
+        if (hit) {
+            found[hit - names] = 1;
+            to[hit - names] = u;
+        }
     }
 
-    wr_msg(user.user_fd, &r, "");
+    // encode once, fan out through the normal send path
+    size_t len = build_usrrecv(buffer, BUFFER_SIZE, user.username, message, msg_len);
+    petr_header send = { .msg_type = USRRECV, .msg_len = len + 1 };
+    int sent = 0;
+    for (int i = 0; i < n; ++i) {
+        if (found[i]) {
+            send_frame(to[i]->user_fd, &send, buffer);
+            sent++;
+        } else if (resume_buffer_user(names[i], &send, buffer) || mailbox_put(names[i], &send, buffer) == MAIL_QUEUED) {
+            found[i] = 1; // parked or offline, held for its return
+            sent++;
+        }
+    }
+    audit(AUDIT_TRACE, "User %s sent %d of %d users message %s\n", user.username, sent, n, message);
+
+    // aggregate reply listing anyone not found
+    bzero(buffer, BUFFER_SIZE);
+    size_t off = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!found[i] && off + strlen(names[i]) + 2 < BUFFER_SIZE)
+            off += sprintf(buffer + off, "%s\n", names[i]);
+    }
+    if (sent < n) {
+        r.msg_type = EUSRNOTFOUND;
+        r.msg_len = off + 1;
+    }
+    send_frame(user.user_fd, &r, buffer);
+    bzero(buffer, BUFFER_SIZE);
 }
 
 // locks buffer and userlist
 void userList(user_t user) {
-    fprintf(a_log, "User %s\n requested userlist\n", user.username);
+    audit(AUDIT_TRACE, "User %s\n requested userlist\n", user.username);
 
     for (user_t *u = users.head; u != NULL; u = u->next) {
         if (strcmp(u->username, user.username) != 0) { // not requesting user
@@ -242,75 +597,304 @@ void userList(user_t user) {
             strcat(buffer, "\n");
         }
     }
-    fprintf(a_log, "Created userlist\n");
+    audit(AUDIT_TRACE, "Created userlist\n");
 
     petr_header r = { .msg_type = USRLIST, .msg_len = strlen(buffer) ? strlen(buffer) + 1 : 0 }; 
-    wr_msg(user.user_fd, &r, buffer);
+    send_frame(user.user_fd, &r, buffer);
 
     bzero(buffer, BUFFER_SIZE); // zero buffer after sending
 }
 
 void logout(user_t user) {
     // TODO: send logout job to remove from all roomlists
-    fprintf(a_log, "Logging out user %s\n", user.username);
+    audit(AUDIT_EVENT, "Logging out user %s\n", user.username);
     // delete or remove from rooms
-    for (room_t *r = rooms.head; r != NULL; r = r->next) {
+    for (room_t *r = rooms.head, *next; r != NULL; r = next) {
+        next = r->next; // roomDelete frees r
         if (strcmp(user.username, r->owner) == 0)
             roomDelete(r->roomname, user, false);
         else
             removeUserFromRoom(&rooms, r, user); // checks if user exists
     }
     removeByIndex(&users, getIndexByFD(&users, user.user_fd)); // TODO: bad
+    resume_close(user.username);
+    mailbox_seen(user.username);
 
     petr_header r = { .msg_type = OK, .msg_len = 0 };
 
     // send response to client
-    int ret = wr_msg(user.user_fd, &r, "");
+    int ret = send_frame(user.user_fd, &r, "");
 }
 
+/*
+ * A connection dropped without LOGOUT: take the user out of its rooms and
+ * the userlist but park its session, so a LOGIN with its token can put it
+ * back. Owned rooms stay open. Caller holds buffer_lock.
+ * @return false if there is no session to park; log the user out instead
+ */
+bool park(user_t user) {
+    int n = 0;
+    for (room_t *r = rooms.head; r != NULL; r = r->next)
+        n += memberIndexByFD(r, user.user_fd) >= 0;
+    char (*in)[STR_MAX] = malloc(n * sizeof(*in));
+    uint64_t *left = malloc(n * sizeof(uint64_t));
+    int k = 0;
+    for (room_t *r = rooms.head; r != NULL; r = r->next) {
+        if (memberIndexByFD(r, user.user_fd) >= 0) {
+            strcpy(in[k], r->roomname);
+            left[k++] = roomMembers(r)->version + 1; // the snapshot without us
+        }
+    }
+    if (!resume_park(user.username, in, left, n)) {
+        free(in);
+        free(left);
+        return false;
+    }
+
+    for (room_t *r = rooms.head; r != NULL; r = r->next)
+        removeUserFromRoom(&rooms, r, user); // checks if user exists
+    removeByIndex(&users, getIndexByFD(&users, user.user_fd));
+    audit(AUDIT_EVENT, "Parked session of %s in %d rooms\n", user.username, n);
+    return true;
+}
 
-void *process_job() {
-    fprintf(a_log, "Job thread started: %lu\n", pthread_self());
+/* The rest of a logout, for a session that ended while parked. Caller holds buffer_lock. */
+void end_parked(char *name) {
+    user_t user = { .user_fd = -1 };
+    strcpy(user.username, name);
+    audit(AUDIT_EVENT, "Parked session of %s ended\n", name);
+    mailbox_seen(name);
+    for (room_t *r = rooms.head, *next; r != NULL; r = next) {
+        next = r->next; // roomDelete frees r
+        if (strcmp(name, r->owner) == 0)
+            roomDelete(r->roomname, user, false);
+    }
+}
 
-    while (1) {
-        // wait for job
-        j_msg m = sbuf_remove(&j_buf);
-        fprintf(a_log, "Removed job from buffer on thread %lu\n", pthread_self());
+void send_frames(int fd, rframe_t *f) {
+    for (rframe_t *i = f; i != NULL; i = i->next)
+        send_frame(fd, &i->h, i->body);
+    resume_free_frames(f);
+}
 
+/*
+ * Put a claimed session back on fd: reply with the new token and the
+ * rooms it is back in, rejoin the rooms, deliver what was buffered.
+ * Called with buffer_lock held; returns with it released, and sends the
+ * buffered frames after, so a client slow to read them holds up only its
+ * own thread.
+ */
+void resume_session(int fd, char *name, char *token, char (*rejoin)[STR_MAX], int n) {
+    user_t user = { .user_fd = fd };
+    strcpy(user.username, name);
+    addUser(&users, name, fd);
+
+    char *reply = malloc(RESUME_TOKEN_LEN + 3 + n * (STR_MAX + 1));
+    size_t len = sprintf(reply, "%s\r\n", token);
+    for (int i = 0; i < n; ++i)
+        if (rejoin[i][0] && getRoom(&rooms, rejoin[i]))
+            len += sprintf(reply + len, "%s\n", rejoin[i]);
+    petr_header r = { .msg_type = OK, .msg_len = len + 1 };
+    send_frame(fd, &r, reply);
+    free(reply);
+    rframe_t *buffered = resume_take(name);
+
+    int joined = 0;
+    for (int i = 0; i < n; ++i) {
+        room_t *room = rejoin[i][0] ? getRoom(&rooms, rejoin[i]) : NULL;
+        if (room) {
+            resume_rejoined(name, i, roomMembers(room)->version + 1);
+            addUserToRoom(room, user);
+            joined++;
+        }
+    }
+    pthread_mutex_unlock(&buffer_lock);
+    send_frames(fd, buffered);
+
+    // room sends on snapshots from before the rejoin may still be buffering
+    epoch_synchronize();
+    send_frames(fd, resume_finish(name));
+    audit(AUDIT_EVENT, "Resumed session of %s in %d rooms\n", name, joined);
+}
+
+/*
+ * LOGIN "name\r\ntoken": claim the parked session, first cutting off a
+ * connection of it that has not been reaped yet.
+ * @return true if the session was resumed on fd
+ */
+bool resume_login(int fd, char *name, char *token) {
+    char tok[RESUME_TOKEN_LEN + 1];
+    snprintf(tok, sizeof(tok), "%s", token);
+    if (!resume_enabled())
+        return false;
+
+    pthread_mutex_lock(&buffer_lock);
+    user_t *old = getUserByName(&users, name);
+    bool takeover = old && resume_live(name, tok);
+    if (takeover) {
+        audit(AUDIT_EVENT, "Session of %s resumed elsewhere, dropping FD %d\n", name, old->user_fd);
+        shutdown(old->user_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&buffer_lock);
+    for (int ms = 0; takeover && resume_live(name, tok) && ms < RESUME_TAKEOVER_MS; ++ms)
+        usleep(1000);
+
+    pthread_mutex_lock(&buffer_lock);
+    char (*rejoin)[STR_MAX];
+    int n = resume_claim(name, tok, &rejoin);
+    if (n < 0) {
+        pthread_mutex_unlock(&buffer_lock);
+        audit(AUDIT_EVENT, "No session of %s to resume\n", name);
+        return false;
+    }
+    resume_session(fd, name, tok, rejoin, n);
+    return true;
+}
+
+/*
+ * Complete a LOGIN for name on fd, resuming its parked session if token
+ * is set. Runs on the client's own thread: a takeover waits for the old
+ * connection to park, and queued frames are sent with blocking writes.
+ * @return false if name is taken; fd is not logged in
+ */
+bool start_session(int fd, char *name, char *token) {
+    if (token[0] && resume_login(fd, name, token))
+        return true;
+
+    petr_header r = { .msg_len = 0 };
+    pthread_mutex_lock(&buffer_lock);
+    if (!nameExists(&users, name) && resume_evict(name))
+        end_parked(name); // a fresh login ends the parked session
+    if (nameExists(&users, name)) {
+        pthread_mutex_unlock(&buffer_lock);
+        audit(AUDIT_EVENT, "Invalid login for username %s: user exists\n", name);
+
+        // respond with error
+        r.msg_type = EUSREXISTS;
+        send_frame(fd, &r, "");
+        return false;
+    }
+    audit(AUDIT_EVENT, "Login accepted for user %s\n", name);
+
+    addUser(&users, name, fd); // add user to userlist
+
+    // reply OK, with the token to resume this session by
+    char token_out[RESUME_TOKEN_LEN + 1] = "";
+    r.msg_type = OK;
+    r.msg_len = resume_open(name, token_out) ? RESUME_TOKEN_LEN + 1 : 0;
+    send_frame(fd, &r, token_out);
+    rframe_t *mail = mailbox_take(name);
+    pthread_mutex_unlock(&buffer_lock);
+
+    // DMs sent while it was away; blocking writes, so not under buffer_lock
+    send_frames(fd, mail);
+    return true;
+}
+
+/* Accept loop: end sessions whose grace ran out */
+void reap_parked() {
+    uint64_t rings;
+    char name[STR_MAX];
+    read(resume_doorbell(), &rings, sizeof(rings));
+    while (resume_expired(name)) {
         pthread_mutex_lock(&buffer_lock);
-        bzero(buffer, BUFFER_SIZE); // start with empty buffer
+        end_parked(name);
+        pthread_mutex_unlock(&buffer_lock);
+    }
+}
+
+
+// only the accept loop handles upgrade requests
+void block_upgrade_signal() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void *process_job(void *seq) {
+    block_upgrade_signal();
+    int node = aff_pin_job((intptr_t)seq);
+    audit(AUDIT_EVENT, "Job thread started: %lu (node %d)\n", pthread_self(), node);
+
+    while (1) {
+        // wait for job, parking in the queue; exit if the pool is shrinking
+        j_msg m;
+        if (sbuf_remove_timed(&j_buf, &m, JOBPOOL_IDLE_MS, node) < 0) {
+            if (jobpool_retire()) {
+                audit(AUDIT_EVENT, "Job thread retired: %lu\n", pthread_self());
+                return NULL;
+            }
+            continue;
+        }
+        uint64_t t_deq = mono_ns();
+        admit_dequeued(m.header.msg_type);
+        admit_sample_delay(m.t_enq, t_deq);
+        audit(AUDIT_TRACE, "Removed job from buffer on thread %lu\n", pthread_self());
+
+        // room sends and listings only read membership snapshots
+        conn_seq_t *q = &conn_seqs[m.user.user_fd];
+        bool reader = m.header.msg_type == RMSEND || m.header.msg_type == RMLIST || m.header.msg_type == RMSEARCH;
+        if (m.header.msg_type == RMSEND) {
+            while (atomic_load(&q->sent) != m.ticket)
+                sched_yield();
+        }
+        if (!reader)
+            pthread_mutex_lock(&buffer_lock);
+        uint64_t t_lock = mono_ns();
+        jobpool_busy(); // not while waiting: another worker would not help
+        trace_event(m.trace_id, TR_QUEUE, m.header.msg_type, m.t_enq, t_deq);
+        trace_event(m.trace_id, TR_JOB_LOCK, m.header.msg_type, t_deq, t_lock);
+        trace_set_current(m.trace_id, m.header.msg_type);
+        set_reply_tag(m.user.user_fd, m.tagged, m.reqid);
+        if (!reader)
+            bzero(buffer, BUFFER_SIZE); // start with empty buffer
         switch (m.header.msg_type) {
         case RMCREATE:
-            roomCreate(m.msg, m.user);
+            roomCreate(FIELD(m, 0), m.user);
             break;
         case RMDELETE:
-            roomDelete(m.msg, m.user, true);
+            roomDelete(FIELD(m, 0), m.user, true);
             break;
         case RMLIST:
             roomList(m.user);
             break;
         case RMJOIN:
-            roomJoin(m.msg, m.user);
+            roomJoin(FIELD(m, 0), m.user);
             break;
         case RMLEAVE:
-            roomLeave(m.msg, m.user);
+            roomLeave(FIELD(m, 0), m.user);
             break;
         case RMSEND:
-            roomSend(m.msg, m.user);
+            roomSend(FIELD(m, 0), FIELD(m, 1), m.fields.len[1], m.user);
+            break;
+        case RMSEARCH:
+            roomSearch(FIELD(m, 0), FIELD(m, 1), m.fields.n > 2 ? FIELD(m, 2) : NULL, m.user);
             break;
         case USRSEND:
-            userSend(m.msg, m.user);
+            userSend(FIELD(m, 0), FIELD(m, 1), m.fields.len[1], m.user);
+            break;
+        case USRMSEND:
+            userMultiSend(FIELD(m, 0), FIELD(m, 1), m.fields.len[1], m.user);
             break;
         case USRLIST:
             userList(m.user);
             break;
         default:
-            fprintf(a_log, "OH NO!!!\n");
+            audit(AUDIT_ERROR, "OH NO!!!\n");
             petr_header r = { .msg_type = ESERV, .msg_len = 0 };
-            wr_msg(m.user.user_fd, &r, "");
+            send_frame(m.user.user_fd, &r, "");
         }
 
-        pthread_mutex_unlock(&buffer_lock);
+        trace_event(m.trace_id, TR_HANDLE, m.header.msg_type, t_lock, mono_ns());
+        trace_set_current(0, 0);
+        set_reply_tag(-1, false, 0);
+        if (m.header.msg_type == RMSEND)
+            atomic_fetch_add(&q->sent, 1);
+        inflight_done(m.user.user_fd);
+        if (!reader)
+            pthread_mutex_unlock(&buffer_lock);
+        jobpool_idle();
     }
 
     return NULL;
@@ -321,12 +905,12 @@ int server_init(int server_port) {
     struct sockaddr_in servaddr;
 
     // socket create and verification
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sockfd == -1) {
         printf("socket creation failed...\n");
         exit(EXIT_FAILURE);
     } else
-        fprintf(a_log, "Socket successfully created\n");
+        audit(AUDIT_EVENT, "Socket successfully created\n");
 
     bzero(&servaddr, sizeof(servaddr));
 
@@ -343,156 +927,520 @@ int server_init(int server_port) {
 
     // Binding newly created socket to given IP and verification
     if ((bind(sockfd, (SA *)&servaddr, sizeof(servaddr))) != 0) {
-        fprintf(a_log, "socket bind failed\n");
+        audit(AUDIT_ERROR, "socket bind failed\n");
         exit(EXIT_FAILURE);
     } else
-        fprintf(a_log, "Socket successfully binded\n");
+        audit(AUDIT_EVENT, "Socket successfully binded\n");
 
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 1)) != 0) {
-        fprintf(a_log, "Listen failed\n");
+    if ((listen(sockfd, SOMAXCONN)) != 0) {
+        audit(AUDIT_ERROR, "Listen failed\n");
         exit(EXIT_FAILURE);
     } else
-        fprintf(a_log, "Server listening on port: %d.. Waiting for connection\n", server_port);
+        audit(AUDIT_EVENT, "Server listening on port: %d.. Waiting for connection\n", server_port);
 
     return sockfd;
 }
 
+atomic_int io_seq; // client threads started, for placement
+
+typedef struct {
+    int fd;
+    atomic_uint_fast64_t last_rx; // mono_ns of the last frame read
+    wtimer_t idle;
+    wtimer_t heartbeat;
+} conn_timers_t;
+
+/*
+ * Timer callbacks run on the wheel thread. They only shut the socket
+ * down; the client thread then sees EOF and logs the user out itself.
+ */
+void idle_expired(void *arg) {
+    conn_timers_t *c = arg;
+    uint64_t quiet = mono_ns() - atomic_load(&c->last_rx);
+    if (quiet < idle_ns) {
+        // heard from since arming; sleep for the remainder
+        timer_add(&c->idle, (idle_ns - quiet) / NS_PER_MS + 1, idle_expired, c);
+        return;
+    }
+    audit(AUDIT_EVENT, "Reaping idle client (FD %d)\n", c->fd);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+void heartbeat_due(void *arg) {
+    conn_timers_t *c = arg;
+    // the kernel sends the keepalive probes; we decide when enough went unanswered
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0
+        && (ti.tcpi_probes >= HEARTBEAT_MISSES
+            || (ti.tcpi_unacked && ti.tcpi_last_ack_recv >= HEARTBEAT_MISSES * heartbeat_ms))) {
+        audit(AUDIT_EVENT, "Heartbeat lost for client (FD %d)\n", c->fd);
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    timer_add(&c->heartbeat, heartbeat_ms, heartbeat_due, c);
+}
+
+void login_expired(void *arg) {
+    int fd = (intptr_t)arg;
+    audit(AUDIT_EVENT, "Login deadline passed (FD %d)\n", fd);
+    shutdown(fd, SHUT_RDWR);
+}
+
+void conn_timers_start(conn_timers_t *c, int fd) {
+    c->fd = fd;
+    atomic_init(&c->last_rx, mono_ns());
+    if (idle_ns)
+        timer_add(&c->idle, idle_ns / NS_PER_MS, idle_expired, c);
+    if (heartbeat_ms) {
+        // probe after one quiet period, then once per period
+        int one = 1, secs = (heartbeat_ms + 999) / 1000, cnt = HEARTBEAT_MISSES + 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &secs, sizeof(secs));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &secs, sizeof(secs));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+        timer_add(&c->heartbeat, heartbeat_ms, heartbeat_due, c);
+    }
+}
+
+void conn_timers_stop(conn_timers_t *c) {
+    timer_cancel_sync(&c->idle);
+    timer_cancel_sync(&c->heartbeat);
+}
+
+// what the accept loop hands a client thread
+typedef struct {
+    int fd;
+    char name[STR_MAX];               // LOGIN to complete, "" if logged in already
+    char token[RESUME_TOKEN_LEN + 1]; // session it asked to resume, "" if none
+} conn_start_t;
+
 //Function running in thread
-void *process_client(void *clientfd_ptr) {
-    fprintf(a_log, "Processing client\n");
-    int client_fd = *(int *)clientfd_ptr;
-    free(clientfd_ptr);
+void *process_client(void *start_ptr) {
+    pthread_detach(pthread_self()); // nobody joins client threads; free the stack on exit
+    block_upgrade_signal();
+    int node = aff_pin_io(atomic_fetch_add(&io_seq, 1));
+    audit(AUDIT_EVENT, "Processing client (node %d)\n", node);
+    conn_start_t *start = start_ptr;
+    int client_fd = start->fd;
+    for (int hwm = atomic_load(&conn_hwm); hwm <= client_fd;)
+        atomic_compare_exchange_weak(&conn_hwm, &hwm, client_fd + 1);
+    bool in = true;
+    if (start->name[0] != '\0') {
+        conn_seqs[client_fd].tagged = false; // left over from the fd's last connection
+        in = start_session(client_fd, start->name, start->token);
+        atomic_fetch_sub(&logging_in, 1);
+    }
+    free(start);
+    if (!in) {
+        audit(AUDIT_EVENT, "Closing client (FD %d)\n", client_fd);
+        capture_disconnect(client_fd);
+        close(client_fd);
+        return NULL;
+    }
     int received_size;
-    fd_set read_fds;
+    // poll, not select: client fds run well past FD_SETSIZE in large rooms
+    struct pollfd pfd[2] = {
+        { .fd = client_fd, .events = POLLIN },
+        { .fd = -1, .events = POLLIN }, // ring doorbell once negotiated
+    };
+    tbucket_t bucket; // per-user rate limit
+    tbucket_init(&bucket);
+    conn_timers_t timers = { 0 };
+    conn_timers_start(&timers, client_fd);
+    bool logged_out = false;
+    bool tcp = sockopt_is_tcp(client_fd);
+    bool corked = false;
+    int batch = 0; // frames read since we last slept
+    conn_seq_t *seq = &conn_seqs[client_fd];
+    atomic_store(&seq->uncork, 0); // left over from the fd's last connection
 
     int retval;
     while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_fd, &read_fds);
-        retval = select(client_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (retval != 1 && !FD_ISSET(client_fd, &read_fds)) {
-            fprintf(a_log, "Error with select() function\n");
-            break;
+        // drain ring frames first; only sleep once the ring is empty and armed
+        bool ring = xp_pending(client_fd);
+        if (!ring) {
+            pfd[1].fd = xp_doorbell(client_fd);
+            retval = poll(pfd, 2, 0);
+            if (retval > 0 && batch > 0 && tcp && !corked) {
+                // pipelined input: hold replies until the batch is answered;
+                // the last batch may still be corked, waiting on its jobs
+                batch += atomic_exchange(&seq->uncork, 0);
+                sockopt_cork(client_fd);
+                corked = true;
+            } else if (retval == 0) {
+                if (corked) {
+                    // input drained: uncork now if no job of the batch is
+                    // left to reply, else the last one uncorks
+                    atomic_store(&seq->uncork, batch);
+                    int frames;
+                    if (atomic_load(&seq->inflight) == 0 && (frames = atomic_exchange(&seq->uncork, 0)) > 0)
+                        sockopt_uncork(client_fd, frames);
+                    corked = false;
+                }
+                batch = 0;
+                retval = poll(pfd, 2, -1);
+            }
+            if (retval < 0 && errno == EINTR)
+                continue;
+            if (retval < 1) {
+                audit(AUDIT_ERROR, "Error with poll() function\n");
+                break;
+            }
+            if (pfd[1].revents & POLLIN) {
+                uint64_t rings;
+                read(pfd[1].fd, &rings, sizeof(rings));
+            }
+            if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
         }
+        batch++;
 
+        uint32_t trace_id = trace_sample();
+        uint64_t t_wake = trace_id ? mono_ns() : 0;
         pthread_mutex_lock(&buffer_lock);
+        uint64_t t_locked = trace_id ? mono_ns() : 0;
+        if (atomic_load(&draining)) {
+            // a hot upgrade is waiting for requests already read; leave this one unread
+            pthread_mutex_unlock(&buffer_lock);
+            usleep(1000);
+            continue;
+        }
 
-        fprintf(a_log, "Client thread: %lu\n", pthread_self());
+        audit(AUDIT_TRACE, "Client thread: %lu\n", pthread_self());
 
-        // read header
+        // same frame either way; only where it comes from differs
         petr_header r, s;
-        rd_msgheader(client_fd, &r);
-        if (r.msg_len < 0) {
-            fprintf(a_log, "Error reading message\n");
+        bzero(buffer, BUFFER_SIZE);
+        if (ring) {
+            if (xp_read(client_fd, &r, buffer, BUFFER_SIZE) < 0) {
+                audit(AUDIT_ERROR, "Invalid ring frame\n");
+                pthread_mutex_unlock(&buffer_lock);
+                break;
+            }
+        } else {
+            // read header
+            if (rd_msgheader(client_fd, &r) < 0) {
+                audit(AUDIT_ERROR, "Error reading message\n");
 
-            pthread_mutex_unlock(&buffer_lock);
-            break;
+                pthread_mutex_unlock(&buffer_lock);
+                break;
+            }
+
+            // read buffer
+            received_size = r.msg_len <= BUFFER_SIZE ? read(client_fd, buffer, r.msg_len) : -1;
+            if (received_size < 0 || received_size != r.msg_len) {
+                audit(AUDIT_ERROR, "Invalid size\n");
+                pthread_mutex_unlock(&buffer_lock);
+                break;
+            }
         }
-        
-        // read buffer
-        bzero(buffer, BUFFER_SIZE);
-        received_size = read(client_fd, buffer, r.msg_len);
-        if (received_size < 0 || received_size != r.msg_len) {
-            fprintf(a_log, "Invalid size\n");
+        capture_frame(client_fd, &r, buffer);
+        atomic_store(&timers.last_rx, mono_ns());
+
+        if (r.msg_type == REQID) {
+            // not a request: tags the next one on this connection
+            seq->tagged = r.msg_len == sizeof(uint32_t);
+            memcpy(&seq->tag, buffer, sizeof(uint32_t));
             pthread_mutex_unlock(&buffer_lock);
-            break;
+            continue;
         }
+        // replies sent from this thread carry the tag; queued jobs carry their own
+        uint32_t tag = seq->tag;
+        bool req_tagged = seq->tagged;
+        set_reply_tag(client_fd, req_tagged, tag);
+        seq->tagged = false;
 
         if (r.msg_type == LOGOUT) {
+            // earlier requests may still be queued, and with REQID their
+            // replies can come after this one; wait for them before closing
+            pthread_mutex_unlock(&buffer_lock);
+            drain_inflight(client_fd);
+            pthread_mutex_lock(&buffer_lock);
+            set_reply_tag(client_fd, req_tagged, tag);
+
             // this sucks
             logout(*getUser(&users, getIndexByFD(&users, client_fd)));
+            logged_out = true;
 
             pthread_mutex_unlock(&buffer_lock);
             break;
+        } else if (r.msg_type == XPSHM) {
+            // connection-level, answered here rather than by a job
+            if (xp_negotiate(client_fd) < 0) {
+                s.msg_type = ESERV;
+                s.msg_len = 0;
+                send_frame(client_fd, &s, "");
+            }
+            pthread_mutex_unlock(&buffer_lock);
         } else {
+            // split once here; handlers get the fields, malformed payloads never queue
+            fields_t fields;
+            if (scan_frame(r.msg_type, buffer, r.msg_len, BUFFER_SIZE, &fields) < 0) {
+                audit(AUDIT_ERROR, "Malformed %#x payload from FD %d\n", r.msg_type, client_fd);
+                s.msg_type = ESERV;
+                s.msg_len = 0;
+                send_frame(client_fd, &s, "");
+                pthread_mutex_unlock(&buffer_lock);
+                continue;
+            }
+
+            // shed load early instead of blocking on a full queue
+            enum admit_reason why = admit_check(&bucket, r.msg_type);
+            if (why != ADMIT_OK) {
+                admit_reject(why);
+                s.msg_type = ESERV;
+                s.msg_len = 0;
+                send_frame(client_fd, &s, "");
+                pthread_mutex_unlock(&buffer_lock);
+                continue;
+            }
+
             j_msg n_job; // new job
             n_job.header = r; // forward header
             n_job.user = *getUser(&users, getIndexByFD(&users, client_fd)); // TODO: totally unsafe
-            strcpy(n_job.msg, buffer);
+            n_job.fields = fields;
+            memcpy(n_job.msg, buffer, r.msg_len < BUFFER_SIZE ? r.msg_len + 1 : BUFFER_SIZE);
 
+            // in flight before the lock drops, so an upgrade draining under it sees this job
+            conn_seq_t *q = &conn_seqs[client_fd];
+            atomic_fetch_add(&q->inflight, 1);
             pthread_mutex_unlock(&buffer_lock);
 
-            fprintf(a_log, "Inserting job to job buffer\n");
-            sbuf_insert(&j_buf, n_job); // add job
+            audit(AUDIT_TRACE, "Inserting job to job buffer\n");
+            admit_enqueued(r.msg_type);
+            if (r.msg_type == RMSEND)
+                n_job.ticket = atomic_fetch_add(&q->sends, 1);
+            n_job.t_enq = mono_ns();
+            n_job.trace_id = trace_id;
+            n_job.node = node; // keep the job on this thread's node
+            n_job.tagged = req_tagged;
+            n_job.reqid = tag;
+            trace_event(trace_id, TR_LOCK_WAIT, r.msg_type, t_wake, t_locked);
+            trace_event(trace_id, TR_READ, r.msg_type, t_locked, n_job.t_enq);
+            if (sbuf_tryinsert(&j_buf, &n_job) < 0) { // add job
+                admit_dequeued(r.msg_type); // never queued: no delay sample
+                admit_reject(ADMIT_FULL);
+                inflight_done(client_fd);
+                if (r.msg_type == RMSEND)
+                    atomic_fetch_sub(&q->sends, 1); // ours was the last ticket
+
+                pthread_mutex_lock(&buffer_lock);
+                s.msg_type = ESERV;
+                s.msg_len = 0;
+                send_frame(client_fd, &s, "");
+                pthread_mutex_unlock(&buffer_lock);
+            }
+            set_reply_tag(-1, false, 0);
         }
     }
+    conn_timers_stop(&timers);
+
+    // dead, reaped or misbehaving clients leave their rooms the same way,
+    // once the requests they already queued are done
+    drain_inflight(client_fd);
+    pthread_mutex_lock(&buffer_lock);
+    if (!logged_out) {
+        int i = getIndexByFD(&users, client_fd);
+        if (i >= 0 && !park(*getUser(&users, i)))
+            logout(*getUser(&users, i));
+    }
+    pthread_mutex_unlock(&buffer_lock);
+
+    // broadcasts that took a snapshot with us in it may still be writing
+    epoch_synchronize();
+    pthread_mutex_lock(&buffer_lock);
+    xp_detach(client_fd); // no writers now: our jobs are drained and we are in no snapshot
+    pthread_mutex_unlock(&buffer_lock);
+
     // Close the socket at the end
-    fprintf(a_log, "Closing client (FD: %d)\n", client_fd);
+    audit(AUDIT_EVENT, "Closing client (FD: %d)\n", client_fd);
+    capture_disconnect(client_fd);
     close(client_fd);
     return NULL;
 }
 
-void run_server(int server_port, int j_threads) {
-    listen_fd = server_init(server_port); // Initiate server and start listening on specified port
+int server_init_unix(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        audit(AUDIT_ERROR, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        printf("socket creation failed...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // a stale socket file from an earlier run would fail the bind
+    unlink(path);
+    if (bind(sockfd, (SA *)&addr, sizeof(addr)) != 0 || listen(sockfd, SOMAXCONN) != 0) {
+        audit(AUDIT_ERROR, "Unix socket bind failed\n");
+        exit(EXIT_FAILURE);
+    }
+    audit(AUDIT_EVENT, "Server listening on %s\n", path);
+
+    return sockfd;
+}
+
+void run_server(server_config *cfg) {
     int client_fd;
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
+
+    xp_init(a_log);
+    struct rlimit rl;
+    size_t slots = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur : 65536;
+    conn_seqs = calloc(slots, sizeof(conn_seq_t));
+
+    if (cfg->handoff_fd >= 0) {
+        // take over listening socket, clients and state from the old server
+        listen_fd = handoff_recv(cfg->handoff_fd, &unix_fd, &users, &rooms, restore_tag);
+        close(cfg->handoff_fd);
+        if (listen_fd < 0) {
+            audit(AUDIT_ERROR, "Handoff from old server failed\n");
+            exit(EXIT_FAILURE);
+        }
+        audit(AUDIT_EVENT, "Took over %d users and %d rooms from old server\n", users.length, rooms.length);
+    } else {
+        listen_fd = server_init(cfg->port); // Initiate server and start listening on specified port
+        if (unix_path)
+            unix_fd = server_init_unix(unix_path);
+    }
 
     // handle interrupt
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
-        fprintf(a_log, "signal handler processing error\n");
+        audit(AUDIT_ERROR, "signal handler processing error\n");
+
+    // a client vanishing mid-reply (e.g. after an ESERV rejection) must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    // handle upgrade; no SA_RESTART so accept() returns EINTR
+    struct sigaction sa = { .sa_handler = sigusr2_handler };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) < 0)
+        audit(AUDIT_ERROR, "signal handler processing error\n");
 
     // TODO: initialize userlist? necessary? 
 
-    // initialize job queue
-    sbuf_init(&j_buf, MAX_JOBS);
+    // pin threads and size the job queue to the NUMA nodes in use
+    if (aff_init(cfg->io_cpus, cfg->job_cpus, a_log) < 0) {
+        audit(AUDIT_ERROR, "Invalid CPU list\n");
+        exit(EXIT_FAILURE);
+    }
+    aff_pin_accept();
 
-    // start job threads
-    for (int i = 0; i < j_threads; ++i) {
-        pthread_t jtid;
-        pthread_create(&jtid, NULL, process_job, NULL);
+    // initialize job queue
+    sbuf_init(&j_buf, MAX_JOBS, aff_nodes());
+    admit_init(MAX_JOBS, cfg->rate, ADMIT_BURST_X * cfg->rate, cfg->max_delay_ms, a_log);
+
+    // start job threads; the pool resizes itself between -j and -J
+    int fanout_threads = cfg->fanout;
+    if (fanout_threads < 0)
+        fanout_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    fanout_init(fanout_threads, send_frame, a_log);
+    idle_ns = (uint64_t)cfg->idle_s * NS_PER_SEC;
+    heartbeat_ms = cfg->heartbeat_s * 1000;
+    timer_start(a_log);
+    resume_init(cfg->grace_s, a_log);
+    sockopt_init(a_log);
+    search_init((size_t)cfg->search_mb << 20, a_log);
+    if (mailbox_init(cfg->mailbox_mb, a_log) < 0) {
+        audit(AUDIT_ERROR, "Cannot map a %d MB mailbox segment\n", cfg->mailbox_mb);
+        exit(EXIT_FAILURE);
     }
+    scan_use(NULL);
+    audit(AUDIT_EVENT, "Payload scanner: %s\n", scan_impl());
+    jobpool_init(cfg->j_threads, cfg->j_max, process_job, a_log);
+    jobpool_start();
 
     pthread_t tid;
 
+    // resume client threads for inherited users
+    for (user_t *u = users.head; u != NULL; u = u->next) {
+        conn_start_t *start = calloc(1, sizeof(conn_start_t));
+        start->fd = u->user_fd;
+        sockopt_apply(start->fd);
+        if (sockopt_is_tcp(start->fd))
+            sockopt_uncork(start->fd, 0); // the old server may have left it mid-batch
+        capture_conn(start->fd);
+        pthread_create(&tid, NULL, process_client, start);
+    }
+
     while (1) {
-        // Wait and Accept the connection from client
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade();
+        }
+
+        // Wait for a connection on either listener, or for parked sessions to expire
+        struct pollfd lp[3] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = unix_fd, .events = POLLIN },
+            { .fd = resume_doorbell(), .events = POLLIN },
+        };
+        if (poll(lp, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            audit(AUDIT_ERROR, "server poll failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (lp[2].revents & POLLIN)
+            reap_parked();
+        if (!((lp[0].revents | lp[1].revents) & POLLIN))
+            continue;
+        int from = (lp[0].revents & POLLIN) ? listen_fd : unix_fd;
+
+        // Accept the connection from client
         int *client_fd = malloc(sizeof(int));
-        *client_fd = accept(listen_fd, (SA *)&client_addr, (socklen_t*)&client_addr_len);
-        if (*client_fd < 0) {
-            fprintf(a_log, "server acccept failed\n");
+        *client_fd = accept4(from, NULL, NULL, SOCK_CLOEXEC);
+        if (*client_fd < 0 && errno == EINTR) {
+            free(client_fd);
+            continue;
+        } else if (*client_fd < 0) {
+            audit(AUDIT_ERROR, "server acccept failed\n");
             exit(EXIT_FAILURE);
         } else {
-            fprintf(a_log, "Client connection accepted (FD %d)\n", *client_fd);
-
-            petr_header login, r;
-            r.msg_len = 0;
-
-            rd_msgheader(*client_fd, &login);
-            if (login.msg_len < 0) {
-                fprintf(a_log, "Error reading message, closing connection\n");
+            audit(AUDIT_EVENT, "Client connection accepted (FD %d)\n", *client_fd);
+            capture_conn(*client_fd);
+            sockopt_apply(*client_fd);
+
+            petr_header login;
+
+            // a client that connects and never logs in must not stall the accept loop
+            wtimer_t deadline;
+            timer_add(&deadline, cfg->login_ms, login_expired, (void *)(intptr_t)*client_fd);
+
+            char body[STR_MAX + RESUME_TOKEN_LEN + 2] = ""; // "name" or "name\r\ntoken"
+            int ok = rd_msgheader(*client_fd, &login) >= 0;
+            if (ok && login.msg_len <= sizeof(body))
+                ok = read(*client_fd, body, login.msg_len) == (ssize_t)login.msg_len;
+            timer_cancel_sync(&deadline);
+            capture_frame(*client_fd, &login, body);
+
+            fields_t f;
+            if (!ok) {
+                audit(AUDIT_ERROR, "Error reading message, closing connection\n");
                 close(*client_fd);
+                free(client_fd);
                 continue;
-            } else if (login.msg_len > STR_MAX) {
-                fprintf(a_log, "Username too long, closing connection\n");
+            } else if (login.msg_len > sizeof(body) || scan_frame(LOGIN, body, login.msg_len, sizeof(body), &f) < 0) {
+                audit(AUDIT_ERROR, "Username too long or malformed, closing connection\n");
                 close(*client_fd);
+                free(client_fd);
                 continue;
             }
-
-            char name[STR_MAX];
-            read(*client_fd, name, login.msg_len);
-            if (nameExists(&users, name)) {
-                fprintf(a_log, "Invalid login for username %s: user exists\n", name);
-
-                // respond with error
-                r.msg_type = EUSREXISTS;
-                wr_msg(*client_fd, &r, "");
-
-                fprintf(a_log, "Closing client (FD %d)\n", *client_fd);
-                close(*client_fd);
-            } else {
-                fprintf(a_log, "Login accepted for user %s\n", name);
-
-                addUser(&users, name, *client_fd); // add user to userlist
-
-                // reply OK
-                r.msg_type = OK;
-                wr_msg(*client_fd, &r, "");
-
-                // create client thread
-                pthread_create(&tid, NULL, process_client, (void *)client_fd);
-            }
+            // the rest of the login runs on the client's thread
+            conn_start_t *start = calloc(1, sizeof(conn_start_t));
+            start->fd = *client_fd;
+            free(client_fd);
+            strcpy(start->name, body + f.off[0]);
+            if (f.n > 1)
+                snprintf(start->token, sizeof(start->token), "%s", body + f.off[1]);
+            atomic_fetch_add(&logging_in, 1);
+            pthread_create(&tid, NULL, process_client, start);
         }
     }
     bzero(buffer, BUFFER_SIZE);
@@ -503,21 +1451,111 @@ void run_server(int server_port, int j_threads) {
 int main(int argc, char *argv[]) {
     int opt;
 
-    const char usage[] = "%s [-h] [-j N] PORT_NUMBER AUDIT_FILENAME\n";
-    unsigned int port = 0;
-    unsigned int j_threads = 2;
+    const char usage[] = "%s [-h] [-j N] [-J N] [-r RATE] [-d MS] [-c FILE] [-t N] [-T FILE] [-p CPUS] [-P CPUS] [-F N] [-I SECS] [-K SECS] [-L MS] [-U PATH] [-o OPTS] [-S MB] [-G SECS] [-M MB] [-H FD] PORT_NUMBER AUDIT_FILENAME\n";
+    server_config cfg = {
+        .j_threads = 2,
+        .j_max = 0,
+        .handoff_fd = -1,
+        .rate = ADMIT_RATE,
+        .max_delay_ms = ADMIT_MAX_DELAY_MS,
+        .fanout = -1,
+        .idle_s = 0,
+        .heartbeat_s = 30,
+        .login_ms = 5000,
+        .grace_s = 0,
+    };
+    char *capture_path = NULL;
+    int trace_every = 0;
+    char *trace_path = "trace.json";
     //char audit_log[STR_MAX];
-    while ((opt = getopt(argc, argv, "hj:")) != -1) {
+    s_argv = argv;
+    while ((opt = getopt(argc, argv, "hj:J:r:d:c:t:T:p:P:F:I:K:L:U:o:S:G:M:H:")) != -1) {
         switch (opt) {
         case 'h':
             printf(usage, argv[0]);
             printf("\n-h\t\tDisplays this help menu, and returns EXIT_SUCCESS.\n");
-            printf("-j N\t\tNumber of job threads. Default to 2.\n");
+            printf("-j N\t\tNumber of job threads (pool minimum). Default to 2.\n");
+            printf("-J N\t\tMaximum job threads the pool may grow to. Default to 4x -j.\n");
+            printf("-r RATE\t\tPer-user request rate limit (req/s, 0 = off), bursts of %dx RATE. Default to %d.\n", ADMIT_BURST_X, ADMIT_RATE);
+            printf("-d MS\t\tQueue delay above which requests are shed. Default to %d.\n", ADMIT_MAX_DELAY_MS);
+            printf("-c FILE\t\tCapture incoming frames to FILE for petr_replay.\n");
+            printf("-t N\t\tTrace one in every N requests. Default to 0 (off).\n");
+            printf("-T FILE\t\tWrite traces as Chrome trace JSON to FILE on shutdown. Default to trace.json.\n");
+            printf("-p CPUS\t\tPin client I/O threads to CPUS, e.g. 0-3,8. Default unpinned.\n");
+            printf("-P CPUS\t\tPin job threads to CPUS. Default unpinned.\n");
+            printf("-F N\t\tWorkers sharing broadcasts to rooms of %d+ members (0 = off). Default to one per spare CPU.\n", FANOUT_MIN);
+            printf("-I SECS\t\tLog out clients silent for SECS. Default to 0 (never).\n");
+            printf("-K SECS\t\tHeartbeat period; %d missed probes drop the client (0 = off). Default to 30.\n", HEARTBEAT_MISSES);
+            printf("-L MS\t\tDeadline for a new connection to send LOGIN. Default to 5000.\n");
+            printf("-U PATH\t\tAlso listen on a Unix domain socket at PATH; clients there may use shared-memory rings.\n");
+            printf("-o OPTS\t\tSocket options: nodelay[=0|1],sndbuf=BYTES,rcvbuf=BYTES,busypoll=US,sndtimeo=MS. Default nodelay,sndtimeo=%d.\n", SOCKOPT_SNDTIMEO_MS);
+            printf("-S MB\t\tIndex recent room messages in up to MB megabytes for RMSEARCH (0 = off). Default to 0.\n");
+            printf("-G SECS\t\tKeep a dropped client's session resumable by its LOGIN token (0 = off). Default to 0.\n");
+            printf("-M MB\t\tQueue DMs to users offline under %d hours, spilling to an MB megabyte file (0 = off). Default to 0.\n", MAILBOX_KEEP_S / 3600);
+            printf("-H FD\t\tTake over from an upgrading server (internal, see SIGUSR2). Parked sessions end and\n"
+                   "\t\tlive resume tokens, queued DMs and the search index are not carried over.\n");
             printf("AUDIT_FILENAME\tFile to output Audit Log messages to.\n");
             printf("PORT_NUMBER\tPort number to listen on.\n");
             exit(EXIT_SUCCESS);
         case 'j':
-            j_threads = atoi(optarg);
+            cfg.j_threads = atoi(optarg);
+            break;
+        case 'J':
+            cfg.j_max = atoi(optarg);
+            break;
+        case 'r':
+            cfg.rate = atoi(optarg);
+            break;
+        case 'd':
+            cfg.max_delay_ms = atoi(optarg);
+            break;
+        case 'c':
+            capture_path = optarg;
+            break;
+        case 't':
+            trace_every = atoi(optarg);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'p':
+            cfg.io_cpus = optarg;
+            break;
+        case 'P':
+            cfg.job_cpus = optarg;
+            break;
+        case 'F':
+            cfg.fanout = atoi(optarg);
+            break;
+        case 'I':
+            cfg.idle_s = atoi(optarg);
+            break;
+        case 'K':
+            cfg.heartbeat_s = atoi(optarg);
+            break;
+        case 'L':
+            cfg.login_ms = atoi(optarg);
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'o':
+            if (sockopt_parse(optarg) < 0) {
+                fprintf(stderr, "Invalid socket options %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            cfg.search_mb = atoi(optarg);
+            break;
+        case 'G':
+            cfg.grace_s = atoi(optarg);
+            break;
+        case 'M':
+            cfg.mailbox_mb = atoi(optarg);
+            break;
+        case 'H':
+            cfg.handoff_fd = atoi(optarg);
             break;
         default: /* '?' */
             fprintf(stderr, usage, argv[0]);
@@ -529,17 +1567,31 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, usage, argv[0]);
         exit(EXIT_FAILURE);
     } else {
-        port = atoi(argv[optind]);
-        a_log = fopen(argv[optind+1], "w");
+        cfg.port = atoi(argv[optind]);
+        // append mode so old and new server can share the log across a hot upgrade
+        a_log = fopen(argv[optind+1], "ae");
         if (a_log == NULL) {
             fprintf(stderr, usage, argv[0]);
             exit(EXIT_FAILURE);
         }
+        // a pipe or /dev/null cannot be truncated; anything else is worth a warning
+        if (cfg.handoff_fd < 0 && ftruncate(fileno(a_log), 0) < 0 && errno != EINVAL)
+            fprintf(stderr, "Cannot truncate audit file %s: %s\n", argv[optind + 1], strerror(errno));
     }
 
-    fprintf(a_log, "Starting server with %d job threads on port: %d\n", j_threads, port);
+    if (capture_path && capture_open(capture_path) < 0) {
+        fprintf(stderr, "Cannot open capture file %s\n", capture_path);
+        exit(EXIT_FAILURE);
+    }
+
+    trace_init(trace_every, trace_path);
+
+    if (cfg.j_max == 0)
+        cfg.j_max = 4 * cfg.j_threads;
+
+    audit(AUDIT_EVENT, "Starting server with %d-%d job threads on port: %d\n", cfg.j_threads, cfg.j_max, cfg.port);
 
-    run_server(port, j_threads);
+    run_server(&cfg);
 
     return 0;
 }
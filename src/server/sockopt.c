@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "sockopt.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static int nodelay = 1;
+static int sndbuf, rcvbuf, busy_poll; // 0 = leave the kernel default
+static int sndtimeo_ms = SOCKOPT_SNDTIMEO_MS;
+static FILE *a_log;
+
+static atomic_ulong n_batches, n_batch_frames, n_failed;
+
+int sockopt_parse(char *spec)
+{
+    enum { NODELAY, SNDBUF, RCVBUF, BUSYPOLL, SNDTIMEO };
+    char *const tokens[] = { "nodelay", "sndbuf", "rcvbuf", "busypoll", "sndtimeo", NULL };
+    char *value;
+
+    while (*spec) {
+        int opt = getsubopt(&spec, tokens, &value);
+        if (opt == NODELAY) {
+            nodelay = value ? atoi(value) != 0 : 1;
+            continue;
+        }
+        if (opt < 0 || value == NULL || atoi(value) < 0)
+            return -1;
+        if (opt == SNDBUF)
+            sndbuf = atoi(value);
+        else if (opt == RCVBUF)
+            rcvbuf = atoi(value);
+        else if (opt == SNDTIMEO)
+            sndtimeo_ms = atoi(value);
+        else
+            busy_poll = atoi(value);
+    }
+    return 0;
+}
+
+void sockopt_init(FILE *log)
+{
+    a_log = log;
+}
+
+static void set(int fd, int level, int name, int val)
+{
+    if (setsockopt(fd, level, name, &val, sizeof(val)) < 0)
+        atomic_fetch_add_explicit(&n_failed, 1, memory_order_relaxed);
+}
+
+bool sockopt_is_tcp(int fd)
+{
+    int domain;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+        return false;
+    return domain == AF_INET || domain == AF_INET6;
+}
+
+void sockopt_apply(int fd)
+{
+    if (sndbuf)
+        set(fd, SOL_SOCKET, SO_SNDBUF, sndbuf);
+    if (rcvbuf)
+        set(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf);
+    if (sndtimeo_ms) {
+        // broadcasts write to members from job and fan-out threads; one that
+        // stops reading must not hold them, or the epoch, indefinitely
+        struct timeval tv = { .tv_sec = sndtimeo_ms / 1000, .tv_usec = sndtimeo_ms % 1000 * 1000 };
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+            atomic_fetch_add_explicit(&n_failed, 1, memory_order_relaxed);
+    }
+    if (!sockopt_is_tcp(fd))
+        return;
+    set(fd, IPPROTO_TCP, TCP_NODELAY, nodelay);
+    if (busy_poll)
+        set(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll);
+}
+
+void sockopt_cork(int fd)
+{
+    set(fd, IPPROTO_TCP, TCP_CORK, 1);
+}
+
+void sockopt_uncork(int fd, int frames)
+{
+    set(fd, IPPROTO_TCP, TCP_CORK, 0);
+    if (frames > 0) {
+        atomic_fetch_add_explicit(&n_batches, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&n_batch_frames, frames, memory_order_relaxed);
+    }
+}
+
+void sockopt_report(void)
+{
+    if (a_log == NULL)
+        return;
+    unsigned long batches = atomic_load(&n_batches), frames = atomic_load(&n_batch_frames);
+    fprintf(a_log, "Sockets: nodelay=%d sndbuf=%d rcvbuf=%d busypoll=%d sndtimeo=%dms, %lu corked batches "
+            "(%.1f frames each), %lu failed setsockopt\n", nodelay, sndbuf, rcvbuf, busy_poll,
+            sndtimeo_ms, batches, batches ? (double)frames / batches : 0.0, atomic_load(&n_failed));
+}
@@ -0,0 +1,201 @@
+#include "timer.h"
+#include "clock.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static wtimer_t wheel[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+static uint64_t now_tick;  // last tick processed
+static uint64_t origin_ns; // mono_ns of tick 0
+static unsigned long formed; // batches taken off the wheel, under lock
+static FILE *a_log;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER; // held while a batch runs
+
+static atomic_ulong n_added, n_cancelled, n_expired, n_batches;
+
+static void link_timer(wtimer_t *t)
+{
+    uint64_t delta = t->expires > now_tick ? t->expires - now_tick : 0;
+    uint64_t at = t->expires;
+    int level = 0;
+
+    // pick the finest level whose range covers the delay; clamp at the outermost
+    while (level < TIMER_LEVELS - 1 && delta >= (1ull << ((level + 1) * TIMER_SLOT_BITS)))
+        level++;
+    if (level == TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_LEVELS * TIMER_SLOT_BITS))) {
+        at = now_tick + (1ull << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+        t->expires = at;
+    }
+    // due now or overdue: next tick
+    if (delta == 0)
+        at = now_tick + 1;
+
+    wtimer_t *head = &wheel[level][(at >> (level * TIMER_SLOT_BITS)) & SLOT_MASK];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void unlink_timer(wtimer_t *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timer_add(wtimer_t *t, uint32_t ms, void (*fn)(void *), void *arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    pthread_mutex_lock(&lock);
+    // round up so a timer never fires early
+    t->expires = now_tick + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    link_timer(t);
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&n_added, 1, memory_order_relaxed);
+}
+
+bool timer_cancel(wtimer_t *t)
+{
+    bool pending = false;
+    pthread_mutex_lock(&lock);
+    if (t->next) {
+        unlink_timer(t);
+        pending = true;
+    }
+    pthread_mutex_unlock(&lock);
+    if (pending)
+        atomic_fetch_add_explicit(&n_cancelled, 1, memory_order_relaxed);
+    return pending;
+}
+
+bool timer_cancel_sync(wtimer_t *t)
+{
+    bool pending = false;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        if (t->next) {
+            unlink_timer(t);
+            pending = true;
+        }
+        unsigned long seen = formed;
+        pthread_mutex_unlock(&lock);
+        // a batch that picked t up before we got the lock may still be
+        // running it, and its callback may re-add t: wait it out, then look
+        // again until t is off the wheel and no new batch could hold it
+        pthread_mutex_lock(&run_lock);
+        pthread_mutex_unlock(&run_lock);
+        pthread_mutex_lock(&lock);
+        if (t->next == NULL && formed == seen)
+            break;
+    }
+    pthread_mutex_unlock(&lock);
+    if (pending)
+        atomic_fetch_add_explicit(&n_cancelled, 1, memory_order_relaxed);
+    return pending;
+}
+
+/* Move every timer in one outer slot down to the level it now belongs to */
+static void cascade(int level, int slot)
+{
+    wtimer_t *head = &wheel[level][slot];
+    wtimer_t *t = head->next;
+    head->next = head->prev = head;
+    while (t != head) {
+        wtimer_t *next = t->next;
+        link_timer(t);
+        t = next;
+    }
+}
+
+/* Advance one tick. Called with lock held; returns the expired timers. */
+static wtimer_t *tick(void)
+{
+    now_tick++;
+    for (int level = 1; level < TIMER_LEVELS; ++level) {
+        if (now_tick & ((1ull << (level * TIMER_SLOT_BITS)) - 1))
+            break;
+        cascade(level, (now_tick >> (level * TIMER_SLOT_BITS)) & SLOT_MASK);
+    }
+
+    // detach the due slot as a singly linked batch
+    wtimer_t *head = &wheel[0][now_tick & SLOT_MASK];
+    wtimer_t *batch = NULL;
+    while (head->next != head) {
+        wtimer_t *t = head->next;
+        unlink_timer(t);
+        t->prev = batch; // batch link; t->next stays NULL so t reads as not pending
+        batch = t;
+    }
+    return batch;
+}
+
+static void *wheel_thread(void *arg)
+{
+    // housekeeping only; leave signals to the accept loop
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        uint64_t next_ns = origin_ns + (now_tick + 1) * TIMER_TICK_MS * NS_PER_MS;
+        struct timespec ts = { .tv_sec = next_ns / NS_PER_SEC, .tv_nsec = next_ns % NS_PER_SEC };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        // catch up on every tick that passed, in case we were descheduled
+        uint64_t target = (mono_ns() - origin_ns) / (TIMER_TICK_MS * NS_PER_MS);
+        pthread_mutex_lock(&lock);
+        while (now_tick < target) {
+            wtimer_t *batch = tick();
+            if (batch == NULL)
+                continue;
+            formed++;
+
+            // take run_lock before dropping lock so cancel_sync cannot miss us
+            pthread_mutex_lock(&run_lock);
+            pthread_mutex_unlock(&lock);
+            unsigned long n = 0;
+            while (batch) {
+                wtimer_t *t = batch;
+                batch = t->prev;
+                t->prev = NULL;
+                t->fn(t->arg); // may re-add t
+                n++;
+            }
+            pthread_mutex_unlock(&run_lock);
+            atomic_fetch_add_explicit(&n_expired, n, memory_order_relaxed);
+            atomic_fetch_add_explicit(&n_batches, 1, memory_order_relaxed);
+            pthread_mutex_lock(&lock);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void timer_start(FILE *log)
+{
+    a_log = log;
+    for (int l = 0; l < TIMER_LEVELS; ++l)
+        for (int s = 0; s < TIMER_SLOTS; ++s)
+            wheel[l][s].next = wheel[l][s].prev = &wheel[l][s];
+    origin_ns = mono_ns();
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, wheel_thread, NULL);
+    pthread_detach(tid);
+}
+
+void timer_report(void)
+{
+    if (a_log == NULL)
+        return;
+    fprintf(a_log, "Timers: %lu armed, %lu cancelled, %lu expired in %lu batches\n",
+            atomic_load(&n_added), atomic_load(&n_cancelled),
+            atomic_load(&n_expired), atomic_load(&n_batches));
+}
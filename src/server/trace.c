@@ -0,0 +1,153 @@
+#include "trace.h"
+#include "clock.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Each thread appends to its own buffer without locking; buffers are
+ * registered once in a global list so trace_export can find them. When a
+ * thread exits its buffer, events and all, goes to a spare list for the
+ * next thread to trace, so there are only ever as many buffers as threads
+ * tracing at once. Its events stay under the first owner's tid; owners
+ * never overlap in time.
+ */
+typedef struct trace_buf {
+    trace_ev ev[TRACE_BUF_EVENTS];
+    atomic_uint n;
+    pid_t tid;
+    struct trace_buf *next;  // every buffer
+    struct trace_buf *spare; // buffers with no thread, under bufs_lock
+} trace_buf;
+
+static int sample_every;
+static const char *trace_path;
+static atomic_uint sample_ctr;
+static uint64_t trace_epoch;
+
+static trace_buf *bufs, *spares;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static __thread trace_buf *my_buf;
+static __thread uint32_t cur_id;
+static __thread uint8_t cur_type;
+
+static const char *stage_str[TR_NSTAGES] = {
+    "lock_wait", "read", "queue", "job_lock_wait", "handle", "write"
+};
+
+void trace_init(int every, const char *path)
+{
+    sample_every = every;
+    trace_path = path;
+    trace_epoch = mono_ns();
+}
+
+uint32_t trace_sample(void)
+{
+    if (sample_every <= 0)
+        return 0;
+    unsigned n = atomic_fetch_add_explicit(&sample_ctr, 1, memory_order_relaxed);
+    return n % sample_every == 0 ? n / sample_every + 1 : 0;
+}
+
+/* Thread exit: keep the buffer for the next thread */
+static void trace_buf_put(void *arg)
+{
+    trace_buf *b = arg;
+    pthread_mutex_lock(&bufs_lock);
+    b->spare = spares;
+    spares = b;
+    pthread_mutex_unlock(&bufs_lock);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&exit_key, trace_buf_put);
+}
+
+static trace_buf *trace_buf_get(void)
+{
+    if (my_buf == NULL) {
+        pthread_once(&exit_once, make_key);
+        pthread_mutex_lock(&bufs_lock);
+        if (spares) {
+            my_buf = spares;
+            spares = my_buf->spare;
+        } else if ((my_buf = calloc(1, sizeof(trace_buf))) != NULL) {
+            my_buf->tid = syscall(SYS_gettid);
+            my_buf->next = bufs;
+            bufs = my_buf;
+        }
+        pthread_mutex_unlock(&bufs_lock);
+        if (my_buf)
+            pthread_setspecific(exit_key, my_buf);
+    }
+    return my_buf;
+}
+
+void trace_event(uint32_t id, uint8_t stage, uint8_t msg_type, uint64_t start_ns, uint64_t end_ns)
+{
+    if (id == 0)
+        return;
+
+    trace_buf *b = trace_buf_get();
+    if (b == NULL)
+        return;
+    unsigned n = atomic_load_explicit(&b->n, memory_order_relaxed);
+    if (n == TRACE_BUF_EVENTS)
+        return;
+
+    b->ev[n] = (trace_ev){
+        .start_ns = start_ns, .dur_ns = end_ns > start_ns ? end_ns - start_ns : 0,
+        .id = id, .stage = stage, .msg_type = msg_type
+    };
+    // publish after the event is written so export never sees a torn one
+    atomic_store_explicit(&b->n, n + 1, memory_order_release);
+}
+
+void trace_set_current(uint32_t id, uint8_t msg_type)
+{
+    cur_id = id;
+    cur_type = msg_type;
+}
+
+void trace_write(uint64_t start_ns, uint64_t end_ns)
+{
+    trace_event(cur_id, TR_WRITE, cur_type, start_ns, end_ns);
+}
+
+void trace_export(void)
+{
+    if (sample_every <= 0 || trace_path == NULL)
+        return;
+
+    FILE *f = fopen(trace_path, "we");
+    if (f == NULL)
+        return;
+
+    fprintf(f, "{\"traceEvents\": [\n");
+    int first = 1;
+    pthread_mutex_lock(&bufs_lock);
+    for (trace_buf *b = bufs; b != NULL; b = b->next) {
+        unsigned n = atomic_load_explicit(&b->n, memory_order_acquire);
+        for (unsigned i = 0; i < n; ++i) {
+            trace_ev *e = &b->ev[i];
+            fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"petr\", \"ph\": \"X\", "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, "
+                       "\"args\": {\"req\": %u, \"type\": \"0x%02x\"}}",
+                    first ? "" : ",\n", stage_str[e->stage],
+                    (e->start_ns - trace_epoch) / 1e3, e->dur_ns / 1e3,
+                    getpid(), b->tid, e->id, e->msg_type);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&bufs_lock);
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include "transport.h"
+#include "audit.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (XP_RING_SIZE - 1)
+
+typedef struct {
+    xp_shm *shm;
+    int memfd;
+    int c2s_bell;         // we read, client rings
+    int s2c_bell;         // we ring, client reads
+    bool dropped;         // s2c filled up; under the fd's write lock
+} xp_conn;
+
+static xp_conn **conns; // indexed by fd
+static pthread_mutex_t *wlocks; // indexed by fd: one writer per socket or ring
+static int n_slots;
+static FILE *a_log;
+
+void xp_init(FILE *log)
+{
+    struct rlimit rl;
+    a_log = log;
+    n_slots = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur : 65536;
+    conns = calloc(n_slots, sizeof(xp_conn *));
+    wlocks = malloc(n_slots * sizeof(pthread_mutex_t));
+    for (int i = 0; i < n_slots; ++i)
+        pthread_mutex_init(&wlocks[i], NULL);
+}
+
+static xp_conn *lookup(int fd)
+{
+    return fd >= 0 && fd < n_slots ? conns[fd] : NULL;
+}
+
+static void ring_put(xp_ring *r, uint32_t off, const void *src, uint32_t n)
+{
+    uint32_t at = off & RING_MASK, first = XP_RING_SIZE - at < n ? XP_RING_SIZE - at : n;
+    memcpy(r->data + at, src, first);
+    memcpy(r->data, (const char *)src + first, n - first);
+}
+
+static void ring_get(xp_ring *r, uint32_t off, void *dst, uint32_t n)
+{
+    uint32_t at = off & RING_MASK, first = XP_RING_SIZE - at < n ? XP_RING_SIZE - at : n;
+    memcpy(dst, r->data + at, first);
+    memcpy((char *)dst + first, r->data, n - first);
+}
+
+int xp_attach(int fd, int memfd, int c2s_bell, int s2c_bell)
+{
+    if (fd < 0 || fd >= n_slots)
+        return -1;
+    xp_shm *shm = mmap(NULL, sizeof(xp_shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED)
+        return -1;
+
+    xp_conn *c = malloc(sizeof(xp_conn));
+    *c = (xp_conn){ .shm = shm, .memfd = memfd, .c2s_bell = c2s_bell, .s2c_bell = s2c_bell };
+    conns[fd] = c;
+    return 0;
+}
+
+static int close_fds(int fds[3])
+{
+    for (int i = 0; i < 3; ++i)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    return -1;
+}
+
+int xp_negotiate(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (fd >= n_slots || lookup(fd) || getsockname(fd, (struct sockaddr *)&ss, &len) < 0
+        || ss.ss_family != AF_UNIX)
+        return -1;
+
+    int fds[3];
+    fds[0] = memfd_create("petr_xp", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || ftruncate(fds[0], sizeof(xp_shm)) < 0)
+        return close_fds(fds);
+
+    // writers serialise on wlocks[fd], so none slips a socket frame in
+    // between the attach and the reply
+    pthread_mutex_lock(&wlocks[fd]);
+    if (xp_attach(fd, fds[0], fds[1], fds[2]) < 0) {
+        pthread_mutex_unlock(&wlocks[fd]);
+        return close_fds(fds);
+    }
+
+    // the reply is the last frame on the socket; everything after goes to s2c
+    petr_header h = { .msg_type = XPSHM, .msg_len = 0 };
+    struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(h)) {
+        xp_detach(fd);
+        pthread_mutex_unlock(&wlocks[fd]);
+        return -1;
+    }
+    pthread_mutex_unlock(&wlocks[fd]);
+    if (a_log)
+        audit(AUDIT_EVENT, "Client (FD %d) switched to shared-memory rings\n", fd);
+    return 0;
+}
+
+int xp_fds(int fd, int fds[3])
+{
+    xp_conn *c = lookup(fd);
+    if (c == NULL)
+        return -1;
+    fds[0] = c->memfd;
+    fds[1] = c->c2s_bell;
+    fds[2] = c->s2c_bell;
+    return 0;
+}
+
+void xp_detach(int fd)
+{
+    xp_conn *c = lookup(fd);
+    if (c == NULL)
+        return;
+    conns[fd] = NULL;
+    munmap(c->shm, sizeof(xp_shm));
+    close(c->memfd);
+    close(c->c2s_bell);
+    close(c->s2c_bell);
+    free(c);
+}
+
+/* Whether fd has a send timeout, so that a short write means it ran out */
+static bool has_sndtimeo(int fd)
+{
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    return getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == 0 && (tv.tv_sec || tv.tv_usec);
+}
+
+/* Socket path of xp_write and xp_write_frames: one writev, finished off if it comes up short */
+static int write_frames_sock(int fd, petr_header *h, char **msg, int n)
+{
+    struct iovec iov[2 * n];
+    int cnt = 0;
+    for (int i = 0; i < n; ++i) {
+        iov[cnt++] = (struct iovec){ .iov_base = &h[i], .iov_len = sizeof(h[i]) };
+        if (h[i].msg_len)
+            iov[cnt++] = (struct iovec){ .iov_base = msg[i], .iov_len = h[i].msg_len };
+    }
+
+    struct iovec *v = iov;
+    while (cnt > 0) {
+        ssize_t w = writev(fd, v, cnt);
+        if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        while (w > 0 && cnt > 0 && (size_t)w >= v->iov_len) {
+            w -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt == 0)
+            break;
+
+        // blocking writes only come up short once SO_SNDTIMEO runs out; like
+        // a full ring, the reader is cut off, and the shutdown makes later
+        // writes to it fail at once
+        if (w < 0 || has_sndtimeo(fd)) {
+            if (a_log)
+                audit(AUDIT_ERROR, "Send to client (FD %d) timed out, dropping it\n", fd);
+            shutdown(fd, SHUT_RDWR);
+            return -1;
+        }
+        v->iov_base = (char *)v->iov_base + w;
+        v->iov_len -= w;
+    }
+    return 0;
+}
+
+int xp_write(int fd, petr_header *h, char *msg)
+{
+    if (fd < 0 || fd >= n_slots)
+        return -1;
+    // header and body in one writev, not a write each
+    return xp_write_frames(fd, h, &msg, 1);
+}
+
+int xp_write_frames(int fd, petr_header *h, char **msg, int n)
+{
+    if (fd < 0 || fd >= n_slots)
+        return -1;
+    xp_conn *c = lookup(fd);
+    if (c == NULL) {
+        pthread_mutex_lock(&wlocks[fd]);
+        if (lookup(fd) != NULL) {
+            // xp_negotiate attached while we waited: the socket is done
+            pthread_mutex_unlock(&wlocks[fd]);
+            return xp_write_frames(fd, h, msg, n);
+        }
+        int ret = write_frames_sock(fd, h, msg, n);
+        pthread_mutex_unlock(&wlocks[fd]);
+        return ret;
+    }
+
+    xp_ring *r = &c->shm->s2c;
+    uint32_t need = 0;
+    for (int i = 0; i < n; ++i)
+        need += sizeof(h[i]) + h[i].msg_len;
+    if (need > XP_RING_SIZE)
+        return -1;
+
+    pthread_mutex_lock(&wlocks[fd]);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    // writers may hold buffer_lock, so never wait for room: a reader a
+    // whole ring behind is cut off, and later frames to it are discarded
+    if (c->dropped || tail - atomic_load_explicit(&r->head, memory_order_acquire) > XP_RING_SIZE - need) {
+        bool first = !c->dropped;
+        c->dropped = true;
+        pthread_mutex_unlock(&wlocks[fd]);
+        if (first) {
+            if (a_log)
+                audit(AUDIT_ERROR, "Ring full for client (FD %d), dropping it\n", fd);
+            shutdown(fd, SHUT_RDWR);
+        }
+        return -1;
+    }
+
+    // all frames become visible with one tail update
+    uint32_t off = tail;
+    for (int i = 0; i < n; ++i) {
+        ring_put(r, off, &h[i], sizeof(h[i]));
+        ring_put(r, off + sizeof(h[i]), msg[i], h[i].msg_len);
+        off += sizeof(h[i]) + h[i].msg_len;
+    }
+    atomic_store(&r->tail, tail + need);
+
+    // pairs with the consumer's store to waiting and reload of tail
+    if (atomic_exchange(&r->waiting, 0)) {
+        uint64_t one = 1;
+        write(c->s2c_bell, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&wlocks[fd]);
+    return 0;
+}
+
+int xp_doorbell(int fd)
+{
+    xp_conn *c = lookup(fd);
+    return c ? c->c2s_bell : -1;
+}
+
+bool xp_pending(int fd)
+{
+    xp_conn *c = lookup(fd);
+    if (c == NULL)
+        return false;
+
+    xp_ring *r = &c->shm->c2s;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (atomic_load_explicit(&r->tail, memory_order_acquire) != head)
+        return true;
+
+    atomic_store(&r->waiting, 1);
+    if (atomic_load(&r->tail) != head) {
+        atomic_store(&r->waiting, 0);
+        return true;
+    }
+    return false;
+}
+
+int xp_read(int fd, petr_header *h, char *buf, size_t size)
+{
+    xp_conn *c = lookup(fd);
+    if (c == NULL)
+        return -1;
+
+    xp_ring *r = &c->shm->c2s;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t avail = atomic_load_explicit(&r->tail, memory_order_acquire) - head;
+    if (avail < sizeof(*h))
+        return -1;
+    ring_get(r, head, h, sizeof(*h));
+    if (h->msg_len > size || avail - sizeof(*h) < h->msg_len)
+        return -1;
+    ring_get(r, head + sizeof(*h), buf, h->msg_len);
+    atomic_store_explicit(&r->head, head + sizeof(*h) + h->msg_len, memory_order_release);
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Closed-loop load generator for petr_server, on libpetr.
+ *
+ * Logs in -c clients, has the first -r of them create a room each and
+ * the rest join one, then keeps -w requests in flight per client for -d
+ * seconds: 60% RMSEND, 20% USRSEND to another client, 10% RMLIST and
+ * 10% USRLIST. Reports throughput, request->reply latency and delivered
+ * events. This is the scenario make pgo trains the release build on and
+ * make loadcmp runs against debug and release servers. A server run with
+ * -r caps throughput at its per-user rate limit.
+ */
+#include "clock.h"
+#include "petr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SETUP_BATCH 8 // setup requests in flight, well under the server's queue
+
+typedef struct {
+    petr_conn *pc;
+    int id;
+    int room;
+    uint32_t rng;
+} client_t;
+
+typedef struct {
+    uint64_t *v;
+    size_t n, cap;
+} samples_t;
+
+static client_t *clients;
+static petr_conn **pcs;
+static int n_clients = 50, n_rooms = 5, window = 4;
+static int setup_done;  // setup replies received in the current phase
+static samples_t lat;
+static unsigned long n_sent, n_replies, n_errors, n_events;
+
+static void sample_add(samples_t *s, uint64_t v)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void sample_print(const char *name, samples_t *s)
+{
+    if (s->n == 0) {
+        printf("%-10s no samples\n", name);
+        return;
+    }
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    printf("%-10s n=%zu p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n", name, s->n,
+           s->v[s->n / 2] / 1e3, s->v[s->n * 9 / 10] / 1e3,
+           s->v[s->n * 99 / 100] / 1e3, s->v[s->n - 1] / 1e3);
+}
+
+/* xorshift32, per client so runs are repeatable */
+static uint32_t next_rand(client_t *c)
+{
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+    return c->rng;
+}
+
+static void on_setup(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h == NULL || h->msg_type != OK)
+        n_errors++;
+    setup_done++;
+}
+
+static void on_event(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    n_events++;
+}
+
+/* Reply to a traffic request; arg is its send time */
+static void on_reply(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h == NULL) {
+        n_errors++;
+        return;
+    }
+    sample_add(&lat, mono_ns() - (uint64_t)(uintptr_t)arg);
+    n_replies++;
+    if (h->msg_type == ESERV || (h->msg_type & 0x0f) >= 0x0a)
+        n_errors++;
+}
+
+static void issue(client_t *c)
+{
+    char body[128];
+    void *ts = (void *)(uintptr_t)mono_ns();
+    uint32_t r = next_rand(c) % 100;
+
+    if (r < 60) {
+        snprintf(body, sizeof(body), "room%d\r\nload %u from %d", c->room, next_rand(c), c->id);
+        petr_request_str(c->pc, RMSEND, body, on_reply, ts);
+    } else if (r < 80) {
+        snprintf(body, sizeof(body), "load%d\r\nhello from %d", (c->id + 1) % n_clients, c->id);
+        petr_request_str(c->pc, USRSEND, body, on_reply, ts);
+    } else if (r < 90) {
+        petr_request_str(c->pc, RMLIST, NULL, on_reply, ts);
+    } else {
+        petr_request_str(c->pc, USRLIST, NULL, on_reply, ts);
+    }
+    n_sent++;
+}
+
+/* Poll until every client has count setup replies, or give up after secs */
+static int wait_setup(int count, int secs)
+{
+    uint64_t deadline = mono_ns() + (uint64_t)secs * NS_PER_SEC;
+    while (setup_done < count && mono_ns() < deadline)
+        petr_poll(pcs, n_clients, 10);
+    return setup_done < count ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char usage[] = "%s [-h] [-c CLIENTS] [-r ROOMS] [-d SECS] [-w WINDOW] HOST PORT\n";
+    int secs = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hc:r:d:w:")) != -1) {
+        switch (opt) {
+        case 'h':
+            printf(usage, argv[0]);
+            printf("\n-c CLIENTS\tConnections to open. Default to 50.\n");
+            printf("-r ROOMS\tRooms the clients are spread over. Default to 5.\n");
+            printf("-d SECS\t\tHow long to run. Default to 5.\n");
+            printf("-w WINDOW\tRequests in flight per client. Default to 4.\n");
+            exit(EXIT_SUCCESS);
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'r':
+            n_rooms = atoi(optarg);
+            break;
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 2 > argc || n_clients < 1 || n_rooms < 1 || n_rooms > n_clients || window < 1) {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *host = argv[optind], *port = argv[optind + 1];
+
+    clients = calloc(n_clients, sizeof(client_t));
+    pcs = calloc(n_clients, sizeof(petr_conn *));
+    for (int i = 0; i < n_clients; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "load%d", i);
+        client_t *c = &clients[i];
+        c->id = i;
+        c->room = i % n_rooms;
+        c->rng = 2463534242u + i;
+        c->pc = pcs[i] = petr_connect(host, port, name, on_setup, c);
+        if (c->pc == NULL) {
+            fprintf(stderr, "connect failed for client %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+        petr_set_event_cb(c->pc, on_event, c);
+        petr_set_tagging(c->pc, 1);
+    }
+
+    // log in, then create the rooms, then join them; a few at a time so
+    // admission control has no reason to shed any of it
+    char room[32];
+    if (wait_setup(n_clients, 10) < 0) {
+        fprintf(stderr, "login timed out\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n_clients; ++i) {
+        snprintf(room, sizeof(room), "room%d", clients[i].room);
+        petr_request_str(clients[i].pc, i < n_rooms ? RMCREATE : RMJOIN, room, on_setup, NULL);
+        if ((i + 1) % SETUP_BATCH == 0 || i == n_rooms - 1 || i == n_clients - 1) {
+            if (wait_setup(n_clients + i + 1, 10) < 0) {
+                fprintf(stderr, "room setup timed out\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    unsigned long setup_errors = n_errors;
+    n_errors = 0;
+
+    // closed loop: top every client back up to the window after each poll
+    uint64_t start = mono_ns(), end = start + (uint64_t)secs * NS_PER_SEC;
+    while (mono_ns() < end) {
+        for (int i = 0; i < n_clients; ++i)
+            while (!petr_closed(clients[i].pc) && petr_pending(clients[i].pc) < (size_t)window)
+                issue(&clients[i]);
+        if (petr_poll(pcs, n_clients, 1) == 0)
+            break;
+    }
+    double elapsed = (mono_ns() - start) / 1e9;
+
+    // let the last window come back before counting
+    uint64_t deadline = mono_ns() + 2 * NS_PER_SEC;
+    for (;;) {
+        size_t pending = 0;
+        for (int i = 0; i < n_clients; ++i)
+            if (!petr_closed(pcs[i]))
+                pending += petr_pending(pcs[i]);
+        if (pending == 0 || mono_ns() > deadline)
+            break;
+        petr_poll(pcs, n_clients, 10);
+    }
+
+    printf("%d clients, %d rooms, window %d: %lu requests in %.2fs (%.0f req/s)\n",
+           n_clients, n_rooms, window, n_replies, elapsed, n_replies / elapsed);
+    printf("ok %lu (%.0f req/s), errors %lu (setup %lu), events %lu (%.0f/s)\n",
+           n_replies - n_errors, (n_replies - n_errors) / elapsed, n_errors, setup_errors,
+           n_events, n_events / elapsed);
+    sample_print("latency", &lat);
+
+    for (int i = 0; i < n_clients; ++i)
+        petr_close(pcs[i]);
+    return 0;
+}
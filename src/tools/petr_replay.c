@@ -0,0 +1,254 @@
+/*
+ * Replay a petr_server capture (-c FILE) against a server.
+ *
+ * Frames are sent on one connection per captured conn_id, at their
+ * captured offsets scaled by -s SPEED, or back to back with -m. Reports
+ * request->response latency and RMSEND->RMRECV / USRSEND->USRRECV
+ * delivery latency. Connections are libpetr clients on one thread, so
+ * requests are pipelined, tagged with REQID and written in batches; HOST
+ * may be the server's -U socket path.
+ */
+#include "capture.h"
+#include "clock.h"
+#include "petr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DELIV_SLOTS 65536
+
+typedef struct {
+    petr_conn *pc;
+    char name[256];
+} conn_t;
+
+typedef struct {
+    uint64_t *v;
+    size_t n, cap;
+} samples_t;
+
+static conn_t *conns;     // indexed by conn_id
+static petr_conn **pcs;   // same order, for petr_poll
+static uint32_t n_conns;
+
+static uint64_t deliv_ts[DELIV_SLOTS]; // send time by payload hash
+static samples_t resp_lat, deliv_lat;
+static unsigned long n_sent, n_resp, n_deliv, n_errors;
+
+static void sample_add(samples_t *s, uint64_t v)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void sample_print(const char *name, samples_t *s)
+{
+    if (s->n == 0) {
+        printf("%-10s no samples\n", name);
+        return;
+    }
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    printf("%-10s n=%zu p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n", name, s->n,
+           s->v[s->n / 2] / 1e3, s->v[s->n * 9 / 10] / 1e3,
+           s->v[s->n * 99 / 100] / 1e3, s->v[s->n - 1] / 1e3);
+}
+
+/* FNV-1a of a delivered payload, slot in deliv_ts */
+static uint32_t hash_str(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s)
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    return h % DELIV_SLOTS;
+}
+
+/* Reply to a request; arg is its send time */
+static void on_reply(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h == NULL) {
+        n_errors++;
+        return;
+    }
+    sample_add(&resp_lat, mono_ns() - (uint64_t)(uintptr_t)arg);
+    n_resp++;
+    if (h->msg_type == ESERV || (h->msg_type & 0x0f) >= 0x0a)
+        n_errors++;
+}
+
+static void on_event(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h->msg_type == RMRECV || h->msg_type == USRRECV) {
+        // RMRECV is "room\r\nfrom\r\nmsg", USRRECV is "from\r\nmsg"
+        uint32_t slot = hash_str(body);
+        if (deliv_ts[slot])
+            sample_add(&deliv_lat, mono_ns() - deliv_ts[slot]);
+        n_deliv++;
+    }
+}
+
+static void send_frame(cap_rec *r, char *payload, const char *host, const char *port)
+{
+    if (r->conn_id >= n_conns) {
+        conns = realloc(conns, (r->conn_id + 1) * sizeof(conn_t));
+        pcs = realloc(pcs, (r->conn_id + 1) * sizeof(petr_conn *));
+        memset(conns + n_conns, 0, (r->conn_id + 1 - n_conns) * sizeof(conn_t));
+        memset(pcs + n_conns, 0, (r->conn_id + 1 - n_conns) * sizeof(petr_conn *));
+        n_conns = r->conn_id + 1;
+    }
+    conn_t *c = &conns[r->conn_id];
+    uint64_t now = mono_ns();
+    void *ts = (void *)(uintptr_t)now;
+
+    if (r->msg_type == REQID)
+        return; // libpetr tags every request itself
+
+    if (r->msg_type == CAPTURE_CLOSE) {
+        // half close; replies to what was sent still come in
+        if (c->pc)
+            petr_shutdown(c->pc);
+        return;
+    }
+
+    if (c->pc == NULL) {
+        // libpetr logs in as part of connecting; a capture that starts
+        // mid-session gets a stand-in name
+        if (r->msg_type == LOGIN) {
+            // just the name: a captured resume token ("name\r\ntoken") is
+            // stale by now, so replay logs in afresh
+            char *sep = memchr(payload, '\r', r->msg_len);
+            int n = sep ? (int)(sep - payload) : (int)r->msg_len;
+            snprintf(c->name, sizeof(c->name), "%.*s", n, payload);
+        } else
+            snprintf(c->name, sizeof(c->name), "conn%u", r->conn_id);
+        c->pc = petr_connect(host, port, c->name, on_reply, ts);
+        if (c->pc == NULL) {
+            fprintf(stderr, "connect failed for conn %u\n", r->conn_id);
+            return;
+        }
+        petr_set_event_cb(c->pc, on_event, c);
+        petr_set_tagging(c->pc, 1);
+        pcs[r->conn_id] = c->pc;
+        n_sent++;
+        if (r->msg_type == LOGIN)
+            return;
+    }
+
+    if (r->msg_type == RMSEND || r->msg_type == USRSEND || r->msg_type == USRMSEND) {
+        // expected delivery payload, keyed the way on_event hashes it
+        char *sep = memchr(payload, '\r', r->msg_len);
+        if (sep) {
+            char key[2048];
+            if (r->msg_type == RMSEND)
+                snprintf(key, sizeof(key), "%.*s\r\n%s\r\n%s", (int)(sep - payload), payload, c->name, sep + 2);
+            else
+                snprintf(key, sizeof(key), "%s\r\n%s", c->name, sep + 2);
+            deliv_ts[hash_str(key)] = now;
+        }
+    }
+
+    if (petr_request(c->pc, r->msg_type, payload, r->msg_len, on_reply, ts) == 0)
+        n_sent++;
+}
+
+static size_t outstanding(void)
+{
+    size_t n = 0;
+    for (uint32_t i = 0; i < n_conns; ++i)
+        if (pcs[i] && !petr_closed(pcs[i]))
+            n += petr_pending(pcs[i]);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    const char usage[] = "%s [-h] [-s SPEED] [-m] HOST PORT CAPTURE_FILE\n";
+    double speed = 1.0;
+    int max_speed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hs:m")) != -1) {
+        switch (opt) {
+        case 'h':
+            printf(usage, argv[0]);
+            printf("\n-s SPEED\tReplay N times faster than captured. Default to 1.\n");
+            printf("-m\t\tReplay as fast as possible, ignoring timestamps.\n");
+            exit(EXIT_SUCCESS);
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'm':
+            max_speed = 1;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 3 > argc || speed <= 0) {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *host = argv[optind], *port = argv[optind + 1];
+
+    FILE *f = fopen(argv[optind + 2], "r");
+    cap_file_hdr fh;
+    if (f == NULL || fread(&fh, sizeof(fh), 1, f) != 1 || fh.magic != CAPTURE_MAGIC
+        || fh.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind + 2]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = mono_ns();
+    cap_rec r;
+    char *payload = NULL;
+    size_t payload_cap = 0;
+    unsigned long n_read = 0;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.msg_len + 1 > payload_cap) {
+            payload_cap = r.msg_len + 1;
+            payload = realloc(payload, payload_cap);
+        }
+        if (r.msg_len && fread(payload, 1, r.msg_len, f) != r.msg_len)
+            break;
+        payload[r.msg_len] = '\0';
+
+        if (max_speed) {
+            // let a batch of requests queue up between polls
+            if (++n_read % 64 == 0)
+                petr_poll(pcs, n_conns, 0);
+        } else {
+            // service replies while waiting for the frame's turn
+            uint64_t due = start + (uint64_t)(r.t_ns / speed);
+            do {
+                uint64_t now = mono_ns();
+                petr_poll(pcs, n_conns, due > now ? (due - now) / NS_PER_MS : 0);
+            } while (mono_ns() < due);
+        }
+        send_frame(&r, payload, host, port);
+    }
+    fclose(f);
+
+    // give in-flight requests a moment to be answered
+    uint64_t elapsed = mono_ns() - start;
+    uint64_t deadline = mono_ns() + 2 * NS_PER_SEC;
+    while (outstanding() && mono_ns() < deadline)
+        petr_poll(pcs, n_conns, 10);
+    petr_poll(pcs, n_conns, 10); // late deliveries
+
+    printf("replayed %lu frames on %u connections in %.3fs (%.0f frames/s)\n",
+           n_sent, n_conns ? n_conns - 1 : 0, elapsed / 1e9, n_sent / (elapsed / 1e9));
+    printf("responses %lu (errors %lu), deliveries %lu\n", n_resp, n_errors, n_deliv);
+    sample_print("response", &resp_lat);
+    sample_print("delivery", &deliv_lat);
+    return 0;
+}
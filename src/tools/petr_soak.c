@@ -0,0 +1,585 @@
+/*
+ * Soak driver for petr_server, on libpetr: churn and slow consumers
+ * together, for tens of minutes, with SLOs checked as it goes.
+ *
+ * Three populations share the server over loopback:
+ *  - -m members spread over -b bursty rooms. Every few seconds each room
+ *    gets a burst of -k RMSENDs from random members, stamped with the send
+ *    time, and members time every RMRECV against its stamp.
+ *  - -c churners log in, join a bursty room, every other cycle create a
+ *    room of their own, send, and after a while delete that room or not,
+ *    then LOGOUT or just drop the connection, and start over under the
+ *    same name. This is what walks logout's room loop and removeByIndex.
+ *  - -s slow clients join every bursty room, shrink their receive buffer
+ *    and never read again, so broadcasts to them back up in the server.
+ *
+ * Every -i seconds it prints one line: open connections, logins, logouts
+ * and drops, rooms created and deleted, messages sent and delivered, the
+ * interval's delivery latency percentiles, replies shed (ESERV) and
+ * failed and, with -p, the server's RSS and open fds from /proc. SLOs
+ * given with -S are checked every interval: p99 and max latency, error
+ * and shed rates, and RSS and fd growth since the first interval. Each
+ * breach is printed; any makes the exit status 1. An interval in which
+ * messages were sent but none delivered is a breach whatever the SLOs, and
+ * so is a server that -p can no longer find, which also ends the run. A
+ * server run with -r shows its per-user rate limit as shed requests.
+ */
+#include "clock.h"
+#include "petr.h"
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SETUP_BATCH 8     // setup requests in flight, well under the server's queue
+#define SLOW_RCVBUF 4096  // so slow clients back up after a few bursts
+#define MEMBER_WINDOW 64  // a member stops bursting this far behind on replies
+#define STAMP "soak "     // message prefix, followed by the mono ns send time
+
+typedef struct {
+    uint64_t *v;
+    size_t n, cap;
+} samples_t;
+
+typedef struct {
+    petr_conn *pc;
+    int id;
+    uint32_t rng;
+} member_t;
+
+enum { CH_IDLE, CH_LOGIN, CH_ON, CH_LEAVING };
+
+typedef struct {
+    petr_conn *pc;
+    int id;
+    int state;
+    bool own_room;  // created churnroom<id> this cycle
+    uint64_t at;    // next step, mono ns
+    uint32_t rng;
+} churner_t;
+
+static const char *host, *port;
+static int n_members = 40, n_rooms = 4, n_churn = 20, n_slow = 4, burst = 50;
+static int server_pid;
+
+static member_t *members, *slow;
+static churner_t *churners;
+static uint64_t *next_burst; // per room
+static int setup_done;
+static bool dropping; // requests failing because we cut their connection
+
+// counts for the current interval
+static struct {
+    unsigned long logins, logouts, drops, conflicts, created, deleted;
+    unsigned long sent, delivered, replies, shed, errors;
+} cnt;
+static samples_t lat, lat_all;
+
+// SLOs, < 0 = unchecked
+static struct {
+    double p99_ms, max_ms, errors_pct, shed_pct, rss_mb;
+    long fds;
+} slo = { -1, -1, -1, -1, -1, -1 };
+static int breaches;
+
+static void sample_add(samples_t *s, uint64_t v)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort s and return its q quantile in ms, 0 if empty */
+static double quantile_ms(samples_t *s, double q)
+{
+    if (s->n == 0)
+        return 0;
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    size_t i = (size_t)(q * s->n);
+    return s->v[i < s->n ? i : s->n - 1] / 1e6;
+}
+
+/* xorshift32 */
+static uint32_t next_rand(uint32_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return *rng;
+}
+
+/* "p99=MS,max=MS,errors=PCT,shed=PCT,rss=MB,fds=N" */
+static int parse_slos(char *spec)
+{
+    for (char *kv = strtok(spec, ","); kv != NULL; kv = strtok(NULL, ",")) {
+        char *eq = strchr(kv, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (strcmp(kv, "p99") == 0)
+            slo.p99_ms = v;
+        else if (strcmp(kv, "max") == 0)
+            slo.max_ms = v;
+        else if (strcmp(kv, "errors") == 0)
+            slo.errors_pct = v;
+        else if (strcmp(kv, "shed") == 0)
+            slo.shed_pct = v;
+        else if (strcmp(kv, "rss") == 0)
+            slo.rss_mb = v;
+        else if (strcmp(kv, "fds") == 0)
+            slo.fds = (long)v;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+/* Server RSS in MB from /proc, -1 if unknown */
+static double server_rss_mb(void)
+{
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/status", server_pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    double mb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            mb = atol(line + 6) / 1024.0;
+    fclose(f);
+    return mb;
+}
+
+/* Server open fds, -1 if unknown */
+static long server_fds(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", server_pid);
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return -1;
+    long n = 0;
+    for (struct dirent *e; (e = readdir(d)) != NULL;)
+        n += e->d_name[0] != '.';
+    closedir(d);
+    return n;
+}
+
+/* ESERV is the server shedding load, which clients retry; the rest are errors */
+static void count_reply(petr_header *h)
+{
+    cnt.replies++;
+    if (h && h->msg_type == ESERV)
+        cnt.shed++;
+    else if ((h == NULL && !dropping) || (h && (h->msg_type & 0x0f) >= 0x0a))
+        cnt.errors++;
+}
+
+static void on_setup(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h == NULL || h->msg_type != OK)
+        cnt.errors++;
+    setup_done++;
+}
+
+static void on_reply(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    count_reply(h);
+}
+
+/* RMRECV "room\r\nfrom\r\nsoak <ns> ...": time its delivery */
+static void on_event(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    if (h->msg_type != RMRECV)
+        return;
+    char *stamp = strstr(body, "\r\n" STAMP);
+    if (stamp == NULL)
+        return;
+    uint64_t sent = strtoull(stamp + 2 + strlen(STAMP), NULL, 10);
+    uint64_t now = mono_ns();
+    sample_add(&lat, now - sent);
+    sample_add(&lat_all, now - sent);
+    cnt.delivered++;
+}
+
+static void send_stamped(petr_conn *pc, int room, int from)
+{
+    char body[128];
+    snprintf(body, sizeof(body), "burst%d\r\n" STAMP "%lu from %d", room, (unsigned long)mono_ns(), from);
+    petr_request_str(pc, RMSEND, body, on_reply, NULL);
+    cnt.sent++;
+}
+
+/* Joined: only now send, RMSEND can overtake RMJOIN in the server's queue */
+static void on_churn_joined(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    count_reply(h);
+    if (h && h->msg_type == OK)
+        send_stamped(pc, (int)(intptr_t)arg, -1);
+}
+
+static void on_room_created(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    churner_t *ch = arg;
+    count_reply(h);
+    if (h && h->msg_type == OK) {
+        ch->own_room = true;
+        cnt.created++;
+    }
+}
+
+static void on_room_deleted(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    count_reply(h);
+    if (h && h->msg_type == OK)
+        cnt.deleted++;
+}
+
+static void on_logout(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    count_reply(h);
+    if (h && h->msg_type == OK)
+        cnt.logouts++;
+}
+
+static void on_churn_login(petr_conn *pc, petr_header *h, char *body, void *arg)
+{
+    churner_t *ch = arg;
+    uint64_t now = mono_ns();
+    if (h == NULL || h->msg_type != OK) {
+        // EUSREXISTS: our dropped connection has not been reaped yet
+        if (h && h->msg_type == EUSREXISTS)
+            cnt.conflicts++;
+        else
+            cnt.errors++;
+        ch->state = CH_LEAVING;
+        return;
+    }
+    cnt.logins++;
+    ch->state = CH_ON;
+    ch->own_room = false;
+    ch->at = now + (200 + next_rand(&ch->rng) % 1800) * NS_PER_MS;
+
+    int room = next_rand(&ch->rng) % n_rooms;
+    char name[32];
+    snprintf(name, sizeof(name), "burst%d", room);
+    petr_request_str(pc, RMJOIN, name, on_churn_joined, (void *)(intptr_t)room);
+    if (next_rand(&ch->rng) % 2) {
+        snprintf(name, sizeof(name), "churnroom%d", ch->id);
+        petr_request_str(pc, RMCREATE, name, on_room_created, ch);
+    }
+}
+
+static void churn_start(churner_t *ch)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "churn%d", ch->id);
+    ch->pc = petr_connect(host, port, name, on_churn_login, ch);
+    if (ch->pc == NULL) {
+        cnt.errors++;
+        ch->at = mono_ns() + 100 * NS_PER_MS;
+        return;
+    }
+    petr_set_event_cb(ch->pc, on_event, ch);
+    petr_set_tagging(ch->pc, 1);
+    ch->state = CH_LOGIN;
+}
+
+/* Move a churner along; never from its own callbacks, as it may close */
+static void churn_step(churner_t *ch, uint64_t now)
+{
+    switch (ch->state) {
+    case CH_IDLE:
+        if (now >= ch->at)
+            churn_start(ch);
+        break;
+    case CH_LOGIN:
+        if (petr_closed(ch->pc)) {
+            cnt.errors++;
+            ch->state = CH_LEAVING;
+        }
+        break;
+    case CH_ON:
+        if (now < ch->at && !petr_closed(ch->pc))
+            break;
+        if (ch->own_room && next_rand(&ch->rng) % 2) {
+            char name[32];
+            snprintf(name, sizeof(name), "churnroom%d", ch->id);
+            petr_request_str(ch->pc, RMDELETE, name, on_room_deleted, NULL);
+        }
+        if (next_rand(&ch->rng) % 2) {
+            petr_request_str(ch->pc, LOGOUT, NULL, on_logout, NULL);
+            ch->state = CH_LEAVING;
+            break;
+        }
+        petr_flush(ch->pc); // the RMDELETE still goes, its reply will not come back
+        dropping = true;
+        petr_close(ch->pc); // drop: the server parks or logs us out
+        dropping = false;
+        ch->pc = NULL;
+        cnt.drops++;
+        ch->state = CH_IDLE;
+        ch->at = now + (50 + next_rand(&ch->rng) % 450) * NS_PER_MS;
+        break;
+    case CH_LEAVING:
+        if (!petr_closed(ch->pc) && petr_pending(ch->pc) > 0)
+            break;
+        petr_close(ch->pc);
+        ch->pc = NULL;
+        ch->state = CH_IDLE;
+        ch->at = now + (50 + next_rand(&ch->rng) % 450) * NS_PER_MS;
+        break;
+    }
+}
+
+/* Bursts from random members of each room that is due one */
+static void bursts(uint64_t now)
+{
+    for (int r = 0; r < n_rooms; ++r) {
+        if (now < next_burst[r])
+            continue;
+        uint32_t rng = (uint32_t)now | 1;
+        for (int k = 0; k < burst; ++k) {
+            // members of room r are r, r + n_rooms, ...
+            int per_room = (n_members - r + n_rooms - 1) / n_rooms;
+            member_t *m = &members[r + n_rooms * (next_rand(&rng) % per_room)];
+            if (!petr_closed(m->pc) && petr_pending(m->pc) < MEMBER_WINDOW)
+                send_stamped(m->pc, r, m->id);
+        }
+        next_burst[r] = now + (1000 + next_rand(&rng) % 4000) * NS_PER_MS;
+    }
+}
+
+/* Poll conns until setup_done reaches count, or give up after secs */
+static int wait_setup(petr_conn **conns, int n, int count, int secs)
+{
+    uint64_t deadline = mono_ns() + (uint64_t)secs * NS_PER_SEC;
+    while (setup_done < count && mono_ns() < deadline)
+        petr_poll(conns, n, 10);
+    return setup_done < count ? -1 : 0;
+}
+
+static void breach(double t, const char *what, double value, double limit)
+{
+    printf("SLO breach at %.0fs: %s %.2f > %.2f\n", t, what, value, limit);
+    breaches++;
+}
+
+int main(int argc, char *argv[])
+{
+    const char usage[] = "%s [-h] [-d SECS] [-i SECS] [-m MEMBERS] [-b ROOMS] [-k BURST] [-c CHURNERS] "
+                         "[-s SLOW] [-p PID] [-S SLOS] HOST PORT\n";
+    int secs = 1200, interval = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hd:i:m:b:k:c:s:p:S:")) != -1) {
+        switch (opt) {
+        case 'h':
+            printf(usage, argv[0]);
+            printf("\n-d SECS\t\tHow long to run. Default to 1200.\n");
+            printf("-i SECS\t\tReport and check SLOs this often. Default to 10.\n");
+            printf("-m MEMBERS\tLong-lived clients in the bursty rooms. Default to 40.\n");
+            printf("-b ROOMS\tBursty rooms. Default to 4.\n");
+            printf("-k BURST\tMessages per burst, one every 1-5s per room. Default to 50.\n");
+            printf("-c CHURNERS\tClients logging in and out over and over. Default to 20.\n");
+            printf("-s SLOW\t\tClients in every bursty room that never read. Default to 4.\n");
+            printf("-p PID\t\tServer process, for its RSS and fd count.\n");
+            printf("-S SLOS\t\tFail past any of p99=MS,max=MS,errors=PCT,shed=PCT,rss=MB,fds=N; shed\n"
+                   "\t\tis ESERV replies, rss and fds are growth since the first interval and need -p.\n");
+            exit(EXIT_SUCCESS);
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'm':
+            n_members = atoi(optarg);
+            break;
+        case 'b':
+            n_rooms = atoi(optarg);
+            break;
+        case 'k':
+            burst = atoi(optarg);
+            break;
+        case 'c':
+            n_churn = atoi(optarg);
+            break;
+        case 's':
+            n_slow = atoi(optarg);
+            break;
+        case 'p':
+            server_pid = atoi(optarg);
+            break;
+        case 'S':
+            if (parse_slos(optarg) < 0) {
+                fprintf(stderr, "Invalid SLOs\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 2 > argc || n_rooms < 1 || n_members < n_rooms || n_churn < 0 || n_slow < 0 ||
+        interval < 1 || ((slo.rss_mb >= 0 || slo.fds >= 0) && server_pid == 0)) {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    // members and slow clients log in; the first n_rooms members create
+    // the rooms, then everyone else joins, a few at a time
+    int n_setup = n_members + n_slow;
+    petr_conn **setup = calloc(n_setup, sizeof(petr_conn *));
+    members = calloc(n_members, sizeof(member_t));
+    slow = calloc(n_slow ? n_slow : 1, sizeof(member_t));
+    for (int i = 0; i < n_setup; ++i) {
+        char name[32];
+        member_t *m = i < n_members ? &members[i] : &slow[i - n_members];
+        snprintf(name, sizeof(name), i < n_members ? "member%d" : "slow%d", i < n_members ? i : i - n_members);
+        m->id = i;
+        m->rng = 2463534242u + i;
+        m->pc = setup[i] = petr_connect(host, port, name, on_setup, m);
+        if (m->pc == NULL) {
+            fprintf(stderr, "connect failed for %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+        if (i >= n_members) {
+            int rcvbuf = SLOW_RCVBUF;
+            setsockopt(petr_fd(m->pc), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        petr_set_event_cb(m->pc, on_event, m);
+        petr_set_tagging(m->pc, 1);
+    }
+    if (wait_setup(setup, n_setup, n_setup, 10) < 0) {
+        fprintf(stderr, "login timed out\n");
+        exit(EXIT_FAILURE);
+    }
+    int expect = n_setup;
+    for (int i = 0; i < n_setup; ++i) {
+        char room[32];
+        int joins = i < n_members ? 1 : n_rooms;
+        for (int r = 0; r < joins; ++r) {
+            int which = i < n_members ? i % n_rooms : r;
+            snprintf(room, sizeof(room), "burst%d", which);
+            petr_request_str(setup[i], i < n_rooms ? RMCREATE : RMJOIN, room, on_setup, NULL);
+            expect++;
+        }
+        if ((i + 1) % SETUP_BATCH == 0 || i == n_rooms - 1 || i == n_setup - 1) {
+            if (wait_setup(setup, n_setup, expect, 10) < 0) {
+                fprintf(stderr, "room setup timed out\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (cnt.errors) {
+        fprintf(stderr, "%lu setup requests failed\n", cnt.errors);
+        exit(EXIT_FAILURE);
+    }
+    memset(&cnt, 0, sizeof(cnt));
+
+    // from here on slow clients are never polled again
+    churners = calloc(n_churn ? n_churn : 1, sizeof(churner_t));
+    for (int i = 0; i < n_churn; ++i) {
+        churners[i].id = i;
+        churners[i].rng = 88172645u + i;
+    }
+    next_burst = calloc(n_rooms, sizeof(uint64_t));
+    petr_conn **pcs = calloc(n_members + n_churn, sizeof(petr_conn *));
+
+    printf("%d members in %d rooms, bursts of %d, %d churners, %d slow clients, %ds\n",
+           n_members, n_rooms, burst, n_churn, n_slow, secs);
+    uint64_t start = mono_ns(), end = start + (uint64_t)secs * NS_PER_SEC;
+    uint64_t next_report = start + (uint64_t)interval * NS_PER_SEC;
+    double rss0 = -1;
+    long fds0 = -1;
+    for (uint64_t now = start; now < end; now = mono_ns()) {
+        bursts(now);
+        for (int i = 0; i < n_churn; ++i)
+            churn_step(&churners[i], now);
+
+        int n = 0, open = 0;
+        for (int i = 0; i < n_members; ++i)
+            pcs[n++] = members[i].pc;
+        for (int i = 0; i < n_churn; ++i)
+            pcs[n++] = churners[i].pc;
+        open = petr_poll(pcs, n, 5);
+
+        if (mono_ns() < next_report)
+            continue;
+        next_report += (uint64_t)interval * NS_PER_SEC;
+        double t = (mono_ns() - start) / 1e9;
+        double p50 = quantile_ms(&lat, 0.5), p99 = quantile_ms(&lat, 0.99), max = quantile_ms(&lat, 1);
+        double rss = server_pid ? server_rss_mb() : -1;
+        long fds = server_pid ? server_fds() : -1;
+        printf("t=%.0fs conns=%d logins=%lu logouts=%lu drops=%lu conflicts=%lu rooms+=%lu rooms-=%lu "
+               "sent=%lu delivered=%lu p50=%.2fms p99=%.2fms max=%.2fms shed=%lu errors=%lu",
+               t, open + n_slow, cnt.logins, cnt.logouts, cnt.drops, cnt.conflicts, cnt.created,
+               cnt.deleted, cnt.sent, cnt.delivered, p50, p99, max, cnt.shed, cnt.errors);
+        if (server_pid)
+            printf(" rss=%.1fMB fds=%ld", rss, fds);
+        printf("\n");
+        fflush(stdout);
+
+        // a dead or wedged server makes every other number look fine
+        if (server_pid && (rss < 0 || fds < 0)) {
+            printf("SLO breach at %.0fs: server %d is gone\n", t, server_pid);
+            breaches++;
+            break;
+        }
+        if (cnt.sent > 0 && cnt.delivered == 0) {
+            printf("SLO breach at %.0fs: %lu sent, none delivered\n", t, cnt.sent);
+            breaches++;
+        }
+        if (slo.p99_ms >= 0 && p99 > slo.p99_ms)
+            breach(t, "p99 delivery ms", p99, slo.p99_ms);
+        if (slo.max_ms >= 0 && max > slo.max_ms)
+            breach(t, "max delivery ms", max, slo.max_ms);
+        double err_pct = cnt.replies ? 100.0 * cnt.errors / cnt.replies : 0;
+        double shed_pct = cnt.replies ? 100.0 * cnt.shed / cnt.replies : 0;
+        if (slo.errors_pct >= 0 && err_pct > slo.errors_pct)
+            breach(t, "error %", err_pct, slo.errors_pct);
+        if (slo.shed_pct >= 0 && shed_pct > slo.shed_pct)
+            breach(t, "shed %", shed_pct, slo.shed_pct);
+        if (rss0 < 0) {
+            rss0 = rss;
+            fds0 = fds;
+        } else {
+            if (slo.rss_mb >= 0 && rss - rss0 > slo.rss_mb)
+                breach(t, "RSS growth MB", rss - rss0, slo.rss_mb);
+            if (slo.fds >= 0 && fds - fds0 > slo.fds)
+                breach(t, "fd growth", fds - fds0, slo.fds);
+        }
+        lat.n = 0;
+        memset(&cnt, 0, sizeof(cnt));
+    }
+
+    printf("delivery over the run: n=%zu p50=%.2fms p99=%.2fms p99.9=%.2fms max=%.2fms\n", lat_all.n,
+           quantile_ms(&lat_all, 0.5), quantile_ms(&lat_all, 0.99), quantile_ms(&lat_all, 0.999),
+           quantile_ms(&lat_all, 1));
+    printf("%s: %d SLO breaches\n", breaches ? "FAIL" : "PASS", breaches);
+
+    for (int i = 0; i < n_members; ++i)
+        petr_close(members[i].pc);
+    for (int i = 0; i < n_slow; ++i)
+        petr_close(slow[i].pc);
+    for (int i = 0; i < n_churn; ++i)
+        if (churners[i].pc)
+            petr_close(churners[i].pc);
+    return breaches ? EXIT_FAILURE : EXIT_SUCCESS;
+}